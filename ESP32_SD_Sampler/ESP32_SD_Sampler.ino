@@ -25,10 +25,12 @@
 #include <Arduino.h>
 #include "config.h"
 #include "misc.h"
+#include "block_device.h"
 #include "sdmmc.h"
 #include <vector>
 #include "sampler.h"
 #include "fx_reverb.h"
+#include "storage_bench.h"
 #include <MIDI.h>
 
 
@@ -72,6 +74,7 @@ MIDI_NAMESPACE::MidiInterface<MIDI_NAMESPACE::SerialMIDI<HardwareSerial, Serial2
 
 
 // =============================================================== MAIN oobjects ===============================================================
+SdmmcDevice     SdCard;
 SDMMC_FAT32     Card;
 SamplerEngine   Sampler;
 FxReverb        Reverb;
@@ -79,80 +82,60 @@ FxReverb        Reverb;
 // =============================================================== GLOBALS ===============================================================
 TaskHandle_t SynthTask;
 TaskHandle_t ControlTask;
-static volatile int DRAM_ATTR WORD_ALIGNED_ATTR out_buf_id = 0;
-static volatile int DRAM_ATTR WORD_ALIGNED_ATTR gen_buf_id = 1;
-static float DRAM_ATTR WORD_ALIGNED_ATTR sampler_l[2][DMA_BUF_LEN];     // sampler L buffer
-static float DRAM_ATTR WORD_ALIGNED_ATTR sampler_r[2][DMA_BUF_LEN];     // sampler R buffer
-static float DRAM_ATTR WORD_ALIGNED_ATTR mix_buf_l[2][DMA_BUF_LEN];     // mix L channel
-static float DRAM_ATTR WORD_ALIGNED_ATTR mix_buf_r[2][DMA_BUF_LEN];     // mix R channel
-static int16_t DRAM_ATTR WORD_ALIGNED_ATTR out_buf[2][DMA_BUF_LEN * 2];        // i2s L+R output buffer
+// one set: the block is generated, mixed and handed to the I2S driver, which copies it into its DMA buffers, before the next one starts
+static mix_t DRAM_ATTR WORD_ALIGNED_ATTR sampler_l[MAX_BLOCK_LEN];     // sampler L buffer
+static mix_t DRAM_ATTR WORD_ALIGNED_ATTR sampler_r[MAX_BLOCK_LEN];     // sampler R buffer
+static int16_t DRAM_ATTR WORD_ALIGNED_ATTR out_buf[MAX_BLOCK_LEN * 2];        // i2s L+R output buffer, mixer() writes it
+static int audioBlockLen = DMA_BUF_LEN;   // samples per block and I2S buffer, the audio task changes them with Sampler.getBlockLen()
+static int audioDmaBufs = DMA_NUM_BUF;
 
 
 // =============================================================== forward declarations ===============================================================
-static  void IRAM_ATTR mixer() ;
-static  void IRAM_ATTR i2s_output();
-static  void IRAM_ATTR sampler_generate_buf();
+static  void IRAM_ATTR mixer(int n) ;
+static  void IRAM_ATTR i2s_output(int n);
+static  void IRAM_ATTR sampler_generate_buf(int n);
 
 // =============================================================== PER CORE TASKS ===============================================================
 static void IRAM_ATTR audio_task(void *userData) { // core 0 task
   DEBUG ("core 0 audio task run");
   vTaskDelay(20);
   volatile uint32_t WORD_ALIGNED_ATTR t1,t2,t3,t4;
-  out_buf_id = 0;
-  gen_buf_id = 1;
   
   while (true) {
-#ifdef DEBUG_CORE_TIME 
-    t1=micros();
-#endif
-
-    sampler_generate_buf();
-    
-#ifdef DEBUG_CORE_TIME 
-    t2=micros();
-#endif
-
-    mixer(); 
-    
-#ifdef DEBUG_CORE_TIME 
-    t3=micros();
-#endif
-
-    i2s_output();
-    
-#ifdef DEBUG_CORE_TIME 
-    t4=micros();
-    DEBF("gen=%d, mix=%d, output=%d, total=%d\r\n", t2-t1, t3-t2, t4-t3, t4-t1);
-#endif
+    if (Sampler.getBlockLen() != audioBlockLen || Sampler.getDmaBufs() != audioDmaBufs) {
+      // a sample set with another block size: I2S starts over with it, between the blocks
+      i2sDeinit();
+      audioBlockLen = Sampler.getBlockLen();
+      audioDmaBufs = Sampler.getDmaBufs();
+      i2sInit();
+      Sampler.blockChanged(audioBlockLen, audioDmaBufs);
+    }
+    const int n = audioBlockLen;
 
-    out_buf_id = 1;
-    gen_buf_id = 0;
-    
 #ifdef DEBUG_CORE_TIME 
     t1=micros();
 #endif
 
-    sampler_generate_buf();
+    sampler_generate_buf(n);
     
 #ifdef DEBUG_CORE_TIME 
     t2=micros();
 #endif
 
-    mixer(); 
+    mixer(n); // effects, master, clipper and the 16 bit frames in one pass
     
 #ifdef DEBUG_CORE_TIME 
     t3=micros();
 #endif
 
-    i2s_output();
+    i2s_output(n);
+    // the block has taken the place of the one that just finished playing, the others are queued before it
+    Sampler.blockOut(micros() + (uint32_t)((float)((audioDmaBufs - 1) * n) * US_PER_SAMPLE));
     
 #ifdef DEBUG_CORE_TIME 
     t4=micros();
     DEBF("gen=%d, mix=%d, output=%d, total=%d\r\n", t2-t1, t3-t2, t4-t3, t4-t1);
 #endif
-
-    out_buf_id = 0;
-    gen_buf_id = 1;
   }
 }
  
@@ -231,10 +214,13 @@ DEBUG("MIDI: INIT");
   MidiInit();
 
 DEBUG("CARD: BEGIN");
-  Card.begin();
+  Card.begin(&SdCard);
   
-//delay(1000);
- // Card.testReadSpeed(READ_BUF_SECTORS,8);
+#ifdef STORAGE_BENCH
+DEBUG("CARD: BENCHMARK");
+  StorageBench Bench(&Card);
+  Bench.run();
+#endif
   
 DEBUG("REVERB: INIT");
   Reverb.Init();
@@ -248,7 +234,7 @@ DEBUG("SAMPLER: INIT");
   
   initButtons();
   
-  xTaskCreatePinnedToCore( audio_task, "SynthTask", 4000, NULL, 20, &SynthTask, 0 );
+  xTaskCreatePinnedToCore( audio_task, "SynthTask", 6000, NULL, 20, &SynthTask, 0 );
  
   xTaskCreatePinnedToCore( control_task, "ControlTask", 9000, NULL, 3, &ControlTask, 1 );
 
@@ -48,6 +48,13 @@ enum eEnd_t { END_REGULAR, END_SEMI_FAST, END_FAST, END_NOW };
     */
     float process();
 
+    /** Writes the next n samples of the envelope to out[], the same values as n calls of process().
+        The state stays in registers for the whole block, the segments run as plain one-pole recurrences,
+        and a segment change is looked for once per block: only a block where the attack went over 1
+        or a release went under 0 is scanned for the sample where it did.
+    */
+    void processBlock(float* out, int n);
+
 	
     /** Sets time
         Set time per segment in seconds
@@ -86,10 +93,11 @@ enum eEnd_t { END_REGULAR, END_SEMI_FAST, END_FAST, END_NOW };
     inline bool isIdle() const { return mode_ == ADSR_SEG_IDLE; }
 
   private:
+    // the state belongs to the audio task while the voice plays (Voice, SamplerEngine::processCommands()), no need for volatile
     float   sus_level_{0.f};
-    volatile float   x_{0.f};
-    volatile float   target_{0.f};
-    volatile float 	D0_{0.f};
+    float   x_{0.f};
+    float   target_{0.f};
+    float   D0_{0.f};
     float   attackShape_{-1.f};
     float   attackTarget_{0.0f};
     float   attackTime_{-1.0f};
@@ -103,6 +111,6 @@ enum eEnd_t { END_REGULAR, END_SEMI_FAST, END_FAST, END_NOW };
     float   fastReleaseD0_{0.f};
     float   semiFastReleaseD0_{0.f};
     int     sample_rate_;
-    volatile eSegment_t mode_{ADSR_SEG_IDLE};
+    eSegment_t mode_{ADSR_SEG_IDLE};
     bool    gate_{false};
 };
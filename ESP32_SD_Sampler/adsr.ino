@@ -162,7 +162,7 @@ float Adsr::process() {
       out = 0.0f;
       break;
     case ADSR_SEG_ATTACK:
-      x_ += (float)D0_ * ((float)attackTarget_ - (float)x_);
+      x_ += D0_ * (attackTarget_ - x_);
       out = x_;
       if (out > 1.f) {
         mode_ = ADSR_SEG_DECAY;
@@ -173,7 +173,7 @@ float Adsr::process() {
       break;
     case ADSR_SEG_DECAY:
     case ADSR_SEG_RELEASE:
-      x_ += (float)D0_ * ((float)target_ - (float)x_);
+      x_ += D0_ * (target_ - x_);
       out = x_;
       if (out < 0.0f) {
         mode_ = ADSR_SEG_IDLE;
@@ -184,7 +184,7 @@ float Adsr::process() {
       break;
     case ADSR_SEG_FAST_RELEASE:
     case ADSR_SEG_SEMI_FAST_RELEASE:
-      x_ += (float)D0_ * ((float)target_ - (float)x_);
+      x_ += D0_ * (target_ - x_);
       out = x_;
       if (out < 0.0f) {
         mode_ = ADSR_SEG_IDLE;
@@ -198,3 +198,63 @@ float Adsr::process() {
   }
   return out;
 }
+
+
+void Adsr::processBlock(float* out, int n) {
+  float x = x_;
+  float target = target_;
+  float d = D0_;
+  eSegment_t mode = mode_;
+  int i = 0;
+  while (i < n) {
+    int j = i;  // where the segment starts in this block
+    switch (mode) {
+      case ADSR_SEG_IDLE:
+        for (; i < n; i++) out[i] = 0.0f;
+        break;
+      case ADSR_SEG_ATTACK: {
+        const float attackTarget = attackTarget_;
+        for (; i < n; i++) {
+          x += d * (attackTarget - x);
+          out[i] = x;
+        }
+        if (x <= 1.f) break;
+        // it rises, so the first sample above 1 is where process() would have gone to the decay
+        while (out[j] <= 1.f) j++;
+        out[j] = x = 1.f;
+        mode = ADSR_SEG_DECAY;
+        target = sus_level_;
+        d = decayD0_;
+        i = j + 1;
+        break;
+      }
+      case ADSR_SEG_DECAY:
+      case ADSR_SEG_RELEASE:
+      case ADSR_SEG_FAST_RELEASE:
+      case ADSR_SEG_SEMI_FAST_RELEASE:
+        if (x == target) {  // the sustain: it's settled, the recurrence wouldn't change it anymore
+          for (; i < n; i++) out[i] = x;
+          break;
+        }
+        for (; i < n; i++) {
+          x += d * (target - x);
+          out[i] = x;
+        }
+        if (x >= 0.0f) break;
+        while (out[j] >= 0.0f) j++;
+        out[j] = x = 0.f;
+        mode = ADSR_SEG_IDLE;
+        target = -0.1f;
+        d = attackD0_;
+        i = j + 1;
+        break;
+      default:
+        for (; i < n; i++) out[i] = 0.0f;
+        break;
+    }
+  }
+  x_ = x;
+  target_ = target;
+  D0_ = d;
+  mode_ = mode;
+}
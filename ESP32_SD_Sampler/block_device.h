@@ -0,0 +1,53 @@
+#pragma once
+
+// Sector storage under SDMMC_FAT32. The FAT layer, the voices and the profilers only read and write
+// through this interface, so the very same code runs on the SD card of the board (SdmmcDevice) or,
+// in the host tools, on a card image or a card reader (host/file_device.h).
+// Every device counts its requests: that's the I/O volume the profilers and the offline renderer report.
+
+#include "esp_err.h"
+
+class BlockDevice {
+  public:
+    BlockDevice() {};
+    virtual ~BlockDevice() {};
+    virtual esp_err_t begin() = 0;
+    virtual void      end() {};
+    virtual uint32_t  getSectors() = 0;     // device size, 0 if unknown
+    inline esp_err_t  read(void* dst, uint32_t sector, uint32_t count)        { _reads++; _readSectors += count; return readSectors(dst, sector, count); }
+    inline esp_err_t  write(const void* src, uint32_t sector, uint32_t count) { _writes++; _writtenSectors += count; return writeSectors(src, sector, count); }
+    inline uint32_t   getReads()            {return _reads;}
+    inline uint64_t   getReadSectors()      {return _readSectors;}
+    inline uint32_t   getWrites()           {return _writes;}
+    inline uint64_t   getWrittenSectors()   {return _writtenSectors;}
+    inline void       resetStats()          {_reads = 0; _readSectors = 0; _writes = 0; _writtenSectors = 0;}
+
+  protected:
+    virtual esp_err_t readSectors(void* dst, uint32_t sector, uint32_t count) = 0;
+    virtual esp_err_t writeSectors(const void* src, uint32_t sector, uint32_t count) = 0;
+
+  private:
+    uint32_t  _reads          = 0;
+    uint64_t  _readSectors    = 0;
+    uint32_t  _writes         = 0;
+    uint64_t  _writtenSectors = 0;
+};
+
+#ifdef ARDUINO_ARCH_ESP32
+#include "driver/sdmmc_host.h"
+#include "sdmmc_cmd.h"
+
+// The card on the SDMMC host, slot 1, 4-bit bus at the SDMMC_* pins of config.h
+class SdmmcDevice : public BlockDevice {
+  public:
+    SdmmcDevice() {};
+    esp_err_t         begin();
+    void              end();
+    uint32_t          getSectors()          {return card.csd.capacity;}
+    sdmmc_card_t      card;
+
+  protected:
+    esp_err_t         readSectors(void* dst, uint32_t sector, uint32_t count)         {return sdmmc_read_sectors(&card, dst, sector, count);}
+    esp_err_t         writeSectors(const void* src, uint32_t sector, uint32_t count)  {return sdmmc_write_sectors(&card, src, sector, count);}
+};
+#endif
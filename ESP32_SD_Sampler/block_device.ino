@@ -0,0 +1,75 @@
+#include "block_device.h"
+
+#ifdef ARDUINO_ARCH_ESP32
+
+esp_err_t SdmmcDevice::begin() {
+  esp_err_t ret;
+  sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+  sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
+  host.flags = SDMMC_HOST_FLAG_4BIT;
+  host.flags &= ~SDMMC_HOST_FLAG_DDR;       // DDR mode OFF
+  // host.flags |= SDMMC_HOST_FLAG_DDR;          // DDR mode ON
+  // host.max_freq_khz = SDMMC_FREQ_52M;
+  host.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
+#if defined SDMMC_D0
+
+  gpio_pulldown_dis((gpio_num_t)SDMMC_D0);
+  gpio_pulldown_dis((gpio_num_t)SDMMC_D1);
+  gpio_pulldown_dis((gpio_num_t)SDMMC_D2);
+  gpio_pulldown_dis((gpio_num_t)SDMMC_D3);
+  gpio_pulldown_dis((gpio_num_t)SDMMC_CLK);
+  gpio_pulldown_dis((gpio_num_t)SDMMC_CMD);
+  gpio_pullup_en((gpio_num_t)SDMMC_D0);
+  gpio_pullup_en((gpio_num_t)SDMMC_D1);
+  gpio_pullup_en((gpio_num_t)SDMMC_D3);
+  gpio_pullup_en((gpio_num_t)SDMMC_CLK);
+  gpio_pullup_en((gpio_num_t)SDMMC_CMD);
+ #if defined(CONFIG_IDF_TARGET_ESP32S3)
+  gpio_pullup_en((gpio_num_t)SDMMC_D2); // formally this is required, nevertheless GPIO12 of ESP32 set HIGH in some cases leads to a bootloop or a bootstop, so it's up to you if you want it for ESP32
+  slot_config.clk = (gpio_num_t)SDMMC_CLK;
+  slot_config.cmd = (gpio_num_t)SDMMC_CMD;
+  slot_config.d0  = (gpio_num_t)SDMMC_D0;
+  slot_config.d1  = (gpio_num_t)SDMMC_D1;
+  slot_config.d2  = (gpio_num_t)SDMMC_D2;
+  slot_config.d3  = (gpio_num_t)SDMMC_D3;
+ #endif
+#endif
+
+
+  slot_config.width = 4;
+  ret = sdmmc_host_init();
+  if(ret != ESP_OK) {    DEBF( "sdmmc_host_init : %s\r\n", esp_err_to_name(ret));  }
+  ret = sdmmc_host_set_bus_ddr_mode(SDMMC_HOST_SLOT_1, false);
+  if(ret != ESP_OK) {    DEBF( "sdmmc_host_set_bus_ddr_mode : %s\r\n", esp_err_to_name(ret));   }
+  ret = sdmmc_host_init_slot(SDMMC_HOST_SLOT_1, &slot_config);
+  if(ret != ESP_OK) {    DEBF( "sdmmc_host_init_slot : %s\r\n", esp_err_to_name(ret));  }
+  ret = sdmmc_card_init(&host, &card);
+  if(ret != ESP_OK) {    DEBF( "sdmmc_card_init : %s\r\n", esp_err_to_name(ret));  return ret; }
+  sdmmc_card_print_info(stdout, &card);
+  uint32_t width = sdmmc_host_get_slot_width(SDMMC_HOST_SLOT_1);
+  DEBF( "Bus width: %d\r\n", width);
+
+
+/*
+ *
+ *  sdmmc_host_set_cclk_always_on(int slot, bool cclk_always_on);
+ *  sdmmc_host_set_bus_width(int slot, size_t width);
+ *  sdmmc_host_set_card_clk(int slot, uint32_t freq_khz);
+ *  sdmmc_host_set_bus_ddr_mode(int slot, bool ddr_enabled);
+ *  sdmmc_host_get_real_freq(int slot, int *real_freq_khz);
+ *  sdmmc_host_set_input_delay(int slot, sdmmc_delay_phase_t delay_phase);
+ *
+ *  SDMMC_SLOT_FLAG_INTERNAL_PULLUP macro
+ *
+ */
+  return ESP_OK;
+}
+
+void SdmmcDevice::end() {
+  esp_err_t ret = sdmmc_host_deinit() ;
+  if(ret != ESP_OK){
+    DEBF( "sdmmc_host_deinit : %s\r\n", esp_err_to_name(ret));
+  }
+}
+
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+
+// Single producer, single consumer command ring from the Control Task (Core1) to the audio task (Core0).
+// Every change of a playing voice goes through it: SamplerEngine posts the commands when MIDI comes in,
+// and the audio task takes them at the start of a block in SamplerEngine::processCommands(). Each one carries
+// the time it was posted, and it's applied at its frame of the block, between the runs of the per sample loop
+// (SamplerEngine::renderBlock()), which works on plain members that nobody changes under its feet.
+// Lock-free: the producer only writes _head, the consumer only writes _tail.
+
+#include <atomic>
+
+#define CMD_QUEUE_LEN       256   // power of 2
+
+enum eCmd_t : uint8_t {
+  CMD_START,            // voice: prepared by Core1, from now on it's played by Core0
+  CMD_NOTE_OFF,         // voice, arg = Adsr::eEnd_t: the key is released
+  CMD_END,              // voice, arg = Adsr::eEnd_t
+  CMD_PITCH,            // value = speed modifier, all the voices
+  CMD_SUSTAIN,          // arg = on/off
+  CMD_ATTACK_TIME,      // value, all the playing voices (ADSR_LIVE_UPDATE)
+  CMD_DECAY_TIME,
+  CMD_SUSTAIN_LEVEL,
+  CMD_RELEASE_TIME
+};
+
+typedef struct {
+  eCmd_t    type;
+  uint8_t   voice;
+  uint8_t   arg;
+  uint8_t   frame;        // Core0: where in the block it takes effect
+  float     value;
+  uint32_t  stamp;        // LATENCY_CLOCK() when it came in
+} cmd_t;
+
+class CmdQueue {
+  public:
+    CmdQueue() {};
+    inline bool push(const cmd_t& cmd) {                        // Core1
+      uint32_t head = _head.load(std::memory_order_relaxed);
+      uint32_t used = head - _tail.load(std::memory_order_acquire);
+      if (used >= CMD_QUEUE_LEN) return false;
+      _buf[head & (CMD_QUEUE_LEN - 1)] = cmd;
+      _head.store(head + 1, std::memory_order_release);
+      if (used + 1 > _maxUsed) _maxUsed = used + 1;
+      return true;
+    }
+    inline bool pop(cmd_t& cmd) {                               // Core0
+      uint32_t tail = _tail.load(std::memory_order_relaxed);
+      if (tail == _head.load(std::memory_order_acquire)) return false;
+      cmd = _buf[tail & (CMD_QUEUE_LEN - 1)];
+      _tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+    inline uint32_t getPushed()     {return _head.load(std::memory_order_relaxed);}
+    inline uint32_t getMaxUsed()    {return _maxUsed;}
+
+  private:
+    cmd_t                 _buf[CMD_QUEUE_LEN];
+    std::atomic<uint32_t> _head     {0};
+    std::atomic<uint32_t> _tail     {0};
+    uint32_t              _maxUsed  = 0;      // producer side statistics
+};
@@ -3,6 +3,8 @@
 //******************************************************* DEBUG **********************************************
 // #define DEBUG_ON
 //#define DEBUG_CORE_TIME
+//#define DEBUG_SCHEDULER                 // print per-voice SD read slack statistics every 2 seconds
+//#define STORAGE_BENCH                   // profile the card on start: read sizes, access patterns, latency tails (see storage_bench.h)
 //#define C_MAJOR_ON_START                // play C major chord on startup (testing) and on folder change
 
 //******************************************************* SYSTEM **********************************************
@@ -17,18 +19,42 @@
 
 //******************************************************* FILESYSTEM **********************************************
 #define INI_FILE              "sampler.ini"
-#define ROOT_FOLDER           "/"         // only </> is supported yet
-#define READ_BUF_SECTORS      7           // that many sectors (assume 512 Bytes) per read operation, the more, the faster it reads
+#define INDEX_FILE            "sampler.idx" // 8.3 name, it's created by the sampler in every sample folder
+#define USE_FOLDER_INDEX                  // keep the prepared sample map in INDEX_FILE, so the next load of the folder skips parsing
+#define ROOT_FOLDER           "/"         // sample sets are the subfolders of this one, nested paths like </pianos/> are fine
+#define READ_BUF_SECTORS      7           // that many sectors (assume 512 Bytes) per read operation at 16 bit stereo and normal pitch, the more, the faster it reads
 
 
 //******************************************************* SAMPLER **********************************************
-#define MAX_POLYPHONY         17          // empiric : MAX_POLYPHONY * READ_BUF_SECTORS <= 156
+#define MAX_POLYPHONY         17          // empiric : MAX_POLYPHONY * READ_BUF_SECTORS <= 156, STORAGE_BENCH tells what your card sustains
+#define USE_HEAD_CACHE                    // keep the beginnings of all the samples of the current folder in PSRAM for instant note starts
+#define HEAD_CACHE_KB         32          // head size per sample, it gets smaller if the folder doesn't fit the budget
+#define HEAD_CACHE_BUDGET_KB  4096        // PSRAM used for the head cache
+#define HEAD_FILL_SHARE       8           // while the voices keep the card busy, one head cache read after this many of theirs
+#define USE_SECTOR_CACHE                  // keep the sectors the voices read in PSRAM, so that reused ones don't hit the card again
+#define SECTOR_CACHE_KB       2048        // PSRAM used for the sector cache
+#define SECTOR_CACHE_PROTECTED 75         // percent of it kept for the sectors read more than once
+#define USE_LOOP_CACHE                    // keep the loops of the looped samples in PSRAM, so the held notes stop reading the card after the first pass
+#define LOOP_CACHE_KB         1536        // PSRAM used for the loops, the looped samples that don't fit play through without looping
+#define LOOP_XFADE_FRAMES     256         // crossfade at the loop seam, with the frames after the loop end or, if there are none, before its start
+#define PSRAM_RESERVE_KB      1024        // PSRAM the caches above leave free for the sample map and the other large allocations; if their
+                                          // budgets don't fit the rest, they all shrink by the same factor
+#define ADMISSION_CONTROL                 // start only as many streaming voices as the card can feed: make room by releasing one, or refuse the note
+#define ADMISSION_BUDGET      85          // percent of the measured card throughput the streaming voices may take
+#define RING_ARENA_SECTORS    272         // internal RAM for all the voice ring buffers, in sectors
+#define RING_MIN_SECTORS      4           // voice ring depth limits, the depth scales with the byte rate of the voice
+#define RING_MAX_SECTORS      32
 #define SACRIFY_VOICES        1           // voices used for smooth transisions to avoid clicks
 #define MAX_SAME_NOTES        2           // number of voices allowed playing the same note
 #define MAX_VELOCITY_LAYERS   16
 #define MAX_NOTES_PER_GROUP   3           // exclusive groups: e.g. Closed hat, Pedal hat and Open hat -- only one of them can play at a time
 #define MAX_GROUPS_CROSSES    1           // max possible exclusive groups interleaving (common is 1, meaning no interleavings)
 #define MAX_DISTANCE_STRETCH  2           // max distance in semitones to search for an absent sample by changing speed of neighbour files
+#define INTERP_QUALITY        INTERP_SINC // best interpolation of the pitched voices: INTERP_NEAREST, INTERP_LINEAR, INTERP_HERMITE or INTERP_SINC
+#define INTERP_GOVERNOR                   // step the voices down from INTERP_QUALITY when they wouldn't fit RENDER_BUDGET
+#define RENDER_BUDGET         50          // percent of the block time the voices may take, the rest is for the effects and the mixer
+#define SAMPLE_ACCURATE_MIDI              // notes start, stop and bend at the frame they came in, a block later, instead of at the next block boundary
+//#define FIXED_POINT_ENGINE                // integer voices, mixer and reverb (fixed_point.h) instead of float, for the targets without a fast FPU
 //#define ADSR_LIVE_UPDATE                  // if you set this param, the notes being played will get the updates along with CC changes (may produce some hisses)
 
 //******************************************************* PINS **********************************************
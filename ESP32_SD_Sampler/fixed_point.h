@@ -0,0 +1,62 @@
+#pragma once
+
+// Number types of the audio path, float or fixed point, chosen at build time by FIXED_POINT_ENGINE (config.h).
+// The voice kernels, the mixer, the reverb and the output conversion only use these types and helpers,
+// so both engines are the same code, and the float build compiles to exactly what it was before.
+// Fixed point is for the ESP32 parts without a fast FPU:
+//   mix_t   buses, Q27 in an int32: 1.0 is the full scale, 16 times of headroom for the sums of the voices
+//   gain_t  mixer and effect gains, Q15
+//   smp_t   decoded samples, the 16 bit range with 8 bits of fraction (24 bit samples keep all their bits)
+//   env_t   voice gain, the float one times 2^44 (a 16 bit full scale sample at gain 2^-15 makes the full scale)
+//   coef_t  interpolation filter taps, Q30
+// The sums and the gains saturate instead of wrapping around.
+
+#ifdef FIXED_POINT_ENGINE
+
+typedef int32_t   mix_t;
+typedef int32_t   gain_t;
+typedef int32_t   smp_t;
+typedef int32_t   env_t;
+typedef int32_t   coef_t;
+
+#define ENGINE_NAME     "fixed point"
+#define MIX_ONE         ((mix_t)1 << 27)
+#define GAIN(x)         ((gain_t)((x) * 32768.0f))
+#define COEF(x)         ((coef_t)lround((x) * 1073741824.0))
+
+inline mix_t    mixSat(int64_t x)             {return (mix_t)constrain(x, (int64_t)INT32_MIN, (int64_t)INT32_MAX);}
+inline mix_t    mixAdd(mix_t a, mix_t b)      {return mixSat((int64_t)a + b);}
+inline mix_t    mixAbs(mix_t a)               {return a ^ (a >> 31);}   // 1 LSB short for the negative ones, but no overflow
+inline mix_t    mixMul(mix_t a, gain_t g)     {return mixSat(((int64_t)a * g) >> 15);}
+inline mix_t    mixClamp(mix_t a)             {return constrain(a, -MIX_ONE, MIX_ONE);}
+inline int16_t  mixToInt16(mix_t a)           {return (int16_t)(((int64_t)mixClamp(a) * 0x7fff) / MIX_ONE);} // truncates like the float one
+inline int16_t  mixClipToInt16(mix_t a)       {return mixToInt16(a);}   // it clamps already
+inline float    mixToFloat(mix_t a)           {return (float)a * (1.0f / (float)MIX_ONE);}
+inline env_t    envGain(float g)              {return (env_t)fclamp(g * 17592186044416.0f, -2147483520.0f, 2147483520.0f);}
+inline mix_t    voiceMul(smp_t s, env_t e)    {return (mix_t)(((int64_t)s * e) >> 25);}
+inline smp_t    mulQ31(smp_t a, uint32_t f)   {return (smp_t)(((int64_t)a * (int64_t)(f >> 1)) >> 31);}  // f is a 0.32 fraction
+
+#else
+
+typedef float     mix_t;
+typedef float     gain_t;
+typedef float     smp_t;
+typedef float     env_t;
+typedef float     coef_t;
+
+#define ENGINE_NAME     "float"
+#define MIX_ONE         1.0f
+#define GAIN(x)         ((gain_t)(x))
+#define COEF(x)         ((coef_t)(x))
+
+inline mix_t    mixAdd(mix_t a, mix_t b)      {return a + b;}
+inline mix_t    mixAbs(mix_t a)               {return fabsf(a);}
+inline mix_t    mixMul(mix_t a, gain_t g)     {return a * g;}
+inline mix_t    mixClamp(mix_t a)             {return fclamp(a, -1.0f, 1.0f);}
+inline int16_t  mixToInt16(mix_t a)           {return (float)0x7fff * a;}
+inline int16_t  mixClipToInt16(mix_t a)       {return mixToInt16(mixClamp(a));}
+inline float    mixToFloat(mix_t a)           {return a;}
+inline env_t    envGain(float g)              {return g;}
+inline mix_t    voiceMul(smp_t s, env_t e)    {return s * e;}
+
+#endif
@@ -11,15 +11,23 @@
  * Changes:
  * - optimized for buffer processing
  * - added interface to set the level
+ * - number types of fixed_point.h, so it runs in Q27 with Q15 gains in the FIXED_POINT_ENGINE builds
+ * - ProcessBlock(): every stage runs over the whole block. The delay lines are rounded up to powers of 2 and
+ *   indexed with a mask, and the part of a line a block reads is copied to internal RAM and the part it writes
+ *   is copied back, two bursts per stage instead of a random PSRAM access per sample and stage
  *
  */ 
 
+#include "fixed_point.h"
+
 #ifdef BOARD_HAS_PSRAM 
   #define REV_MULTIPLIER 1.8f
   #define MALLOC_CAP        MALLOC_CAP_SPIRAM
+  #define REV_STAGING       true    // the blocks go through internal RAM
 #else
   #define REV_MULTIPLIER 0.35f
   #define MALLOC_CAP        MALLOC_CAP_INTERNAL
+  #define REV_STAGING       false   // the lines are in internal RAM already, the copies would only cost
 #endif
 
 #define COMB_BUF_LEN_0 (int)( 3604.0 * REV_MULTIPLIER)
@@ -33,92 +41,119 @@
 //rev_time 0.0 <-> 1.0
 //rev_delay 0.0 <-> 1.0
 
+// A delay of lim samples in a power of 2 ring, one block longer than the longest delay, so that the block
+// read lim samples back and the block written now never overlap when lim >= the block length
+class DelayLine {
+  public:
+    inline bool init(const char* name, int maxDelay) {
+      size = 1;
+      while (size < (uint32_t)(maxDelay + MAX_BLOCK_LEN)) size <<= 1;
+      mask = size - 1;
+      buf = (mix_t*)heap_caps_malloc( sizeof(mix_t) * size , MALLOC_CAP );
+      if( buf == NULL){
+        DEBF("No more RAM for reverb %s!\r\n", name);
+        return false;
+      }
+      DEBF("REVERB: %s : %u Bytes RAM allocated for reverb buffer, &=%p\r\n", name, (unsigned)(sizeof(mix_t) * size), buf);
+      memset(buf, 0, sizeof(mix_t) * size);
+      return true;
+    }
+
+    // the n samples written lim samples ago, copied to win[]; false if they aren't staged (internal RAM lines,
+    // or a delay shorter than the block) and the stage works in the line itself
+    inline bool read( mix_t* win, int n ){
+      if (!REV_STAGING || lim < (uint32_t)n) return false;
+      copyOut(win, (pos - lim) & mask, n);
+      return true;
+    }
+
+    inline void write( const mix_t* win, int n ){
+      copyIn(win, pos, n);
+      pos = (pos + n) & mask;
+    }
+
+
+    mix_t*    buf   = nullptr;
+    uint32_t  size  = 0;
+    uint32_t  mask  = 0;
+    uint32_t  pos   = 0;    // where the current sample goes
+    uint32_t  lim   = 1;    // delay, samples
+
+  private:
+    inline void copyOut( mix_t* dst, uint32_t from, int n ){
+      uint32_t first = min((uint32_t)n, size - from);
+      memcpy(dst, buf + from, first * sizeof(mix_t));
+      memcpy(dst + first, buf, (n - first) * sizeof(mix_t));
+    }
+    inline void copyIn( const mix_t* src, uint32_t to, int n ){
+      uint32_t first = min((uint32_t)n, size - to);
+      memcpy(buf + to, src, first * sizeof(mix_t));
+      memcpy(buf, src + first, (n - first) * sizeof(mix_t));
+    }
+};
+
 class FxReverb {
 	public:
 	FxReverb() {
   
   }
 
-  	inline void Process( float *signal_l, float *signal_r ){
-  
-  		float inSample;
-  
-  		// create mono sample 
-  		inSample = *signal_l + *signal_r; // it may cause unwanted audible effects 
-  		inSample *= 0.5f;
-  
-  		// float newsample = (Do_Comb0(inSample) + Do_Comb1(inSample) + Do_Comb2(inSample) + Do_Comb3(inSample)) / 4.0f;
-  		float newsample = (Do_Comb0(inSample) + Do_Comb1(inSample) + Do_Comb2(inSample) + Do_Comb3(inSample)) * 0.25f;
-  		newsample = Do_Allpass0(newsample);
-  		newsample = Do_Allpass1(newsample);
-  		newsample = Do_Allpass2(newsample);
-  
-  		// apply reverb level 
-  		newsample *= rev_level;
-  
-  		*signal_l += newsample;
-  		*signal_r += newsample;
-  
+    // one frame, the same as a block of 1
+  	inline void Process( mix_t *signal_l, mix_t *signal_r ){
+      ProcessBlock(signal_l, signal_r, 1);
+  	}
+
+    // the mono input of a stereo frame
+    static inline mix_t Mono( mix_t l, mix_t r ) {
+      return mixMul(mixAdd(l, r), GAIN(0.5f)); // it may cause unwanted audible effects
+    }
+
+    // adds the reverb to n <= MAX_BLOCK_LEN frames
+  	inline void ProcessBlock( mix_t *signal_l, mix_t *signal_r, int n ){
+      mix_t bus[MAX_BLOCK_LEN];
+      if (!ready) return;
+
+      for (int i = 0; i < n; i++) bus[i] = Mono(signal_l[i], signal_r[i]);
+      ProcessMono(bus, n);
+      for (int i = 0; i < n; i++) {
+        signal_l[i] = mixAdd(signal_l[i], bus[i]);
+        signal_r[i] = mixAdd(signal_r[i], bus[i]);
+      }
+  	}
+
+    // n <= MAX_BLOCK_LEN frames of the mono send in bus[] (see Mono()) are replaced by the reverb return,
+    // the mixer adds it to both channels
+  	inline void ProcessMono( mix_t *bus, int n ){
+      mix_t sum[MAX_BLOCK_LEN];
+      if (!ready) {
+        for (int i = 0; i < n; i++) bus[i] = 0;
+        return;
+      }
+
+      for (int i = 0; i < n; i++) sum[i] = 0;
+
+      // float newsample = (Do_Comb0(inSample) + Do_Comb1(inSample) + Do_Comb2(inSample) + Do_Comb3(inSample)) / 4.0f;
+      Do_Comb(comb[0], GAIN(0.805f), bus, sum, n);
+      Do_Comb(comb[1], GAIN(0.827f), bus, sum, n);
+      Do_Comb(comb[2], GAIN(0.783f), bus, sum, n);
+      Do_Comb(comb[3], GAIN(0.764f), bus, sum, n);
+      for (int i = 0; i < n; i++) sum[i] = mixMul(sum[i], GAIN(0.25f));
+      Do_Allpass(allPass[0], GAIN(0.7f), sum, n);
+      Do_Allpass(allPass[1], GAIN(0.7f), sum, n);
+      Do_Allpass(allPass[2], GAIN(0.7f), sum, n);
+
+      // apply reverb level
+      for (int i = 0; i < n; i++) bus[i] = mixMul(sum[i], rev_level);
   	}
   
   	inline void Init() { 
-
-        combBuf0 = (float*)heap_caps_malloc( sizeof(float) * COMB_BUF_LEN_0 , MALLOC_CAP );
-        if( combBuf0 == NULL){
-          DEBUG("No more RAM for reverb combBuf0!");
-        } else {
-          DEB("REVERB: combBuf0 : ");
-          DEBF("%d Bytes RAM allocated for reverb buffer, &=%#010x\r\n", sizeof(float) * COMB_BUF_LEN_0 , combBuf0);
-          memset(combBuf0, 0, sizeof(float) * COMB_BUF_LEN_0);
-        } 
-        combBuf1 = (float*)heap_caps_malloc( sizeof(float) * COMB_BUF_LEN_1 , MALLOC_CAP );
-        if( combBuf1 == NULL){
-          DEBUG("No more RAM for reverb combBuf1!");
-        } else {
-          DEB("REVERB: combBuf1 : ");
-          DEBF("%d Bytes RAM allocated for reverb buffer, &=%#010x\r\n", sizeof(float) * COMB_BUF_LEN_1 , combBuf1);
-          memset(combBuf1, 0, sizeof(float) * COMB_BUF_LEN_1);
-        }
-        combBuf2 = (float*)heap_caps_malloc( sizeof(float) * COMB_BUF_LEN_2 , MALLOC_CAP );
-        if( combBuf2 == NULL){
-          DEBUG("No more RAM for reverb combBuf2!");
-        } else {
-          DEB("REVERB: combBuf2 : ");
-          DEBF("%d Bytes RAM allocated for reverb buffer, &=%#010x\r\n", sizeof(float) * COMB_BUF_LEN_2 , combBuf2);
-          memset(combBuf2, 0, sizeof(float) * COMB_BUF_LEN_2);
-        }
-        combBuf3 = (float*)heap_caps_malloc( sizeof(float) * COMB_BUF_LEN_3 , MALLOC_CAP );
-        if( combBuf3 == NULL){
-          DEBUG("No more RAM for reverb combBuf2!");
-        } else {
-          DEB("REVERB: combBuf3 : ");
-          DEBF("%d Bytes RAM allocated for reverb buffer, &=%#010x\r\n", sizeof(float) * COMB_BUF_LEN_3 , combBuf3);
-          memset(combBuf3, 0, sizeof(float) * COMB_BUF_LEN_3);
-        } 
-        allPassBuf0 = (float*)heap_caps_malloc( sizeof(float) * ALLPASS_BUF_LEN_0 , MALLOC_CAP );
-        if( allPassBuf0 == NULL){
-          DEBUG("No more RAM for reverb allPassBuf0!");
-        } else {
-          DEB("REVERB: allPassBuf0 : ");
-          DEBF("%d Bytes RAM allocated for reverb buffer, &=%#010x\r\n", sizeof(float) * ALLPASS_BUF_LEN_0 , allPassBuf0);
-          memset(allPassBuf0, 0, sizeof(float) * ALLPASS_BUF_LEN_0);
-        }
-        allPassBuf1 = (float*)heap_caps_malloc( sizeof(float) * ALLPASS_BUF_LEN_1 , MALLOC_CAP );
-        if( allPassBuf1 == NULL){
-          DEBUG("No more RAM for reverb allPassBuf1!");
-        } else {
-          DEB("REVERB: allPassBuf1 : ");
-          DEBF("%d Bytes RAM allocated for reverb buffer, &=%#010x\r\n", sizeof(float) * ALLPASS_BUF_LEN_1, allPassBuf1);
-          memset(allPassBuf1, 0, sizeof(float) * ALLPASS_BUF_LEN_1);
-        }
-        allPassBuf2 = (float*)heap_caps_malloc( sizeof(float) * ALLPASS_BUF_LEN_2 , MALLOC_CAP );
-        if( allPassBuf2 == NULL){
-          DEBUG("No more RAM for reverb allPassBuf2!");
-        } else {
-          DEB("REVERB: allPassBuf2 : ");
-          DEBF("%d Bytes RAM allocated for reverb buffer, &=%#010x\r\n", sizeof(float) * ALLPASS_BUF_LEN_2, allPassBuf2);
-          memset(allPassBuf2, 0, sizeof(float) * ALLPASS_BUF_LEN_2);
-        }
+        const int combLen[4] = { COMB_BUF_LEN_0, COMB_BUF_LEN_1, COMB_BUF_LEN_2, COMB_BUF_LEN_3 };
+        const int allPassLen[3] = { ALLPASS_BUF_LEN_0, ALLPASS_BUF_LEN_1, ALLPASS_BUF_LEN_2 };
+        const char* combNames[4] = { "combBuf0", "combBuf1", "combBuf2", "combBuf3" };
+        const char* allPassNames[3] = { "allPassBuf0", "allPassBuf1", "allPassBuf2" };
+        ready = true;
+        for (int i = 0; i < 4; i++) ready &= comb[i].init(combNames[i], combLen[i]);
+        for (int i = 0; i < 3; i++) ready &= allPass[i].init(allPassNames[i], allPassLen[i]);
         
   		SetLevel( 1.0f );
   		SetTime( 0.5f );
@@ -126,20 +161,20 @@ class FxReverb {
 		
     inline void SetTime( float value ){
       rev_time = 0.92f * value + 0.02f ;
-      cf0_lim = (int)(rev_time * (float)(COMB_BUF_LEN_0));
-      cf1_lim = (int)(rev_time * (float)(COMB_BUF_LEN_1));
-      cf2_lim = (int)(rev_time * (float)(COMB_BUF_LEN_2));
-      cf3_lim = (int)(rev_time * (float)(COMB_BUF_LEN_3));
-      ap0_lim = (int)(rev_time * (float)(ALLPASS_BUF_LEN_0));
-      ap1_lim = (int)(rev_time * (float)(ALLPASS_BUF_LEN_1));
-      ap2_lim = (int)(rev_time * (float)(ALLPASS_BUF_LEN_2));
+      comb[0].lim = max((int)(rev_time * (float)(COMB_BUF_LEN_0)), 1);
+      comb[1].lim = max((int)(rev_time * (float)(COMB_BUF_LEN_1)), 1);
+      comb[2].lim = max((int)(rev_time * (float)(COMB_BUF_LEN_2)), 1);
+      comb[3].lim = max((int)(rev_time * (float)(COMB_BUF_LEN_3)), 1);
+      allPass[0].lim = max((int)(rev_time * (float)(ALLPASS_BUF_LEN_0)), 1);
+      allPass[1].lim = max((int)(rev_time * (float)(ALLPASS_BUF_LEN_1)), 1);
+      allPass[2].lim = max((int)(rev_time * (float)(ALLPASS_BUF_LEN_2)), 1);
 #ifdef DEBUG_FX
       DEBF("reverb time: %0.3f\n", value);
 #endif
     }
     
     inline void SetLevel( float value ){
-      rev_level = value;
+      rev_level = GAIN(value);
 #ifdef DEBUG_FX
       DEBF("reverb level: %0.3f\n", value);
 #endif
@@ -147,122 +182,59 @@ class FxReverb {
 		
 	private:
 		float rev_time = 0.5f;
-		float rev_level = 0.5f;
+		gain_t rev_level = GAIN(0.5f);
+    bool ready = false;
  
-    float* combBuf0     = nullptr;
-    float* combBuf1     = nullptr;
-    float* combBuf2     = nullptr;
-    float* combBuf3     = nullptr;
-    float* allPassBuf0  = nullptr;
-    float* allPassBuf1  = nullptr;
-    float* allPassBuf2  = nullptr;    
- 	
-		//define pointer limits = delay time
-		int cf0_lim, cf1_lim, cf2_lim, cf3_lim, ap0_lim, ap1_lim, ap2_lim;
-
-    
-    inline float Do_Comb0( float inSample ){
-      static int cf0_p = 0;
-      static float cf0_g = 0.805f;
-
-      float readback = combBuf0[cf0_p];
-      float newV = readback * cf0_g + inSample;
-      combBuf0[cf0_p] = newV;
-      cf0_p++;
-      if( cf0_p >= cf0_lim ){
-        cf0_p = 0;
-      }
-      return readback;
-    }
-
-    inline float Do_Comb1( float inSample ){
-      
-      static int cf1_p = 0;
-      static float cf1_g = 0.827f;
-
-      float readback = combBuf1[cf1_p];
-      float newV = readback * cf1_g + inSample;
-      combBuf1[cf1_p] = newV;
-      cf1_p++;
-      if( cf1_p >= cf1_lim ){
-        cf1_p = 0;
-      }
-      return readback;
-    }
-
-    inline float Do_Comb2( float inSample ){
-      static int cf2_p = 0;
-      static float cf2_g = 0.783f;
-
-      float readback = combBuf2[cf2_p];
-      float newV = readback * cf2_g + inSample;
-      combBuf2[cf2_p] = newV;
-      cf2_p++;
-      if( cf2_p >= cf2_lim ){
-        cf2_p = 0;
-      }
-      return readback;
-    }
-
-    inline float Do_Comb3( float inSample ){
-      static int cf3_p = 0;
-      static float cf3_g = 0.764f;
-
-      float readback = combBuf3[cf3_p];
-      float newV = readback * cf3_g + inSample;
-      combBuf3[cf3_p] = newV;
-      cf3_p++;
-      if( cf3_p >= cf3_lim ){
-        cf3_p = 0;
+    DelayLine comb[4];
+    DelayLine allPass[3];
+
+    // adds the comb output to sum[], the window is in internal RAM (the stack), only the copies touch the line
+    inline void Do_Comb( DelayLine& d, const gain_t g, const mix_t* __restrict in, mix_t* __restrict sum, int n ){
+      mix_t win[MAX_BLOCK_LEN];
+      if (d.read(win, n)) {
+        for (int i = 0; i < n; i++) {
+          mix_t readback = win[i];
+          sum[i] = mixAdd(sum[i], readback);
+          win[i] = mixAdd(mixMul(readback, g), in[i]);
+        }
+        d.write(win, n);
+        return;
       }
-      return readback;
-    }
-
-
-    inline float Do_Allpass0( float inSample ){
-      static int ap0_p = 0;
-      static float ap0_g = 0.7f;
-
-      float readback = allPassBuf0[ap0_p];
-      readback += (-ap0_g) * inSample;
-      float newV = readback * ap0_g + inSample;
-      allPassBuf0[ap0_p] = newV;
-      ap0_p++;
-      if( ap0_p >= ap0_lim ){
-        ap0_p = 0;
+      mix_t* buf = d.buf;
+      const uint32_t mask = d.mask;
+      uint32_t p = d.pos;
+      const uint32_t lim = d.lim;
+      for (int i = 0; i < n; i++) {
+        mix_t readback = buf[(p - lim) & mask];
+        sum[i] = mixAdd(sum[i], readback);
+        buf[p] = mixAdd(mixMul(readback, g), in[i]);
+        p = (p + 1) & mask;
       }
-      return readback;
+      d.pos = p;
     }
 
-    inline float Do_Allpass1( float inSample ){
-      static int ap1_p = 0;
-      static float ap1_g = 0.7f;
-
-      float readback = allPassBuf1[ap1_p];
-      readback += (-ap1_g) * inSample;
-      float newV = readback * ap1_g + inSample;
-      allPassBuf1[ap1_p] = newV;
-      ap1_p++;
-      if( ap1_p >= ap1_lim ){
-        ap1_p = 0;
+    // in place
+    inline void Do_Allpass( DelayLine& d, const gain_t g, mix_t* __restrict io, int n ){
+      mix_t win[MAX_BLOCK_LEN];
+      if (d.read(win, n)) {
+        for (int i = 0; i < n; i++) {
+          mix_t readback = mixAdd(win[i], mixMul(io[i], -g));
+          win[i] = mixAdd(mixMul(readback, g), io[i]);
+          io[i] = readback;
+        }
+        d.write(win, n);
+        return;
       }
-      return readback;
-    }
-
-    inline float Do_Allpass2( float inSample ){
-      static int ap2_p = 0;
-      static float ap2_g = 0.7f;
-
-      float readback = allPassBuf2[ap2_p];
-      readback += (-ap2_g) * inSample;
-      float newV = readback * ap2_g + inSample;
-      allPassBuf2[ap2_p] = newV;
-      ap2_p++;
-      if( ap2_p >= ap2_lim ){
-        ap2_p = 0;
+      mix_t* buf = d.buf;
+      const uint32_t mask = d.mask;
+      uint32_t p = d.pos;
+      const uint32_t lim = d.lim;
+      for (int i = 0; i < n; i++) {
+        mix_t readback = mixAdd(buf[(p - lim) & mask], mixMul(io[i], -g));
+        buf[p] = mixAdd(mixMul(readback, g), io[i]);
+        io[i] = readback;
+        p = (p + 1) & mask;
       }
-      return readback;
+      d.pos = p;
     }
-
-
 };
@@ -0,0 +1,50 @@
+#pragma once
+
+// The first HEAD_CACHE_KB of every sample mapped in the current folder, kept in PSRAM.
+// It's filled in the background, when no voice needs to read the card, and one read in HEAD_FILL_SHARE when they
+// keep it busy, so a folder change under a long held chord still gets its heads. The voices take their first
+// buffers from here instantly, while the card streaming catches up from the head boundary.
+// Everything is done in the Control Task (Core1).
+
+#define HEAD_FILL_SECTORS   8     // sectors per background read
+
+typedef struct {
+  uint32_t              key     = 0;  // first sector of the sample file
+  uint32_t              offset  = 0;  // in sectors from the beginning of _data
+  uint32_t              sectors = 0;  // head length
+  uint32_t              filled  = 0;  // sectors already read
+  std::vector<chain_t>  chains  ;
+} head_t;
+
+class HeadCache {
+  public:
+    HeadCache() {};
+    bool              init(uint32_t budgetBytes);
+    void              clear();
+    int               add(const sample_t& smp, uint32_t headSectors); // returns entry id or -1 if the budget is over
+    bool              fillStep(SDMMC_FAT32* Card);    // reads the next portion, false if there's nothing left to read
+    bool              ready(int id, uint32_t key, uint32_t sectors); // counts hits and misses, called on note start
+    inline bool       covers(int id, uint32_t key, uint32_t fileSector, uint32_t count) {
+      return (id >= 0 && id < (int)_heads.size() && _heads[id].key == key && fileSector + count <= _heads[id].filled);
+    }
+    inline uint8_t*   data(int id, uint32_t fileSector) {return _data + (_heads[id].offset + fileSector) * BYTES_PER_SECTOR;}
+    inline uint32_t   getCapacity()           {return _capacity;}
+    inline uint32_t   getSectorsTotal()       {return _used;}
+    inline uint32_t   getSectorsFilled()      {return _filled;}
+    inline bool       complete()              {return _filled >= _used;}
+    inline uint32_t   getHits()               {return _hits;}
+    inline uint32_t   getMisses()             {return _misses;}
+    inline int        size()                  {return _heads.size();}
+
+  private:
+    uint8_t*          _data                   = nullptr;  // PSRAM
+    uint8_t*          _bounce                 = nullptr;  // internal RAM for DMA
+    uint32_t          _capacity               = 0;        // sectors
+    uint32_t          _used                   = 0;        // sectors
+    uint32_t          _filled                 = 0;        // sectors
+    uint32_t          _fillId                 = 0;        // entry being filled
+    uint32_t          _fillStart              = 0;
+    uint32_t          _hits                   = 0;
+    uint32_t          _misses                 = 0;
+    std::vector<head_t> _heads;
+};
@@ -0,0 +1,75 @@
+#include "head_cache.h"
+
+bool HeadCache::init(uint32_t budgetBytes) {
+  _capacity = budgetBytes / BYTES_PER_SECTOR;
+  _data = (uint8_t*)heap_caps_malloc( _capacity * BYTES_PER_SECTOR, MALLOC_CAP_SPIRAM);
+  _bounce = (uint8_t*)heap_caps_malloc( HEAD_FILL_SECTORS * BYTES_PER_SECTOR, MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA);
+  if (_data == NULL || _bounce == NULL) {
+    DEBUG("HEAD CACHE: no PSRAM, disabled");
+    _capacity = 0;
+    return false;
+  }
+  DEBF("HEAD CACHE: %d Bytes PSRAM allocated\r\n", _capacity * BYTES_PER_SECTOR);
+  return true;
+}
+
+
+void HeadCache::clear() {
+  _heads.clear();
+  _used = 0;
+  _filled = 0;
+  _fillId = 0;
+  _fillStart = micros();
+}
+
+
+int HeadCache::add(const sample_t& smp, uint32_t headSectors) {
+  head_t h;
+  if (smp.sectors.empty()) return -1;
+  uint32_t fileSectors = (smp.size + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+  h.sectors = min(headSectors, fileSectors);
+  if (_used + h.sectors > _capacity) return -1;
+  h.key     = smp.sectors[0].first;
+  h.offset  = _used;
+  h.chains  = smp.sectors;
+  _used += h.sectors;
+  _heads.push_back(h);
+  return _heads.size() - 1;
+}
+
+
+bool HeadCache::fillStep(SDMMC_FAT32* Card) {
+  uint32_t runLeft;
+  while (_fillId < _heads.size() && _heads[_fillId].filled >= _heads[_fillId].sectors) _fillId++;
+  if (_fillId >= _heads.size()) return false;
+  head_t& h = _heads[_fillId];
+  uint32_t sector = chainSector(h.chains, h.filled, runLeft);
+  uint32_t n = min(min(runLeft, h.sectors - h.filled), (uint32_t)HEAD_FILL_SECTORS);
+  if (n == 0) { // chains are shorter than the file size says
+    _used -= h.sectors - h.filled;
+    h.sectors = h.filled;
+    return true;
+  }
+  if (Card->read_block(_bounce, sector, n) != ESP_OK) { // leave it as it is
+    _used -= h.sectors - h.filled;
+    h.sectors = h.filled;
+    return true;
+  }
+  memcpy(data(_fillId, h.filled), _bounce, n * BYTES_PER_SECTOR);
+  h.filled += n;
+  _filled += n;
+  if (_filled >= _used) {
+    DEBF("HEAD CACHE: %u samples, %d KBytes filled in %d ms\r\n", (unsigned)_heads.size(), _filled / 2, (micros() - _fillStart) / 1000);
+  }
+  return true;
+}
+
+
+bool HeadCache::ready(int id, uint32_t key, uint32_t sectors) {
+  if (id >= 0 && id < (int)_heads.size() && covers(id, key, 0, min(_heads[id].sectors, sectors))) {
+    _hits++;
+    return true;
+  }
+  _misses++;
+  return false;
+}
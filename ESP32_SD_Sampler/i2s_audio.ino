@@ -1,7 +1,4 @@
 
-
-//#define DEBUG_MASTER_OUT
-
 #if ESP_ARDUINO_VERSION_MAJOR < 3
 
 #include "driver/i2s.h"
@@ -19,8 +16,8 @@ void i2sInit() {
     .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,
     .communication_format = (i2s_comm_format_t)(I2S_COMM_FORMAT_STAND_I2S ),
     .intr_alloc_flags = ESP_INTR_FLAG_LEVEL2,
-    .dma_buf_count = DMA_NUM_BUF,
-    .dma_buf_len = DMA_BUF_LEN,
+    .dma_buf_count = audioDmaBufs,
+    .dma_buf_len = audioBlockLen,
     .use_apll = true,
   };
 
@@ -35,7 +32,7 @@ void i2sInit() {
   i2s_set_pin(i2s_num, &i2s_pin_config);
   i2s_zero_dma_buffer(i2s_num);
 
-  DEBF("I2S is started: BCK %d, WCK %d, DAT %d\r\n", I2S_BCLK_PIN, I2S_WCLK_PIN, I2S_DOUT_PIN);
+  DEBF("I2S is started: BCK %d, WCK %d, DAT %d, %d buffers of %d samples\r\n", I2S_BCLK_PIN, I2S_WCLK_PIN, I2S_DOUT_PIN, audioDmaBufs, audioBlockLen);
 }
 
 
@@ -46,18 +43,11 @@ void i2sDeinit() {
 
 
 
-static void i2s_output () {
-// now out_buf is ready, output
+static void i2s_output (int n) {
+// now out_buf is ready (mixer() packs the frames), output
 size_t bytes_written;
 
-
-  for (int i=0; i < DMA_BUF_LEN; i++) {
-    out_buf[out_buf_id][i*2] = (float)0x7fff * mix_buf_l[out_buf_id][i]; 
-    out_buf[out_buf_id][i*2+1] = (float)0x7fff * mix_buf_r[out_buf_id][i];
-   // if (i%4==0) DEBUG(out_buf[out_buf_id][i*2]);
-   // if (out_buf[out_buf_id][i*2]) DEBF(" %d\r\n ", out_buf[out_buf_id][i*2]);
-  }
-  i2s_write(i2s_num, out_buf[out_buf_id], sizeof(out_buf[out_buf_id]), &bytes_written, portMAX_DELAY);
+  i2s_write(i2s_num, out_buf, n * 2 * sizeof(int16_t), &bytes_written, portMAX_DELAY);
 
 }
 
@@ -73,6 +63,7 @@ void i2sInit() {
   pinMode(I2S_DOUT_PIN, OUTPUT);
   pinMode(I2S_WCLK_PIN, OUTPUT);
   I2S.setPins(I2S_BCLK_PIN, I2S_WCLK_PIN, I2S_DOUT_PIN); //SCK, WS, SDOUT, SDIN, MCLK
+  // I2SClass sets up its DMA buffers itself, audioDmaBufs doesn't apply here, the block size does (i2s_output())
   I2S.begin(I2S_MODE_STD, SAMPLE_RATE, I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_STEREO);
 
   DEBF("I2S is started: BCK %d, WCK %d, DAT %d\r\n", I2S_BCLK_PIN, I2S_WCLK_PIN, I2S_DOUT_PIN);
@@ -82,89 +73,9 @@ void i2sDeinit() {
   I2S.end();
 }
 
-static void i2s_output () {
-// now out_buf is ready, output
-  for (int i=0; i < DMA_BUF_LEN; i++) {
-    out_buf[out_buf_id][i*2] = (float)0x7fff * mix_buf_l[out_buf_id][i]; 
-    out_buf[out_buf_id][i*2+1] = (float)0x7fff * mix_buf_r[out_buf_id][i];
-   // if (i%4==0) DEBUG(out_buf[out_buf_id][i*2]);
-   
-   //if (out_buf[out_buf_id][i*2]) DEBF(" %d\r\n ", out_buf[out_buf_id][i*2]);
-  }
-  I2S.write((uint8_t*)out_buf[out_buf_id], sizeof(out_buf[out_buf_id]));
+static void i2s_output (int n) {
+// now out_buf is ready (mixer() packs the frames), output
+  I2S.write((uint8_t*)out_buf, n * 2 * sizeof(int16_t));
 }
 
 #endif
-
-
-static void mixer() { // sum buffers 
-#ifdef DEBUG_MASTER_OUT
-  float meter = 0.0f;
-#endif
-  const float attenuator = 0.5f;
-  float sampler_out_l, sampler_out_r;
-  float mono_mix;
-  float dly_l, dly_r;
-  float rvb_l, rvb_r;
-  
-    for (int i=0; i < DMA_BUF_LEN; i++) {
-      
-      sampler_out_l = sampler_l[out_buf_id][i] * attenuator;
-      sampler_out_r = sampler_r[out_buf_id][i] * attenuator;
-
-  //    DJFilter.Process(&sampler_out_l, &sampler_out_r);
-
-  //    Drive.Process(&sampler_out_l, &sampler_out_r);               // overdrive // make it stereo firstly
-  //    Distortion.Process(&sampler_out_l, &sampler_out_r);             // distortion // make it stereo firstly
-/*
-      dly_l = sampler_out_l * Sampler.getDelaySendLevel(); // delay bus
-      dly_r = sampler_out_r * Sampler.getDelaySendLevel();
-      Delay.Process( &dly_l, &dly_r );
- 
-      sampler_out_l += dly_l;
-      sampler_out_r += dly_r;
-*/
-
-
-      rvb_l = sampler_out_l * Sampler.getReverbSendLevel(); // reverb bus
-      rvb_r = sampler_out_r * Sampler.getReverbSendLevel();
-      Reverb.Process( &rvb_l, &rvb_r );
-      
-      sampler_out_l += rvb_l;
-      sampler_out_r += rvb_r;
-
-      
-      mono_mix = 0.5f * (sampler_out_l + sampler_out_r);
-      
-  //    Comp.Process( mono_mix * 0.25f);  // calc compressor gain, may be side-chain driven 
-            
-  //    mix_buf_l[out_buf_id][i] = Comp.Apply(sampler_out_l);
-  //    mix_buf_r[out_buf_id][i] = Comp.Apply(sampler_out_r);
-      mix_buf_l[out_buf_id][i] = 0.6f* (sampler_out_l);
-      mix_buf_r[out_buf_id][i] = 0.6f* (sampler_out_r);
-
-#ifdef DEBUG_MASTER_OUT
-      if ( i % 16 == 0) meter = meter * 0.95f + fabs( mono_mix); 
-#endif
-
-  // if none of the following limitters is engaged, digital clipping can occur
-
-      mix_buf_l[out_buf_id][i] = fclamp(mix_buf_l[out_buf_id][i] , -1.0f, 1.0f); // clipper
-      mix_buf_r[out_buf_id][i] = fclamp(mix_buf_r[out_buf_id][i] , -1.0f, 1.0f);
-
-  //    mix_buf_l[out_buf_id][i] = fast_shape( mix_buf_l[out_buf_id][i]); // soft limitter/saturator
-  //    mix_buf_r[out_buf_id][i] = fast_shape( mix_buf_r[out_buf_id][i]);
-   }
-   
-#ifdef DEBUG_MASTER_OUT
-  meter *= 0.95f;
-  meter += fabs(mono_mix); 
-  DEBF("out= %0.5f\r\n", meter);
-#endif
-}
-
-static void  sampler_generate_buf() {
-  for (uint32_t i=0; i < DMA_BUF_LEN; i++){
-    Sampler.getSample(sampler_l[gen_buf_id][i], sampler_r[gen_buf_id][i]) ;
-  }
-}
@@ -0,0 +1,60 @@
+#pragma once
+
+// Loop bodies of the looped samples of the current folder, kept in PSRAM.
+// The voices fill an entry as they stream through the loop for the first time, then every voice of that sample
+// plays the loop from here and stops reading the card: Voice::renderBlock() points its ring at the body, and the
+// ring wrap of the kernels is the jump from the loop end to its start, sample accurate, with the interpolation
+// taps running across the seam.
+// An entry captures the body and the frames that follow it in the file. When it's complete, the first frames of
+// the body are crossfaded from those (LOOP_XFADE_FRAMES), so the jump back continues the waveform the end leads to,
+// and then they give way to the guard, a copy of the body start like the one of the rings.
+// A loop with (almost) nothing after its end, like the whole sample ones, captures the frames before its start
+// instead, and the last frames of the body are crossfaded into those, so the end leads to the start. If the start
+// is too close to the beginning of the file for that, it moves forward.
+// Filled in the Control Task (Core1); a complete entry stays as it is until the folder changes.
+
+#define LOOP_MIN_FRAMES     32    // shorter loops are played as they are
+#define LOOP_MIN_XFADE      64    // fewer frames after the end make the crossfade go to the end of the body
+
+typedef struct {
+  uint32_t  key         = 0;      // first sector of the sample file
+  uint32_t  offset      = 0;      // bytes from the beginning of _data, aligned like the loop start in the file
+  uint32_t  start       = 0;      // file byte of the loop start
+  uint32_t  bytes       = 0;      // body length
+  uint32_t  lead        = 0;      // bytes captured before the start, when the crossfade is at the end of the body
+  uint32_t  capture     = 0;      // bytes to capture from start - lead: the body and the frames around it
+  uint32_t  filled      = 0;      // captured so far
+  uint32_t  xfade       = 0;      // frames
+  uint16_t  frameBytes  = 4;
+  uint8_t   bitDepth    = 16;
+  bool      complete    = false;
+} loop_t;
+
+class LoopCache {
+  public:
+    LoopCache() {};
+    bool              init(uint32_t budgetBytes);
+    void              clear();
+    int               add(const sample_t& smp);       // entry id, -1 if it doesn't loop or the budget is over
+    // streamed file data, returns the body once the entry is complete
+    const uint8_t*    capture(int id, uint32_t key, uint32_t fileByte, const uint8_t* src, uint32_t bytes);
+    inline bool       valid(int id, uint32_t key)     {return (id >= 0 && id < (int)_loops.size() && _loops[id].key == key);}
+    inline const uint8_t* body(int id)                {return _loops[id].complete ? _data + _loops[id].offset : nullptr;}
+    inline uint32_t   getStart(int id)                {return _loops[id].start;}
+    inline uint32_t   getBytes(int id)                {return _loops[id].bytes;}
+    inline uint32_t   getCaptureEnd(int id)           {return _loops[id].start - _loops[id].lead + _loops[id].capture;}  // file byte
+    inline uint32_t   getXfade(int id)                {return _loops[id].xfade;}
+    inline uint32_t   getStartXfade(int id)           {return _loops[id].lead ? 0 : _loops[id].xfade;}  // crossfaded frames at the body start
+    inline uint32_t   getCapacity()           {return _capacity;}
+    inline uint32_t   getBytesUsed()          {return _used;}
+    inline uint32_t   getComplete()           {return _complete;}
+    inline int        size()                  {return _loops.size();}
+
+  private:
+    void              finish(loop_t& e);      // crossfade and guard
+    uint8_t*          _data                   = nullptr;  // PSRAM
+    uint32_t          _capacity               = 0;        // bytes
+    uint32_t          _used                   = 0;        // bytes
+    uint32_t          _complete               = 0;        // entries
+    std::vector<loop_t> _loops;
+};
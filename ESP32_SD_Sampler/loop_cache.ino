@@ -0,0 +1,124 @@
+#include "loop_cache.h"
+
+bool LoopCache::init(uint32_t budgetBytes) {
+  _capacity = budgetBytes;
+  _data = (uint8_t*)heap_caps_malloc( _capacity, MALLOC_CAP_SPIRAM);
+  if (_data == NULL) {
+    DEBUG("LOOP CACHE: no PSRAM, disabled");
+    _capacity = 0;
+    return false;
+  }
+  DEBF("LOOP CACHE: %d Bytes PSRAM allocated\r\n", _capacity);
+  return true;
+}
+
+
+void LoopCache::clear() {
+  _loops.clear();
+  _used = 0;
+  _complete = 0;
+}
+
+
+int LoopCache::add(const sample_t& smp) {
+  loop_t e;
+  if (_capacity == 0 || smp.loop_mode <= 0 || smp.sectors.empty() || smp.channels <= 0 || smp.bit_depth <= 0) return -1;
+  e.key = smp.sectors[0].first;
+  for (int i = 0; i < (int)_loops.size(); i++) {
+    if (_loops[i].key == e.key) return i;   // a sample shared by several notes
+  }
+  e.bitDepth    = smp.bit_depth;
+  e.frameBytes  = smp.channels * smp.bit_depth / 8;
+  int32_t frames = smp.data_size / e.frameBytes;
+  int32_t first = (smp.loop_first_smp >= 0) ? smp.loop_first_smp : 0;
+  int32_t last  = (smp.loop_last_smp >= 0) ? min(smp.loop_last_smp, frames - 1) : frames - 1; // inclusive
+  if (last + 1 - first < LOOP_MIN_FRAMES) return -1;
+  uint32_t after = (frames - 1 - last) * e.frameBytes;    // in the file, after the loop end
+  e.xfade       = min(min((uint32_t)LOOP_XFADE_FRAMES, after / e.frameBytes), (uint32_t)(last + 1 - first) / 4);
+  if (e.xfade < LOOP_MIN_XFADE) {
+    // the end fades into the frames before the start
+    e.xfade     = min((uint32_t)LOOP_XFADE_FRAMES, (uint32_t)(last + 1 - first) / 4);
+    first       = max(first, (int32_t)e.xfade);
+    e.lead      = e.xfade * e.frameBytes;
+    if (last + 1 - first < LOOP_MIN_FRAMES) return -1;
+  }
+  e.start       = smp.byte_offset + first * e.frameBytes;
+  e.bytes       = (last + 1 - first) * e.frameBytes;
+  uint32_t tail = e.lead ? 0 : e.xfade * e.frameBytes;   // room after the body for the frames it fades from
+  e.capture     = e.lead + e.bytes + min(after, max(tail, (uint32_t)RING_GUARD_BYTES));
+  e.offset      = ((_used + e.lead + 3) & ~3UL) + (e.start & 3);  // the kernels read the frames the way they are aligned in the ring
+  uint32_t end  = e.offset + e.bytes + max(tail, (uint32_t)RING_GUARD_BYTES);
+  if (end > _capacity) return -1;
+  _used = end;
+  _loops.push_back(e);
+  return _loops.size() - 1;
+}
+
+
+const uint8_t* LoopCache::capture(int id, uint32_t key, uint32_t fileByte, const uint8_t* src, uint32_t bytes) {
+  if (!valid(id, key)) return nullptr;
+  loop_t& e = _loops[id];
+  if (e.complete) return _data + e.offset;
+  uint32_t at = e.start - e.lead + e.filled;   // the next byte it needs
+  if (fileByte > at || fileByte + bytes <= at) return nullptr;
+  uint32_t n = min(fileByte + bytes - at, e.capture - e.filled);
+  memcpy(_data + e.offset - e.lead + e.filled, src + (at - fileByte), n);
+  e.filled += n;
+  if (e.filled < e.capture) return nullptr;
+  finish(e);
+  return _data + e.offset;
+}
+
+
+// one channel, top aligned
+static inline int32_t loopGet(const uint8_t* p, int bits) {
+  switch (bits) {
+    case 8:   return ((int32_t)p[0] - 128) << 24;
+    case 16:  return (int32_t)(((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 24));
+    case 24:  return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24));
+    default:  return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+  }
+}
+
+static inline void loopPut(uint8_t* p, int bits, int32_t v) {
+  switch (bits) {
+    case 8:   p[0] = (uint8_t)((v >> 24) + 128); break;
+    case 16:  p[0] = v >> 16; p[1] = v >> 24; break;
+    case 24:  p[0] = v >> 8; p[1] = v >> 16; p[2] = v >> 24; break;
+    default:  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; break;
+  }
+}
+
+
+void LoopCache::finish(loop_t& e) {
+  uint8_t* body = _data + e.offset;
+  const int bytes = e.bitDepth / 8;
+  const int64_t den = 2 * e.xfade;
+  if (e.lead) {
+    // the last frames of the body are blended from their own ones to the frames before the start, so the end leads into it
+    uint8_t* fade = body + e.bytes - e.lead;
+    for (uint32_t k = 0; k < e.xfade; k++) {
+      const int64_t w = 2 * k + 1;
+      for (uint32_t c = 0; c < e.frameBytes; c += bytes) {
+        uint8_t* p = fade + k * e.frameBytes + c;
+        int64_t own = loopGet(p, e.bitDepth);
+        int64_t before = loopGet(p - e.bytes, e.bitDepth);
+        loopPut(p, e.bitDepth, (int32_t)((own * (den - w) + before * w) / den));
+      }
+    }
+  } else {
+    // frame k of the body is blended from frame k after the loop end to its own one, so the end flows into the start
+    for (uint32_t k = 0; k < e.xfade; k++) {
+      const int64_t w = 2 * k + 1;
+      for (uint32_t c = 0; c < e.frameBytes; c += bytes) {
+        uint8_t* p = body + k * e.frameBytes + c;
+        int64_t own = loopGet(p, e.bitDepth);
+        int64_t next = loopGet(p + e.bytes, e.bitDepth);
+        loopPut(p, e.bitDepth, (int32_t)((own * w + next * (den - w)) / den));
+      }
+    }
+  }
+  for (uint32_t i = 0; i < RING_GUARD_BYTES; i++) body[e.bytes + i] = body[i % e.bytes];
+  e.complete = true;
+  _complete++;
+}
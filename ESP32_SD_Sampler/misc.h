@@ -1,7 +1,9 @@
 #pragma once
 
-#define DMA_NUM_BUF 2                     // number of I2S buffers, 2 should be enough
-#define DMA_BUF_LEN 64                    // length of I2S buffers use 8 samples or more
+#define DMA_NUM_BUF 2                     // number of I2S buffers, 2 should be enough; the default, sampler.ini can set it per sample set
+#define DMA_BUF_LEN 64                    // length of I2S buffers use 8 samples or more; the default audio block, sampler.ini can set it too
+#define MAX_BLOCK_LEN 128                 // the longest audio block, the block buffers are sized for it
+#define MAX_DMA_BUF 8                     // the most I2S buffers sampler.ini may ask for
 #define FASTLED_INTERNAL                  // remove annoying pragma messages
 
 const float MIDI_NORM           = (1.0f / 127.0f);
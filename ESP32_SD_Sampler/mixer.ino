@@ -0,0 +1,90 @@
+// The audio path that doesn't depend on the output: the voices sum into sampler_l/r, then mixer() takes that block
+// through the effects, the master gain and the clipper and packs it as 16 bit L+R frames into out_buf, in a single
+// pass: no stereo mix buffer in between. i2s_output() sends out_buf to the DAC, the host renderer writes it to a WAV file.
+// The only other pass is the reverb send, which ProcessMono() needs as a whole block, as a mono bus on the stack.
+// The arithmetic goes through fixed_point.h, so it's float or fixed point as the engine is built.
+
+//#define DEBUG_MASTER_OUT
+
+static void mixer(int n) { // sum buffers, n <= MAX_BLOCK_LEN 
+#ifdef DEBUG_MASTER_OUT
+  float meter = 0.0f;
+  float mono_mix;
+#endif
+  const gain_t attenuator = GAIN(0.5f);
+  const gain_t reverbSend = GAIN(Sampler.getReverbSendLevel());
+  const gain_t master = GAIN(0.6f);
+  mix_t sampler_out_l, sampler_out_r;
+  mix_t dly_l, dly_r;
+  mix_t rvb_l, rvb_r;
+  mix_t rvb_bus[MAX_BLOCK_LEN];
+
+    // the reverb bus goes through the reverb a block at a time, the voices are attenuated in place on the way
+    for (int i=0; i < n; i++) {
+      sampler_l[i] = mixMul(sampler_l[i], attenuator);
+      sampler_r[i] = mixMul(sampler_r[i], attenuator);
+      rvb_l = mixMul(sampler_l[i], reverbSend);
+      rvb_r = mixMul(sampler_r[i], reverbSend);
+      rvb_bus[i] = FxReverb::Mono(rvb_l, rvb_r);
+    }
+    Reverb.ProcessMono( rvb_bus, n );
+  
+    for (int i=0; i < n; i++) {
+      
+      sampler_out_l = sampler_l[i];
+      sampler_out_r = sampler_r[i];
+
+  //    DJFilter.Process(&sampler_out_l, &sampler_out_r);
+
+  //    Drive.Process(&sampler_out_l, &sampler_out_r);               // overdrive // make it stereo firstly
+  //    Distortion.Process(&sampler_out_l, &sampler_out_r);             // distortion // make it stereo firstly
+/*
+      dly_l = sampler_out_l * Sampler.getDelaySendLevel(); // delay bus
+      dly_r = sampler_out_r * Sampler.getDelaySendLevel();
+      Delay.Process( &dly_l, &dly_r );
+ 
+      sampler_out_l += dly_l;
+      sampler_out_r += dly_r;
+*/
+
+      // the send again (a multiply is cheaper than a buffer) and the return
+      rvb_l = mixAdd(mixMul(sampler_out_l, reverbSend), rvb_bus[i]);
+      rvb_r = mixAdd(mixMul(sampler_out_r, reverbSend), rvb_bus[i]);
+      sampler_out_l = mixAdd(sampler_out_l, rvb_l);
+      sampler_out_r = mixAdd(sampler_out_r, rvb_r);
+
+#ifdef DEBUG_MASTER_OUT
+      mono_mix = 0.5f * (mixToFloat(sampler_out_l) + mixToFloat(sampler_out_r));
+#endif
+      
+  //    Comp.Process( mono_mix * 0.25f);  // calc compressor gain, may be side-chain driven 
+            
+  //    sampler_out_l = Comp.Apply(sampler_out_l);
+  //    sampler_out_r = Comp.Apply(sampler_out_r);
+      sampler_out_l = mixMul(sampler_out_l, master);
+      sampler_out_r = mixMul(sampler_out_r, master);
+
+#ifdef DEBUG_MASTER_OUT
+      if ( i % 16 == 0) meter = meter * 0.95f + fabs( mono_mix); 
+#endif
+
+  //    sampler_out_l = fast_shape( sampler_out_l); // soft limitter/saturator
+  //    sampler_out_r = fast_shape( sampler_out_r);
+
+  // if none of the limitters above is engaged, digital clipping can occur
+
+      out_buf[i*2] = mixClipToInt16(sampler_out_l); // clipper, and the 16 bit frame
+      out_buf[i*2+1] = mixClipToInt16(sampler_out_r);
+   }
+   
+#ifdef DEBUG_MASTER_OUT
+  meter *= 0.95f;
+  meter += fabs(mono_mix); 
+  DEBF("out= %0.5f\r\n", meter);
+#endif
+}
+
+static void  sampler_generate_buf(int n) {
+  Sampler.processCommands(n); // note ons and offs, pitch, sustain from the Control Task, each at its frame of the block
+  Sampler.renderBlock(sampler_l, sampler_r, n);
+}
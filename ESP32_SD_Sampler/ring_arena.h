@@ -0,0 +1,24 @@
+#pragma once
+
+// Internal RAM shared by the voice ring buffers.
+// A voice takes a contiguous run of sectors on start, its length depends on the voice byte rate, and gives it back
+// when it's over. First fit over a bitmap of sectors: the arena is small, and the runs are just a few dozens of sectors.
+// It's only called in the Control Task (Core1).
+
+class RingArena {
+  public:
+    RingArena() {};
+    bool              init(uint32_t sectors);
+    uint8_t*          alloc(uint32_t sectors);        // nullptr if there's no run that long
+    void              free(uint8_t* ptr, uint32_t sectors);
+    inline uint32_t   getSectorsFree()        {return _free;}
+    inline uint32_t   getSectorsTotal()       {return _sectors;}
+
+  private:
+    inline bool       isUsed(uint32_t i)      {return _map[i >> 5] & (1UL << (i & 31));}
+    void              mark(uint32_t first, uint32_t count, bool used);
+    uint8_t*          _data                   = nullptr;
+    uint32_t          _sectors                = 0;
+    uint32_t          _free                   = 0;
+    std::vector<uint32_t> _map;                       // bit per sector, 1 = used
+};
@@ -0,0 +1,52 @@
+#include "ring_arena.h"
+
+bool RingArena::init(uint32_t sectors) {
+  _data = (uint8_t*)heap_caps_malloc( sectors * BYTES_PER_SECTOR, MALLOC_CAP_INTERNAL);
+  if (_data == NULL) {
+    DEBUG("No more RAM for voice rings!");
+    return false;
+  }
+  _sectors = sectors;
+  _free = sectors;
+  _map.assign((sectors + 31) / 32, 0);
+  DEBF("%d Bytes RAM allocated for voice rings\r\n", sectors * BYTES_PER_SECTOR);
+  return true;
+}
+
+
+uint8_t* RingArena::alloc(uint32_t sectors) {
+  uint32_t run = 0;
+  if (sectors == 0 || sectors > _free) return nullptr;
+  for (uint32_t i = 0; i < _sectors; i++) {
+    if (isUsed(i)) {
+      run = 0;
+      continue;
+    }
+    run++;
+    if (run == sectors) {
+      uint32_t first = i + 1 - sectors;
+      mark(first, sectors, true);
+      _free -= sectors;
+      return _data + first * BYTES_PER_SECTOR;
+    }
+  }
+  return nullptr;
+}
+
+
+void RingArena::free(uint8_t* ptr, uint32_t sectors) {
+  if (ptr == nullptr) return;
+  mark((ptr - _data) / BYTES_PER_SECTOR, sectors, false);
+  _free += sectors;
+}
+
+
+void RingArena::mark(uint32_t first, uint32_t count, bool used) {
+  for (uint32_t i = first; i < first + count; i++) {
+    if (used) {
+      _map[i >> 5] |= (1UL << (i & 31));
+    } else {
+      _map[i >> 5] &= ~(1UL << (i & 31));
+    }
+  }
+}
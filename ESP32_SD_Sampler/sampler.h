@@ -3,13 +3,20 @@
 #define WAV_CHANNELS          2           // do not change, not implemented
 #define MAX_CONFIG_LINE_LEN   256         // 4 < x < 256 , must be divisible by 4, no need to change this
 #define STR_LEN               MAX_CONFIG_LINE_LEN
+#define LATENCY_BIN_US        250         // note-on to first sound histogram: bin width
+#define LATENCY_BINS          64          //   and bins, the last one takes all the longer ones
+#define MAX_BLOCK_CMDS        64          // commands a block takes from the queue, the others wait for the next one
+
+#ifndef LATENCY_CLOCK
+  #define LATENCY_CLOCK()     micros()    // the note-on stamps, the host renderer counts audio time instead
+#endif
 
 #include <vector>
 #include <FixedString.h>
 #include "voice.h"
 #include "sdmmc.h"
+#include "cmd_queue.h"
 
-enum eVoiceAlloc_t  { VA_OLDEST, VA_MOST_QUIET, VA_PERCEPTUAL, VA_NUMBER }; // not implemented
 enum eVeloCurve_t   { VC_LINEAR, VC_CUSTOM, VC_SOFT1, VC_SOFT2, VC_SOFT3, VC_HARD1, VC_HARD2, VC_HARD3, VC_CONST, VC_NUMBER }; // VC_LINEAR, VC_CUSTOM implemented
 enum eItem_t        { P_NUMBER, P_NAME, P_MIDINOTE, P_OCTAVE, P_SEPARATOR, P_VELO, P_INSTRUMENT }; // filename template elements 
 enum eInstr_t       { SMP_MELODIC, SMP_PERCUSSIVE }; 
@@ -63,6 +70,7 @@ typedef struct {
   float       decay_time    = 0.01f;
   float       sustain_level = 1.0f;
   float       release_time  = 0.05f;
+  bool        loop          = false; // LOOP = true of its range: the whole sample, if the file has no loop points
 } midikey_t;
 
 typedef struct {
@@ -70,6 +78,54 @@ typedef struct {
   str20_t     item_str;
 } template_item_t;
 
+// folder index file (INDEX_FILE) layout: header, samples, chains, map cells
+#define INDEX_MAGIC           "SIDX"
+#define INDEX_VERSION         2           // 2: loop points from the smpl chunk
+#define INDEX_NO_SAMPLE       0xFFFF
+
+typedef struct __attribute__((packed)) {
+  char        magic[4];
+  uint16_t    version;
+  uint16_t    velo_layers;        // cells stored = 128 * velo_layers
+  uint32_t    stamp;              // SDMMC_FAT32::stampCurrentDir() plus build constants
+  uint32_t    samples;
+  uint32_t    chains;
+  uint32_t    size;               // total bytes
+  uint32_t    checksum;           // fnv1a of everything after the header
+} idx_header_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t    size;
+  uint32_t    data_size;
+  int32_t     byte_offset;
+  int32_t     sample_rate;
+  int16_t     channels;
+  int16_t     bit_depth;
+  int32_t     loop_mode;
+  int32_t     loop_first_smp;
+  int32_t     loop_last_smp;
+  uint32_t    first_chain;
+  uint32_t    num_chains;
+} idx_sample_t;
+
+typedef struct __attribute__((packed)) {
+  uint16_t    sample;             // index in the samples table or INDEX_NO_SAMPLE
+  uint8_t     orig_velo_layer;
+  uint8_t     native_freq;
+  float       orig_freq;
+  float       speed;
+  float       amp;
+} idx_cell_t;
+
+
+// SD read scheduler statistics, per voice
+typedef struct {
+  uint32_t    reads       = 0;
+  uint32_t    first_fills = 0;
+  int32_t     min_slack   = INT32_MAX;  // us left till underrun when a read completed
+  int64_t     sum_slack   = 0;
+  uint32_t    underruns   = 0;          // Voice::getUnderruns() at the last report
+} sched_stat_t;
 
 const str8_t notes[2][12]= {
   {"C","C#","D","D#","E","F","F#","G","G#","A","A#","B"},
@@ -83,7 +139,8 @@ class SamplerEngine {
     void            init(SDMMC_FAT32* Card);
     void            initKeyboard();
     void            fadeOut(int id);
-    void            getSample(float& sampleL, float& sampleR);
+    void            renderBlock(mix_t* L, mix_t* R, int n); // Core0: the sum of all the voices, n <= MAX_BLOCK_LEN
+    void            processCommands(int n);                 // Core0, before renderBlock(): the frames of the commands in the block of n
     fname_t         getFolderName(int id)                 { return _folders[id]; }
     fname_t         getCurrentFolder()                    { return _currentFolder; }
     int             getActiveVoices();
@@ -94,6 +151,7 @@ class SamplerEngine {
     inline void     setRootFolder(const fname_t& rf)      { _rootFolder = rf; }
     inline void     setMaxVoices(byte mv)                 { _maxVoices = constrain(mv, 1, MAX_POLYPHONY); }
     inline void     setVoiceAllocMethod(eVoiceAlloc_t va) { _voiceAllocMethod = va ; }
+    inline eVoiceAlloc_t getVoiceAllocMethod()            { return _voiceAllocMethod; }
     inline void     setCurrentFolder(int folder_id);        // sets current folder to the desired path[folder_id]
     inline void     setNextFolder();                        // sets current folder to the next dir which was found during scanFolders()
     inline void     setPrevFolder();                        // sets current folder to the previous dir which was found during scanFolders()
@@ -107,6 +165,26 @@ class SamplerEngine {
     inline float    getReverbSendLevel()                  {return _sendReverb;}
     inline float    getVolume()                           {return _amp;}
     inline float    getPano()                             {return _pano;}
+    inline SectorCache& getSectorCache()                  {return _Sectors;}
+    inline void     setInterpolation(eInterp_t q)         {_interpMax = q;}        // the best tier the governor may give
+    inline void     setRenderBudget(uint32_t us)          {_renderBudgetUs = us;}  // voice rendering time per block, 0 = no limit
+    inline uint32_t getRenderBudget()                     {return _renderBudgetUs;}
+    inline eInterp_t getInterpolation()                   {return _interpMax;}
+    inline uint32_t getInterpBlocks(int q)                {return _interpBlocks[q];}  // voice blocks played with eInterp_t q
+    inline float    getInterpCost(int q)                  {return interpWeight[q] * _linearCostUs;}  // us per voice and block
+    inline void     setAdmissionBudget(uint32_t percent)  {_admitBudget = percent;}  // of the card throughput, 0 = admit every note
+    inline void     setCardRate(float mbs)                {_cardRate = mbs; _cardRateFixed = true;}  // instead of measuring it, MB/s = bytes per us
+    inline float    getCardRate()                         {return _cardRate;}
+    inline void     setAudioBlock(int len, int bufs)      {_blockLen = constrain(len, 8, MAX_BLOCK_LEN); _dmaBufs = constrain(bufs, 2, MAX_DMA_BUF);}
+    inline int      getBlockLen()                         {return _blockLen;}   // wanted, the audio task reinitializes I2S when they change
+    inline int      getDmaBufs()                          {return _dmaBufs;}
+    void            blockChanged(int len, int bufs);        // Core0: I2S runs with the new block, between the blocks
+    void            blockOut(uint32_t firstSampleUs);       // Core0: the block is handed to I2S, its first sample sounds at LATENCY_CLOCK() firstSampleUs
+    uint32_t        getLatencyNotes()                     {return _latencyNotes;}
+    float           getLatencyMs(float share);              // note-on to first sound, the share of the notes that made it that fast, 1.0 = the slowest
+    float           getJitterMs();                          // standard deviation of the note-on latency
+    inline void     setSampleAccurate(bool on)            {_sampleAccurate = on;}  // false: the commands take effect at the block start
+    inline bool     getSampleAccurate()                   {return _sampleAccurate;}
     
     void            storeGroup( variants_t& vars );
     void            setSustainLevel(float seconds);
@@ -115,11 +193,22 @@ class SamplerEngine {
     void            setReleaseTime(float seconds);
     inline void     noteOn(uint8_t midiNote, uint8_t velocity);
     inline void     noteOff(uint8_t midiNote, Adsr::eEnd_t end_type = Adsr::END_REGULAR);
-    void            fillBuffer();
+    void            fillBuffer();                           // serves one SD read: first fills, then the earliest deadline
+    void            printSchedStats();
     
   private:
     SDMMC_FAT32*    _Card;
     inline int      assignVoice(byte midi_note, byte midi_velocity);    // returns id of a slot to use for a new note
+    inline bool     startVoice(int i, uint8_t midiNote, uint8_t velo, uint32_t stamp);  // prepares a free voice and hands it over to Core0
+    void            startDeferred();            // notes waiting for their stolen voices to be over
+    void            governInterpolation();      // Core0: the tiers of the playing voices for the next block
+    inline void     endVoice(int i, Adsr::eEnd_t end_type);
+    inline void     stealVoice(int i, Adsr::eEnd_t end_type);   // endVoice() of a playing note, for a new one or the polyphony
+    inline bool     admit(int i, const sample_t& smp);          // false if the card can't feed a voice of smp, voice i is being taken for it
+    inline float    streamRate(const sample_t& smp);            // bytes per us a new voice of smp takes from the card
+    float           cardDemand(int except);                     // bytes per us of the voices that stream from the card, and of the deferred notes
+    inline void     post(eCmd_t type, int voice = 0, uint8_t arg = 0, float value = 0.0f);
+    inline void     applyCommand(const cmd_t& cmd);         // Core0
     void            parseIni();                  // loads config from current folder, determining how wav files spread over the notes/velocities
     bool            parseFilenameTemplate(str256_t& line);
     void            processNameParser(entry_t* entry);
@@ -133,6 +222,14 @@ class SamplerEngine {
     void            parseWavHeader(entry_t* entry, sample_t& smp);
     void            applyRange(ini_range_t& range);
     void            finalizeMapping();
+    void            buildHeadCache();           // assigns HeadCache entries to the mapped samples, they are filled in fillBuffer() later
+    void            initCaches();               // head, sector and loop caches, sized to the free PSRAM
+    uint32_t        psramBudgetKb(uint32_t wantKb);  // what a cache can have of it now
+    void            buildLoopCache();           // assigns LoopCache entries to the looped samples, the voices fill them
+    bool            parseSmplChunk(const uint8_t* buf, int len, sample_t& smp); // loop points, false if there's no smpl chunk
+    uint32_t        indexStamp(entry_t* idx);   // stamp of the current folder, INDEX_FILE entry goes to *idx
+    bool            loadIndex();                // restores _sampleMap from INDEX_FILE if it's valid for the current folder
+    void            saveIndex();
     void            buildVeloCurve();
     uint8_t         mapVelo(uint8_t velo);
     uint8_t         unMapVelo(uint8_t mappedVelo);
@@ -165,13 +262,70 @@ class SamplerEngine {
     float           _sustainLevel         = 1.0f;
     float           _speed                = 1.0f;
     int             _pitchBendSemitones   = 2;
-    eVoiceAlloc_t   _voiceAllocMethod     = VA_OLDEST; // not implemented, VA_PERCEPTUAL is gonna be the only one
+    eVoiceAlloc_t   _voiceAllocMethod     = VA_PERCEPTUAL;
+    uint32_t        _steals               = 0;      // statistics
+    uint32_t        _heldSteals           = 0;      // the notes cut before their release, the ones you hear
+    float           _heldDbSum            = 0.0f;   // levels of the stolen voices
+    float           _releasedDbSum        = 0.0f;
+#ifdef ADMISSION_CONTROL
+    uint32_t        _admitBudget          = ADMISSION_BUDGET;
+#else
+    uint32_t        _admitBudget          = 0;
+#endif
+    float           _cardRate             = 5.0f;   // MB/s of the card reads, a guess for the first notes, then measured in fillBuffer()
+    bool            _cardRateFixed        = false;
+    float           _demandPeak           = 0.0f;   // statistics, MB/s
+    uint32_t        _admitted             = 0;
+    uint32_t        _madeRoom             = 0;      // notes that took the bandwidth of a released voice
+    uint32_t        _refused              = 0;
     int             _parser_i             = 0;
     bool            _normalized           = false;
     bool            _sustain              = false;
+    bool            _sustainPlay          = false;  // Core0 copy, the voices look at it
+    CmdQueue        _Cmds                  ;
+    uint32_t        _cmdStalls            = 0;      // times the queue was full
+    cmd_t           _blockCmds[MAX_BLOCK_CMDS];     // Core0: the ones of the block being rendered, by frame
+    int             _blockCmdCount        = 0;
+#ifdef SAMPLE_ACCURATE_MIDI
+    bool            _sampleAccurate       = true;
+#else
+    bool            _sampleAccurate       = false;
+#endif
+    uint8_t         _deferredNote[MAX_POLYPHONY];   // 255 = none
+    uint8_t         _deferredVelo[MAX_POLYPHONY];
+    uint32_t        _deferredStamp[MAX_POLYPHONY];
+    uint32_t        _noteStamp[MAX_POLYPHONY];      // LATENCY_CLOCK() at the note-on of the note a voice plays, Core1 sets it before CMD_START
+    uint32_t        _startStamp[MAX_POLYPHONY];     // Core0: of the notes started in the block being rendered
+    int             _starts               = 0;
+    int             _blockLen             = DMA_BUF_LEN;  // wanted audio block
+    int             _dmaBufs              = DMA_NUM_BUF;
+    int             _blockLenOut          = DMA_BUF_LEN;  // the one I2S runs with, for the latency report
+    int             _dmaBufsOut           = DMA_NUM_BUF;
+    uint32_t        _latencyHist[LATENCY_BINS] = {0}; // statistics, Core0
+    uint32_t        _latencyNotes         = 0;
+    uint32_t        _latencyMinUs         = UINT32_MAX;
+    uint32_t        _latencyMaxUs         = 0;
+    uint64_t        _latencySumUs         = 0;
+    double          _latencySqSum         = 0.0;    // us^2
     eInstr_t        _type                 = SMP_MELODIC;
     str64_t         _title                = "";
+    RingArena       _Arena                 ;
+    HeadCache       _Heads                 ;
+    SectorCache     _Sectors               ;
+    LoopCache       _Loops                 ;
+    voice_bank_t    _Bank                  ;
+    eInterp_t       _interpMax            = (eInterp_t)INTERP_QUALITY;
+    uint32_t        _renderBudgetUs       = 0;      // 0 = every voice plays at _interpMax
+    float           _linearCostUs         = 6.0f;   // a voice block with linear interpolation, a guess for 240 MHz, learned while playing
+    float           _blockWeight          = 0.0f;   // of the block being rendered, in linear voice blocks
+    float           _levelFall            = 0.97f;  // LEVEL_FALL over a block, for Voice::endBlock()
+    uint32_t        _interpBlocks[INTERP_COPY + 1] = {0}; // statistics
     Voice           Voices[MAX_POLYPHONY]  ;
+    sched_stat_t    _schedStats[MAX_POLYPHONY];
+    uint32_t        _readTimeUs           = 2000;   // running average of a READ_BUF_SECTORS read
+    uint32_t        _readsSinceHead       = 0;      // voice card reads since the last head cache read, for HEAD_FILL_SHARE
+    uint32_t        _schedStatsTime       = 0;
+    uint64_t        _schedStatsSaved      = 0;      // sector cache bytes saved at the previous report
     variants_t      _veloVars              ;
     std::vector<fname_t>          _folders ;
     std::vector<template_item_t>  _template;
@@ -12,11 +12,22 @@ void SamplerEngine::init(SDMMC_FAT32* Card){
   }
   DEBF("Total %d folders with samples found\r\n", num_sets);
   initKeyboard();
+  if (!_Arena.init(RING_ARENA_SECTORS)) {
+    DEBUG("SAMPLER: INIT: NOT ENOUGH MEMORY");
+    delay(100);
+    while(1){;}
+  }
+  initCaches();
+  initSincTables();
+#ifdef INTERP_GOVERNOR
+  _renderBudgetUs = (uint64_t)_blockLenOut * 1000000 / SAMPLE_RATE * RENDER_BUDGET / 100;
+#endif
+  _levelFall = powf(LEVEL_FALL, (float)_blockLenOut);
   for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
-    DEBF("Voice %d: ", i);
     // sustain is global and needed for every voice, so we just pass a pointer to it.
-    Voices[i].init(Card, &_sustain, &_normalized);
+    Voices[i].init(Card, &_Arena, &_Heads, &_Sectors, &_Loops, &_Bank, Voices, &_sustainPlay, &_normalized);
     Voices[i].my_id = i;
+    _deferredNote[i] = 255;
   }
   if (num_sets > 0) {
     setSampleRate(SAMPLE_RATE);
@@ -33,29 +44,23 @@ void SamplerEngine::init(SDMMC_FAT32* Card){
 }
 
 int SamplerEngine::scanRootFolder() {  
-  fpath_t dirname;
+  std::vector<fname_t> dirs;
   DEBUG("SAMPLER: Scanning root folder");
-  SDMMC_FileReader Reader(_Card);
   _rootFolder = ROOT_FOLDER;
   _folders.clear();
   _Card->setCurrentDir(_rootFolder);
+  _Card->listCurrentDir(dirs, true);
   int index = 0;
-  while (true) {
-    entry_t* entry = _Card->nextEntry();
-    if (entry->is_end) break;
-    if (entry->is_dir) {
-      point_t p = _Card->getCurrentPoint();
-      dirname = entry->name;      
-      DEBUG(dirname.c_str());
-      _Card->setCurrentDir(dirname);
-      if (Reader.open(INI_FILE) == ESP_OK ) {
-        Reader.close();
-        _folders.push_back(dirname);
-        index++;
-      }
-      _Card->setCurrentPoint(p);
+  for (auto& dirname: dirs) {
+    DEBUG(dirname.c_str());
+    _Card->setCurrentDir(_rootFolder);  // both are O(1) lookups in the cached directory indexes
+    _Card->setCurrentDir(dirname);
+    if (_Card->findEntry(INI_FILE)->is_end == 0) {
+      _folders.push_back(dirname);
+      index++;
     }
   }
+  _Card->setCurrentDir(_rootFolder);
   _sampleSetsCount = index;
   return index;
 }
@@ -73,8 +78,10 @@ inline int SamplerEngine::assignVoice(byte midi_note, byte velo){
   }  
 
   for (int i = 0 ; i < _maxVoices ; i++) {
-    if (Voices[i].getKillScore() > maxVictimScore){
-      maxVictimScore = Voices[i].getKillScore();
+    if (_deferredNote[i] != 255) continue;   // it's been stolen already
+    float score = Voices[i].getKillScore(_voiceAllocMethod);
+    if (score > maxVictimScore){
+      maxVictimScore = score;
       id = i;
     }
   }
@@ -83,8 +90,10 @@ inline int SamplerEngine::assignVoice(byte midi_note, byte velo){
 }
 
 inline void SamplerEngine::noteOn(uint8_t midiNote, uint8_t velo){
+  uint32_t stamp = LATENCY_CLOCK();
+  startDeferred();  // they came first
   int i = assignVoice(midiNote, velo);
-  sample_t smp = _sampleMap[midiNote][mapVelo(velo)];
+  sample_t& smp = _sampleMap[midiNote][mapVelo(velo)];
   for (int n = 0; n < ( ( MAX_NOTES_PER_GROUP - 1 ) * MAX_GROUPS_CROSSES ); n++ ) {
     if (_groups[midiNote][n] == 255) break;    // terminate
     DEBF("SAMPLER: GROUP KILL: %d\r\n", _groups[midiNote][n]);
@@ -92,38 +101,199 @@ inline void SamplerEngine::noteOn(uint8_t midiNote, uint8_t velo){
   }
   if (smp.channels > 0) {
    // DEBF("SAMPLER: voice %d note %d velo %d\r\n", i, midiNote, velo);
-    Voices[i].setStarted(false);
-    Voices[i].setAttackTime(_keyboard[midiNote].attack_time);
-    Voices[i].setDecayTime(_keyboard[midiNote].decay_time);
-    Voices[i].setReleaseTime(_keyboard[midiNote].release_time);
-    Voices[i].setSustainLevel(_keyboard[midiNote].sustain_level);
-    Voices[i].start(_sampleMap[midiNote][mapVelo(velo)], midiNote, velo);
+    if (!admit(i, smp)) return;
+    if (Voices[i].isActive()) {
+      // Core0 may be in the middle of a block with it: it's killed now, and the note starts when it's over
+      stealVoice(i, Adsr::END_NOW);
+      _deferredNote[i] = midiNote;
+      _deferredVelo[i] = velo;
+      _deferredStamp[i] = stamp;
+      return;
+    }
+    startVoice(i, midiNote, velo, stamp);
   } else {
     DEBUG("SAMPLER: no sample assigned");
     return;
   }
 }
 
+inline bool SamplerEngine::startVoice(int i, uint8_t midiNote, uint8_t velo, uint32_t stamp) {
+  Voices[i].setAttackTime(_keyboard[midiNote].attack_time);
+  Voices[i].setDecayTime(_keyboard[midiNote].decay_time);
+  Voices[i].setReleaseTime(_keyboard[midiNote].release_time);
+  Voices[i].setSustainLevel(_keyboard[midiNote].sustain_level);
+  if (!Voices[i].start(_sampleMap[midiNote][mapVelo(velo)], midiNote, velo)) return false;
+  _noteStamp[i] = stamp;
+  post(CMD_START, i);
+  return true;
+}
+
+void SamplerEngine::startDeferred() {
+  for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
+    if (_deferredNote[i] == 255 || Voices[i].isActive()) continue;
+    startVoice(i, _deferredNote[i], _deferredVelo[i], _deferredStamp[i]);
+    _deferredNote[i] = 255;
+  }
+}
+
 inline void SamplerEngine::noteOff(uint8_t midiNote, Adsr::eEnd_t end_type ){
   if (_keyboard[midiNote].noteoff || end_type!= Adsr::END_REGULAR) {
     for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
+      if (_deferredNote[i] == midiNote) _deferredNote[i] = 255; // it hasn't even started
       if (Voices[i].getMidiNote() == midiNote && Voices[i].isActive()) {      
         // DEBF("SAMPLER: NOTE OFF Voice %d note %d \r\n", i, midiNote);
-        Voices[i].setPressed(false);
-        Voices[i].end(end_type);
+        if (end_type == Adsr::END_FAST) Voices[i].setDying();
+        post(CMD_NOTE_OFF, i, end_type);
       }
     }
   }
 }
 
+inline void SamplerEngine::endVoice(int i, Adsr::eEnd_t end_type) {
+  if (end_type == Adsr::END_NOW || end_type == Adsr::END_FAST) Voices[i].setDying();
+  post(CMD_END, i, end_type);
+}
+
+inline void SamplerEngine::stealVoice(int i, Adsr::eEnd_t end_type) {
+  float db = 20.0f * log10f(Voices[i].getAmplitude() + LEVEL_FLOOR);
+  _steals++;
+  if (Voices[i].isHeld()) {
+    _heldSteals++;
+    _heldDbSum += db;
+  } else {
+    _releasedDbSum += db;
+  }
+  endVoice(i, end_type);
+}
+
+// The card has to feed every voice that streams from it. A note that would take more than _admitBudget percent of
+// what it delivers gets the bandwidth of the streaming voice that will be missed the least, which fades out the way
+// the polyphony steals do, or, if no single voice frees enough, it isn't played: an underrun would cut some note
+// with a click anyway.
+inline bool SamplerEngine::admit(int i, const sample_t& smp) {
+  float need = streamRate(smp);
+  if (_admitBudget == 0 || need == 0.0f) {
+    _admitted++;
+    return true;
+  }
+  float demand = cardDemand(i) + need;   // voice i, if it's playing, is being stolen for this note
+  float budget = _cardRate * (float)_admitBudget * 0.01f;
+  if (!_Heads.complete()) budget *= (float)HEAD_FILL_SHARE / (float)(HEAD_FILL_SHARE + 1); // the heads' share of the reads
+  float over = demand - budget;
+  _demandPeak = max(_demandPeak, demand);
+  if (over <= 0.0f) {
+    _admitted++;
+    return true;
+  }
+  float maxScore = 0.0f;
+  int id = -1;
+  for (int j = 0; j < _maxVoices; j++) {
+    if (j == i || !Voices[j].isActive() || Voices[j].getCardRate() < over) continue;
+    float score = Voices[j].getKillScore(_voiceAllocMethod);
+    if (score > maxScore) {
+      maxScore = score;
+      id = j;
+    }
+  }
+  if (id < 0) {
+    _refused++;
+    DEBF("SAMPLER: ADMISSION: note refused, %.2f of %.2f MB/s\r\n", demand, _cardRate);
+    return false;
+  }
+  stealVoice(id, Adsr::END_FAST);  // the fade of the polyphony steals, and the card doesn't feed it anymore
+  _madeRoom++;
+  DEBF("SAMPLER: ADMISSION: voice %d released for the bandwidth\r\n", id);
+  return true;
+}
+
+inline float SamplerEngine::streamRate(const sample_t& smp) {
+  if (smp.sectors.empty()) return 0.0f;
+  uint32_t sectors = (smp.size + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+  if (_Heads.covers(smp.head, smp.sectors[0].first, 0, sectors)) return 0.0f; // it's all in PSRAM
+  return (float)(smp.channels * smp.bit_depth / 8) * smp.speed * _speed / US_PER_SAMPLE;
+}
+
+float SamplerEngine::cardDemand(int except) {
+  float demand = 0.0f;
+  for (int j = 0; j < MAX_POLYPHONY; j++) {
+    if (j != except && Voices[j].isActive()) demand += Voices[j].getCardRate();
+    if (_deferredNote[j] != 255) demand += streamRate(_sampleMap[_deferredNote[j]][mapVelo(_deferredVelo[j])]);
+  }
+  return demand;
+}
+
+inline void SamplerEngine::post(eCmd_t type, int voice, uint8_t arg, float value) {
+  // a start is as late as its note-on, a deferred one too
+  cmd_t cmd = {type, (uint8_t)voice, arg, 0, value, (type == CMD_START) ? _noteStamp[voice] : LATENCY_CLOCK()};
+  while (!_Cmds.push(cmd)) { // Core0 drains it every audio block
+    _cmdStalls++;
+    taskYIELD();
+  }
+}
+
+void SamplerEngine::processCommands(int n) { // audio task, Core0
+  // a command takes effect a block time after it came in, so it lands on its own frame of this block and the
+  // latency is a constant instead of anything up to a block. The late ones (deferred notes, queue stalls)
+  // take the first frame, and none goes before one posted earlier: the order of the queue holds.
+  const uint32_t now = LATENCY_CLOCK();
+  const uint32_t blockUs = (uint32_t)((float)n * US_PER_SAMPLE);
+  int frame = 0;
+  cmd_t cmd;
+  _blockCmdCount = 0;
+  while (_blockCmdCount < MAX_BLOCK_CMDS && _Cmds.pop(cmd)) {
+    if (_sampleAccurate) {
+      int32_t us = (int32_t)(cmd.stamp + blockUs - now);   // from the start of this block
+      frame = constrain((int)lroundf((float)us / US_PER_SAMPLE), frame, n - 1);
+    }
+    cmd.frame = frame;
+    _blockCmds[_blockCmdCount++] = cmd;
+  }
+}
+
+
+inline void SamplerEngine::applyCommand(const cmd_t& cmd) { // audio task, Core0
+  switch (cmd.type) {
+    case CMD_START:
+      Voices[cmd.voice].play();
+      if (_starts < MAX_POLYPHONY) _startStamp[_starts++] = cmd.stamp - (uint32_t)lroundf((float)cmd.frame * US_PER_SAMPLE); // blockOut() has the first frame
+      break;
+    case CMD_NOTE_OFF:
+      Voices[cmd.voice].release((Adsr::eEnd_t)cmd.arg);
+      break;
+    case CMD_END:
+      Voices[cmd.voice].end((Adsr::eEnd_t)cmd.arg);
+      break;
+    case CMD_PITCH:
+      for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
+        if (Voices[i].isPlaying()) Voices[i].bend(cmd.value);
+      }
+      break;
+    case CMD_SUSTAIN:
+      _sustainPlay = cmd.arg;
+      break;
+    default:  // envelope updates, the voices that aren't playing are Core1's
+      for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
+        if (!Voices[i].isPlaying()) continue;
+        switch (cmd.type) {
+          case CMD_ATTACK_TIME:   Voices[i].setAttackTime(cmd.value);   break;
+          case CMD_DECAY_TIME:    Voices[i].setDecayTime(cmd.value);    break;
+          case CMD_SUSTAIN_LEVEL: Voices[i].setSustainLevel(cmd.value); break;
+          case CMD_RELEASE_TIME:  Voices[i].setReleaseTime(cmd.value);  break;
+          default: ;
+        }
+      }
+  }
+}
+
 
 inline void SamplerEngine::setSustain(bool onoff) {
   _sustain = onoff; 
   DEBF("SAMPLER: sustain: %d\r\n", onoff);
+  post(CMD_SUSTAIN, 0, onoff);
   if (!onoff) {
     for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
-      if (_keyboard[Voices[i].getMidiNote()].noteoff && Voices[i].isActive() ) {
-        Voices[i].end(Adsr::END_REGULAR);   
+      if (Voices[i].isActive() && _keyboard[Voices[i].getMidiNote()].noteoff) {
+        endVoice(i, Adsr::END_REGULAR);   
       }
     }
   }
@@ -135,9 +305,7 @@ void SamplerEngine::setAttackTime(float val) {
     _keyboard[i].attack_time = val;
   }
 #ifdef ADSR_LIVE_UPDATE
-  for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
-    Voices[i].setAttackTime(val);
-  }
+  post(CMD_ATTACK_TIME, 0, 0, val);
 #endif
 }
 
@@ -146,9 +314,7 @@ void SamplerEngine::setDecayTime(float val) {
     _keyboard[i].decay_time = val;
   }
 #ifdef ADSR_LIVE_UPDATE
-  for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
-    Voices[i].setDecayTime(val);
-  }
+  post(CMD_DECAY_TIME, 0, 0, val);
 #endif
 }
 
@@ -157,9 +323,7 @@ void SamplerEngine::setReleaseTime(float val) {
     _keyboard[i].release_time = val;
   }
 #ifdef ADSR_LIVE_UPDATE
-  for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
-    Voices[i].setReleaseTime(val);
-  }
+  post(CMD_RELEASE_TIME, 0, 0, val);
 #endif
 }
 
@@ -168,9 +332,7 @@ void SamplerEngine::setSustainLevel(float val) {
     _keyboard[i].sustain_level = val;
   }
 #ifdef ADSR_LIVE_UPDATE
-  for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
-    Voices[i].setSustainLevel(val);
-  }
+  post(CMD_SUSTAIN_LEVEL, 0, 0, val);
 #endif
 }
 
@@ -197,20 +359,118 @@ uint8_t SamplerEngine::unMapVelo(uint8_t mappedVelo) {
 }
 
 void IRAM_ATTR SamplerEngine::fillBuffer() {
-  // search and fill the most hungry buffer
-  static uint32_t hungerMax;
-  static uint32_t hunger;
-  static int iToFeed;
-  hunger = hungerMax = 0;
-  iToFeed = 0;
+  // earliest deadline first, but a voice that has nothing to play yet goes before the others,
+  // unless serving it would make the most urgent one underrun.
+  // feeds served from the siblings' rings or from the PSRAM caches cost little, so we go on until one real card read is done
+  for (int n = 0; n < _maxVoices; n++) {
+    uint32_t dl;
+    uint32_t dlMin = DEADLINE_NONE;
+    int iToFeed = -1;
+    int iFirst = -1;
+    bool first = false;
+    for (int i=0; i<_maxVoices; i++) {
+      dl = Voices[i].deadline();
+      if (dl == DEADLINE_NONE) continue;
+      if (!Voices[i].isStarted()) {
+        if (iFirst < 0) iFirst = i;
+        continue;
+      }
+      if (dl < dlMin) {
+        dlMin = dl;
+        iToFeed = i;
+      }
+    }
+    if (iFirst >= 0 && (iToFeed < 0 || dlMin > 2 * _readTimeUs)) {
+      iToFeed = iFirst;
+      first = true;
+    }
+    if (iToFeed < 0) {
+      _Heads.fillStep(_Card); // no voice needs data now, so it's time to read some sample heads
+      _readsSinceHead = 0;
+      break;
+    }
+    // the heads' share of the card, when the most urgent voice can wait for the head read and two reads of its own
+    if (!first && _readsSinceHead >= HEAD_FILL_SHARE && (float)dlMin > (float)((HEAD_FILL_SECTORS + 2 * READ_BUF_SECTORS) * BYTES_PER_SECTOR) / _cardRate) {
+      _readsSinceHead = 0;
+      if (_Heads.fillStep(_Card)) break;
+    }
+    uint32_t sectors = Voices[iToFeed].getCardSectors();
+    uint32_t t1 = micros();
+    bool cardRead = Voices[iToFeed].feed();
+    uint32_t t = micros() - t1;
+    sched_stat_t& st = _schedStats[iToFeed];
+    if (first) {
+      st.first_fills++;
+    } else {
+      int32_t slack = (int32_t)dlMin - (int32_t)t;
+      st.reads++;
+      st.sum_slack += slack;
+      if (slack < st.min_slack) st.min_slack = slack;
+    }
+    if (cardRead) {
+      _readTimeUs = (_readTimeUs * 7 + t) >> 3;
+      _readsSinceHead++;
+      if (!_cardRateFixed && t > 0) _cardRate += 0.125f * ((float)((Voices[iToFeed].getCardSectors() - sectors) * BYTES_PER_SECTOR) / (float)t - _cardRate);
+      break;
+    }
+  }
+#ifdef DEBUG_SCHEDULER
+  if (micros() - _schedStatsTime > 2000000) printSchedStats();
+#endif
+}
+
+
+void SamplerEngine::printSchedStats() {
+  uint32_t now = micros();
+  uint32_t elapsed = _schedStatsTime ? now - _schedStatsTime : 0;
+  _schedStatsTime = now;
+  uint32_t card = 0, shared = 0, head = 0, cached = 0;
+  for (int i=0; i<MAX_POLYPHONY; i++) {
+    card += Voices[i].getCardSectors();
+    shared += Voices[i].getSharedSectors();
+    head += Voices[i].getHeadSectors();
+    cached += Voices[i].getCachedSectors();
+  }
+  DEBF("SCHEDULER: avg read %d us, sectors: card %d, siblings %d, head cache %d, sector cache %d, ring arena %d of %d free\r\n", _readTimeUs, card, shared, head, cached, _Arena.getSectorsFree(), _Arena.getSectorsTotal());
+  DEBF("SCHEDULER: head cache: %d of %d KBytes filled, hits %d, misses %d\r\n", _Heads.getSectorsFilled() / 2, _Heads.getSectorsTotal() / 2, _Heads.getHits(), _Heads.getMisses());
+  if (_Loops.size() > 0) {
+    int looping = 0;
+    for (int i=0; i<MAX_POLYPHONY; i++) looping += (Voices[i].isActive() && Voices[i].isLooping());
+    DEBF("SCHEDULER: loop cache: %d of %d loops in RAM, %d KBytes, %d voices playing from there\r\n", _Loops.getComplete(), _Loops.size(), _Loops.getBytesUsed() / 1024, looping);
+  }
+  if (_Sectors.getCapacity() > 0) {
+    // card bandwidth it freed since the last report, in 16 bit stereo voices
+    float voices = elapsed ? (float)(_Sectors.getBytesSaved() - _schedStatsSaved) / (float)elapsed * US_PER_SAMPLE / 4.0f : 0.0f;
+    _schedStatsSaved = _Sectors.getBytesSaved();
+    DEBF("SCHEDULER: sector cache: %d of %d KBytes used, %d protected, hit rate %.1f%% (%d of %d), evictions %d, saved %d KBytes, %.1f voices\r\n",
+      _Sectors.getSectorsUsed() / 2, _Sectors.getCapacity() / 2, _Sectors.getSectorsProtected() / 2, _Sectors.getHitRate() * 100.0f,
+      _Sectors.getHits(), _Sectors.getHits() + _Sectors.getMisses(), _Sectors.getEvictions(), (uint32_t)(_Sectors.getBytesSaved() / 1024), voices);
+  }
+  DEBF("SCHEDULER: commands to Core0: %d, queue peak %d of %d, stalls %d\r\n", _Cmds.getPushed(), _Cmds.getMaxUsed(), CMD_QUEUE_LEN, _cmdStalls);
+  DEBF("SCHEDULER: interpolation up to %s, budget %d us: voice blocks nearest %d, linear %d, hermite %d, sinc %d, copy %d; us per voice %.1f, %.1f, %.1f, %.1f\r\n",
+    interpNames[_interpMax], _renderBudgetUs, _interpBlocks[INTERP_NEAREST], _interpBlocks[INTERP_LINEAR], _interpBlocks[INTERP_HERMITE], _interpBlocks[INTERP_SINC],
+    _interpBlocks[INTERP_COPY], getInterpCost(INTERP_NEAREST), getInterpCost(INTERP_LINEAR), getInterpCost(INTERP_HERMITE), getInterpCost(INTERP_SINC));
+  DEBF("SAMPLER: admission: card %.2f MB/s%s, budget %d%%, demand %.2f MB/s now, %.2f MB/s peak; notes admitted %d, made room %d, refused %d\r\n",
+    _cardRate, _cardRateFixed ? " (fixed)" : "", _admitBudget, cardDemand(-1), _demandPeak, _admitted, _madeRoom, _refused);
+  _demandPeak = 0.0f;
+  uint32_t released = _steals - _heldSteals;
+  if (_latencyNotes > 0) {
+    DEBF("SAMPLER: note-on latency, block %d x %d DMA buffers, %s: %d notes, min %.2f ms, avg %.2f, 50%% %.2f, 90%% %.2f, 99%% %.2f, max %.2f ms, jitter %.3f ms\r\n",
+      _blockLenOut, _dmaBufsOut, _sampleAccurate ? "sample accurate" : "at the block start", _latencyNotes, (float)_latencyMinUs * 0.001f,
+      (float)_latencySumUs * 0.001f / (float)_latencyNotes, getLatencyMs(0.5f), getLatencyMs(0.9f), getLatencyMs(0.99f), getLatencyMs(1.0f), getJitterMs());
+  }
+  DEBF("SAMPLER: voice allocation %s: steals %d, held notes %d at %.1f dBFS avg, released %d at %.1f dBFS avg\r\n", voiceAllocNames[_voiceAllocMethod],
+    _steals, _heldSteals, _heldSteals ? _heldDbSum / (float)_heldSteals : 0.0f, released, released ? _releasedDbSum / (float)released : 0.0f);
   for (int i=0; i<_maxVoices; i++) {
-    hunger = Voices[i].hunger();
-    if (hunger > hungerMax) {
-      hungerMax = hunger;
-      iToFeed = i;
+    sched_stat_t& st = _schedStats[i];
+    uint32_t underruns = Voices[i].getUnderruns();
+    if (st.reads > 0 || st.first_fills > 0 || underruns != st.underruns) {
+      DEBF("SCHEDULER: voice %d: reads %d, first fills %d, slack min %d us, avg %d us, underruns %d\r\n", i, st.reads, st.first_fills,
+        st.reads ? st.min_slack : 0, st.reads ? (int32_t)(st.sum_slack / st.reads) : 0, underruns - st.underruns);
     }
+    st = sched_stat_t();
+    st.underruns = underruns;
   }
-  Voices[iToFeed].feed(); 
 }
 
 
@@ -226,20 +486,124 @@ inline void SamplerEngine::setCurrentFolder(int folder_id) {
   _Card->setCurrentDir(_folders[folder_id]);
   initKeyboard();               // it resets _keyboard[] which holds key-specific parameters
   parseIni();                   // this will read the sampler.ini file and prepare name template along with other parameters
-  _Card->rewindDir();
-  while (true) {                // iterate thru the selected directory
-    entry_t* entry = _Card->nextEntry();
-    if (entry->is_end) break;
-    if (!entry->is_dir) {
-      processNameParser(entry); // parse filenames basing on a prepared template
+  if (!loadIndex()) {           // no index or the folder has changed since it was written
+    _Card->prepareChains();     // all the sample chains in one pass over the FAT
+    _Card->rewindDir();
+    while (true) {              // iterate thru the selected directory
+      entry_t* entry = _Card->nextEntry();
+      if (entry->is_end) break;
+      if (!entry->is_dir) {
+        processNameParser(entry); // parse filenames basing on a prepared template
+      }
     }
+    //printMapping();
+    _Card->dropChains();
+    finalizeMapping();  // fill the gaps when we don't have dedicated samples for some pitches or velocity layers
+    saveIndex();
   }
-  //printMapping();
-  finalizeMapping();  // fill the gaps when we don't have dedicated samples for some pitches or velocity layers
+  buildHeadCache();
+  buildLoopCache();
   printMapping();
 }
 
 
+void SamplerEngine::buildHeadCache() {
+  std::vector<uint32_t> keys;
+  std::vector<int>      ids(128 * _veloLayers, -1);  // unique sample index of every map cell
+  _Heads.clear();
+  if (_Heads.getCapacity() == 0) return;
+  for (int i = 0; i < _veloLayers; i++) {
+    for (int j = 0; j < 128; j++) {
+      sample_t& smp = _sampleMap[j][i];
+      if (smp.sectors.empty()) continue;
+      for (int k = keys.size() - 1; k >= 0; k--) {
+        if (keys[k] == smp.sectors[0].first) {
+          ids[i * 128 + j] = k;
+          break;
+        }
+      }
+      if (ids[i * 128 + j] < 0) {
+        ids[i * 128 + j] = keys.size();
+        keys.push_back(smp.sectors[0].first);
+      }
+    }
+  }
+  if (keys.empty()) return;
+  // the same head for everyone, but not shorter than one read
+  uint32_t headSectors = min((uint32_t)HEAD_CACHE_KB * 2, _Heads.getCapacity() / (uint32_t)keys.size());
+  headSectors = max(headSectors, (uint32_t)READ_BUF_SECTORS);
+  std::vector<int> heads(keys.size(), -2);
+  for (int i = 0; i < _veloLayers; i++) {
+    for (int j = 0; j < 128; j++) {
+      int k = ids[i * 128 + j];
+      if (k < 0) continue;
+      if (heads[k] == -2) heads[k] = _Heads.add(_sampleMap[j][i], headSectors);
+      _sampleMap[j][i].head = heads[k];
+    }
+  }
+  DEBF("SAMPLER: HEAD CACHE: %d of %u samples, %d KBytes each\r\n", _Heads.size(), (unsigned)keys.size(), headSectors / 2);
+}
+
+
+// the PSRAM caches share what is free but PSRAM_RESERVE_KB: the budgets shrink by the same factor if they don't fit,
+// and each one takes at most what is left in one piece when its turn comes, so none of them is disabled for the others
+void SamplerEngine::initCaches() {
+  uint32_t headKb = 0, sectorKb = 0, loopKb = 0;
+#ifdef USE_HEAD_CACHE
+  headKb = HEAD_CACHE_BUDGET_KB;
+#endif
+#ifdef USE_SECTOR_CACHE
+  sectorKb = SECTOR_CACHE_KB;
+#endif
+#ifdef USE_LOOP_CACHE
+  loopKb = LOOP_CACHE_KB;
+#endif
+  const uint32_t freeKb = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 1024;
+  const uint32_t roomKb = (freeKb > PSRAM_RESERVE_KB) ? freeKb - PSRAM_RESERVE_KB : 0;
+  const uint32_t wantKb = headKb + sectorKb + loopKb;
+  if (wantKb > roomKb) {
+    headKb = (uint64_t)headKb * roomKb / wantKb;
+    sectorKb = (uint64_t)sectorKb * roomKb / wantKb;
+    loopKb = (uint64_t)loopKb * roomKb / wantKb;
+  }
+  if (headKb > 0) _Heads.init(psramBudgetKb(headKb) * 1024);
+  if (sectorKb > 0) _Sectors.init(psramBudgetKb(sectorKb) * 1024, SECTOR_CACHE_PROTECTED);
+  if (loopKb > 0) _Loops.init(psramBudgetKb(loopKb) * 1024);
+  const uint32_t leftKb = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 1024;
+  DEBF("SAMPLER: PSRAM: %d KBytes free, %d committed to the caches (head %d, sector %d, loop %d KBytes asked for), %d KBytes left\r\n",
+    freeKb, freeKb - leftKb, headKb, sectorKb, loopKb, leftKb);
+}
+
+
+uint32_t SamplerEngine::psramBudgetKb(uint32_t wantKb) {
+  uint32_t freeKb = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 1024;
+  uint32_t roomKb = (freeKb > PSRAM_RESERVE_KB) ? freeKb - PSRAM_RESERVE_KB : 0;
+  uint32_t pieceKb = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) / 1024;
+  return min(wantKb, min(roomKb, pieceKb));
+}
+
+
+void SamplerEngine::buildLoopCache() {
+  int looped = 0;
+  _Loops.clear();
+  for (int i = 0; i < _veloLayers; i++) {
+    for (int j = 0; j < 128; j++) {
+      sample_t& smp = _sampleMap[j][i];
+      smp.loop = -1;
+      if (_keyboard[j].loop && smp.loop_mode <= 0) { // the whole sample, if the file has no loop points
+        smp.loop_mode = 1;
+        smp.loop_first_smp = -1;
+        smp.loop_last_smp = -1;
+      }
+      if (smp.loop_mode <= 0 || smp.sectors.empty()) continue;
+      looped++;
+      smp.loop = _Loops.add(smp);
+    }
+  }
+  if (looped > 0) DEBF("SAMPLER: LOOP CACHE: %d looped samples, %d KBytes of %d\r\n", _Loops.size(), _Loops.getBytesUsed() / 1024, _Loops.getCapacity() / 1024);
+}
+
+
 inline void SamplerEngine::setNextFolder() {
   _currentFolderId++;
   if (_currentFolderId > _sampleSetsCount-1) _currentFolderId = 0;
@@ -260,6 +624,7 @@ void SamplerEngine::initKeyboard() {
     _keyboard[i].name[1]      = notes[1][i%12];
     _keyboard[i].transpose    = 0;
     _keyboard[i].noteoff      = true;
+    _keyboard[i].loop         = false;
     //_keyboard[i].velo_layer   = 1;
     _keyboard[i].tuning       = 1.0f;
     // DEBF("%d:\t%s\t%s\t%d\t%7.3f\r\n", i, _keyboard[i].name[0].c_str(), _keyboard[i].name[1].c_str(), _keyboard[i].octave, _keyboard[i].freq);
@@ -273,7 +638,8 @@ void SamplerEngine::resetSamples() {
   _sustainLevel = 1.0f;
   _releaseTime  = 8.0f;
   for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
-    Voices[i].end(Adsr::END_FAST);    
+    _deferredNote[i] = 255;
+    if (Voices[i].isActive()) endVoice(i, Adsr::END_FAST);
   }
   for (int i = 0; i<MAX_VELOCITY_LAYERS; i++) {
     for (int j = 0; j<128; j++) {
@@ -306,16 +672,119 @@ int SamplerEngine::getActiveVoices() {
   return n;
 }
 
-void SamplerEngine::getSample(float& sampleL, float& sampleR){
-  float sL = 0.0f;
-  float sR = 0.0f;
-  sampleL = 0.0f;
-  sampleR = 0.0f;
+void SamplerEngine::renderBlock(mix_t* L, mix_t* R, int n) { // audio task, Core0
+  memset(L, 0, n * sizeof(mix_t));
+  memset(R, 0, n * sizeof(mix_t));
+  int k = 0;
+  while (k < _blockCmdCount && _blockCmds[k].frame == 0) applyCommand(_blockCmds[k++]);
+  governInterpolation(); // the voices starting later in the block keep the tier they had for the frames left
+  uint32_t t0 = micros();
+  for (int pos = 0; pos < n; ) {
+    int end = (k < _blockCmdCount) ? _blockCmds[k].frame : n;
+    for (int i = 0; i < _maxVoices; i++) {
+      Voices[i].renderBlock(L + pos, R + pos, end - pos); // up to the next command per voice, the state stays in registers
+    }
+    for (pos = end; k < _blockCmdCount && _blockCmds[k].frame == pos; k++) applyCommand(_blockCmds[k]);
+  }
+  for (int i = 0; i < _maxVoices; i++) Voices[i].endBlock(_levelFall); // once per block, however many runs it took
+  _blockCmdCount = 0;
+  if (_blockWeight > 0.0f) { // the tiers keep their relative costs, the measure scales them to this CPU and these samples
+    _linearCostUs += 0.125f * ((float)(micros() - t0) / _blockWeight - _linearCostUs);
+  }
+}
+
+
+void SamplerEngine::blockChanged(int len, int bufs) { // audio task, Core0
+  // the budget and the learned cost are per block, they scale with it
+  float k = (float)len / (float)_blockLenOut;
+  _renderBudgetUs = (uint32_t)((float)_renderBudgetUs * k);
+  _linearCostUs *= k;
+  _levelFall = powf(LEVEL_FALL, (float)len);   // the voice levels fall at the same rate with any block
+  _blockLenOut = len;
+  _dmaBufsOut = bufs;
+  // the latency distribution is the one of a block size
+  memset(_latencyHist, 0, sizeof(_latencyHist));
+  _latencyNotes = _latencySumUs = _latencyMaxUs = 0;
+  _latencyMinUs = UINT32_MAX;
+  _latencySqSum = 0.0;
+}
+
+
+void SamplerEngine::blockOut(uint32_t firstSampleUs) { // audio task, Core0
+  for (int k = 0; k < _starts; k++) {
+    uint32_t us = firstSampleUs - _startStamp[k];
+    _latencyHist[min(us / LATENCY_BIN_US, (uint32_t)LATENCY_BINS - 1)]++;
+    _latencyNotes++;
+    _latencySumUs += us;
+    _latencySqSum += (double)us * (double)us;
+    _latencyMinUs = min(_latencyMinUs, us);
+    _latencyMaxUs = max(_latencyMaxUs, us);
+  }
+  _starts = 0;
+}
+
+
+float SamplerEngine::getLatencyMs(float share) {
+  if (_latencyNotes == 0) return 0.0f;
+  if (share >= 1.0f) return (float)_latencyMaxUs * 0.001f;
+  uint32_t want = max((uint32_t)ceilf(share * (float)_latencyNotes), (uint32_t)1);
+  uint32_t sum = 0;
+  for (int b = 0; b < LATENCY_BINS - 1; b++) {
+    sum += _latencyHist[b];
+    if (sum >= want) return min((float)((b + 1) * LATENCY_BIN_US), (float)_latencyMaxUs) * 0.001f; // the upper edge of the bin
+  }
+  return (float)_latencyMaxUs * 0.001f;
+}
+
+
+float SamplerEngine::getJitterMs() {
+  if (_latencyNotes == 0) return 0.0f;
+  double avg = (double)_latencySumUs / (double)_latencyNotes;
+  return (float)sqrt(max(_latencySqSum / (double)_latencyNotes - avg * avg, 0.0)) * 0.001f;
+}
+
+
+void SamplerEngine::governInterpolation() { // audio task, Core0
+  int ids[MAX_POLYPHONY];
+  float speeds[MAX_POLYPHONY];
+  uint8_t tiers[MAX_POLYPHONY];
+  int n = 0, copies = 0;
+  // the voices that interpolate, the highest pitch first: it aliases the most
   for (int i = 0; i < _maxVoices; i++) {
-    Voices[i].getSample(sL, sR);
-    sampleL = sampleL + sL;
-    sampleR = sampleR + sR;    
-  }  
+    if (!Voices[i].isPlaying()) continue;
+    if (!Voices[i].needsInterpolation()) {
+      copies++;
+      continue;
+    }
+    float s = Voices[i].getSpeed();
+    int j = n++;
+    while (j > 0 && speeds[j - 1] < s) {
+      ids[j] = ids[j - 1];
+      speeds[j] = speeds[j - 1];
+      j--;
+    }
+    ids[j] = i;
+    speeds[j] = s;
+  }
+  // all of them start at the lowest tier and go up a tier at a time, in that order, while the block fits the budget
+  float budget = _renderBudgetUs ? (float)_renderBudgetUs / _linearCostUs : 1e30f; // in linear voice blocks
+  float cost = (float)n * interpWeight[INTERP_NEAREST] + (float)copies * interpWeight[INTERP_COPY];
+  for (int k = 0; k < n; k++) tiers[k] = INTERP_NEAREST;
+  for (int q = INTERP_NEAREST + 1; q <= _interpMax; q++) {
+    float step = interpWeight[q] - interpWeight[q - 1];
+    int k = 0;
+    for ( ; k < n && cost + step <= budget; k++) {
+      tiers[k] = q;
+      cost += step;
+    }
+    if (k < n) break;
+  }
+  _interpBlocks[INTERP_COPY] += copies;
+  for (int k = 0; k < n; k++) {
+    Voices[ids[k]].setInterpolation((eInterp_t)tiers[k]);
+    _interpBlocks[tiers[k]]++;
+  }
+  _blockWeight = cost;
 }
 
 void SamplerEngine::freeSomeVoices() {
@@ -327,25 +796,27 @@ void SamplerEngine::freeSomeVoices() {
   float maxKillScore = 0.0f;
   float maxSameKillScore = 0.0f;
   memset(note_count, 0, 128);
+  startDeferred();
   for (int i = 0 ; i < MAX_POLYPHONY ; i++) {
+    if (!Voices[i].isActive()) Voices[i].releaseRing(); // the arena is shared, give it back as soon as possible
     if (Voices[i].isActive() && !Voices[i].isDying() ) {
       n++;
       midi_note = Voices[i].getMidiNote();
       note_count[midi_note]++;
       if (note_count[midi_note] > _keyboard[midi_note].limit_same) { // if we have limit overrun, find the best candidate
         for (int j = 0 ; j < MAX_POLYPHONY ; j++) {
-          if (Voices[j].getMidiNote() == midi_note) {
-            score = Voices[j].getKillScore();
+          if (Voices[j].getMidiNote() == midi_note && Voices[j].isActive()) {
+            score = Voices[j].getKillScore(_voiceAllocMethod);
             if (score > maxSameKillScore) {
               maxSameKillScore = score;
               id = j;
             }
           }
         }
-        Voices[id].end(Adsr::END_FAST);
+        stealVoice(id, Adsr::END_FAST);
         return;
       }
-      score = Voices[i].getKillScore();
+      score = Voices[i].getKillScore(_voiceAllocMethod);
       if (score > maxKillScore) {
         maxKillScore = score;
         id = i;
@@ -353,7 +824,7 @@ void SamplerEngine::freeSomeVoices() {
     }
   }
   if ( ( n + SACRIFY_VOICES ) > MAX_POLYPHONY ) {
-    Voices[id].end(Adsr::END_FAST);
+    stealVoice(id, Adsr::END_FAST);
     return;
   }
 }
@@ -362,7 +833,9 @@ void SamplerEngine::freeSomeVoices() {
 inline void SamplerEngine::setPitch(int number) {
   float speedModifier = ((((float)number + 8191.5f) * (float)TWO_DIV_16383 ) - 1.0f ) * (float)_pitchBendSemitones;
   speedModifier = fast_semitones2speed(speedModifier);
-  for (int i=0; i<_maxVoices; i++) {
+  _speed = speedModifier;
+  for (int i=0; i<MAX_POLYPHONY; i++) {
     Voices[i].setPitch(speedModifier);
   }
+  post(CMD_PITCH, 0, 0, speedModifier);
 }
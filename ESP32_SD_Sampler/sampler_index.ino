@@ -0,0 +1,157 @@
+#include "sampler.h"
+#include "sdmmc_file.h"
+
+// Folder index: the result of parseIni() + processNameParser() + finalizeMapping() stored as a binary file.
+// It's only valid while the folder stays the same, so we stamp it with a hash of all the directory records
+// (names, sizes, dates, clusters), and the index is rebuilt on the first load after any change.
+
+uint32_t SamplerEngine::indexStamp(entry_t* idx) {
+  const uint32_t build[4] = { INDEX_VERSION, SAMPLE_RATE, MAX_VELOCITY_LAYERS, MAX_DISTANCE_STRETCH };
+  uint32_t stamp = _Card->stampCurrentDir(INDEX_FILE, idx);
+  return fnv1a(build, sizeof(build), stamp);
+}
+
+
+bool SamplerEngine::loadIndex() {
+#ifdef USE_FOLDER_INDEX
+  entry_t idx;
+  idx_header_t hdr;
+  uint32_t t1 = micros();
+  uint32_t stamp = indexStamp(&idx);
+  uint32_t checksum;
+  if (idx.is_end || idx.size < sizeof(idx_header_t)) {
+    DEBUG("SAMPLER: INDEX: not found");
+    return false;
+  }
+  SDMMC_FileReader Reader(_Card);
+  if (Reader.open(idx) != ESP_OK) return false;
+  if (Reader.read(&hdr, sizeof(hdr)) != sizeof(hdr)) return false;
+  if (memcmp(hdr.magic, INDEX_MAGIC, 4) != 0 || hdr.version != INDEX_VERSION || hdr.size > idx.size || hdr.velo_layers > MAX_VELOCITY_LAYERS) {
+    DEBUG("SAMPLER: INDEX: invalid");
+    return false;
+  }
+  if (hdr.stamp != stamp) {
+    DEBUG("SAMPLER: INDEX: folder has changed");
+    return false;
+  }
+  std::vector<idx_sample_t> smps(hdr.samples);
+  std::vector<chain_t>      chains(hdr.chains);
+  std::vector<idx_cell_t>   cells(128 * hdr.velo_layers);
+  Reader.read(smps.data(), smps.size() * sizeof(idx_sample_t));
+  Reader.read(chains.data(), chains.size() * sizeof(chain_t));
+  Reader.read(cells.data(), cells.size() * sizeof(idx_cell_t));
+  Reader.close();
+  checksum = fnv1a(smps.data(), smps.size() * sizeof(idx_sample_t));
+  checksum = fnv1a(chains.data(), chains.size() * sizeof(chain_t), checksum);
+  checksum = fnv1a(cells.data(), cells.size() * sizeof(idx_cell_t), checksum);
+  if (checksum != hdr.checksum) {
+    DEBUG("SAMPLER: INDEX: checksum mismatch");
+    return false;
+  }
+  for (int i = 0; i < hdr.velo_layers; i++) {
+    for (int j = 0; j < 128; j++) {
+      idx_cell_t& c = cells[i * 128 + j];
+      sample_t& smp = _sampleMap[j][i];
+      smp.orig_velo_layer = c.orig_velo_layer;
+      smp.native_freq     = c.native_freq;
+      smp.orig_freq       = c.orig_freq;
+      smp.speed           = c.speed;
+      smp.amp             = c.amp;
+      if (c.sample >= smps.size()) continue;
+      idx_sample_t& s = smps[c.sample];
+      if (s.first_chain + s.num_chains > chains.size()) continue;
+      smp.size            = s.size;
+      smp.data_size       = s.data_size;
+      smp.byte_offset     = s.byte_offset;
+      smp.sample_rate     = s.sample_rate;
+      smp.channels        = s.channels;
+      smp.bit_depth       = s.bit_depth;
+      smp.loop_mode       = s.loop_mode;
+      smp.loop_first_smp  = s.loop_first_smp;
+      smp.loop_last_smp   = s.loop_last_smp;
+      smp.sectors.assign(chains.begin() + s.first_chain, chains.begin() + s.first_chain + s.num_chains);
+    }
+  }
+  _veloLayers = max((int)hdr.velo_layers, 1);
+  _divVeloLayers = 1.0f / (float)_veloLayers;
+  DEBF("SAMPLER: INDEX: %d samples loaded in %d ms\r\n", hdr.samples, (micros() - t1) / 1000);
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+void SamplerEngine::saveIndex() {
+#ifdef USE_FOLDER_INDEX
+  entry_t idx;
+  idx_header_t hdr;
+  std::vector<uint32_t>     keys;   // first sector of every sample stored, to find duplicates
+  std::vector<idx_sample_t> smps;
+  std::vector<chain_t>      chains;
+  std::vector<idx_cell_t>   cells;
+  idx_cell_t c;
+  idx_sample_t s;
+  for (int i = 0; i < _veloLayers; i++) {
+    for (int j = 0; j < 128; j++) {
+      sample_t& smp = _sampleMap[j][i];
+      c.orig_velo_layer = smp.orig_velo_layer;
+      c.native_freq     = smp.native_freq;
+      c.orig_freq       = smp.orig_freq;
+      c.speed           = smp.speed;
+      c.amp             = smp.amp;
+      c.sample          = INDEX_NO_SAMPLE;
+      if (!smp.sectors.empty()) {
+        for (int k = keys.size() - 1; k >= 0; k--) { // neighbour cells usually share samples, so search backwards
+          if (keys[k] == smp.sectors[0].first) {
+            c.sample = k;
+            break;
+          }
+        }
+        if (c.sample == INDEX_NO_SAMPLE) {
+          s.size            = smp.size;
+          s.data_size       = smp.data_size;
+          s.byte_offset     = smp.byte_offset;
+          s.sample_rate     = smp.sample_rate;
+          s.channels        = smp.channels;
+          s.bit_depth       = smp.bit_depth;
+          s.loop_mode       = smp.loop_mode;
+          s.loop_first_smp  = smp.loop_first_smp;
+          s.loop_last_smp   = smp.loop_last_smp;
+          s.first_chain     = chains.size();
+          s.num_chains      = smp.sectors.size();
+          chains.insert(chains.end(), smp.sectors.begin(), smp.sectors.end());
+          c.sample = keys.size();
+          keys.push_back(smp.sectors[0].first);
+          smps.push_back(s);
+        }
+      }
+      cells.push_back(c);
+    }
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.version     = INDEX_VERSION;
+  hdr.velo_layers = _veloLayers;
+  hdr.stamp       = indexStamp(&idx);
+  hdr.samples     = smps.size();
+  hdr.chains      = chains.size();
+  hdr.size        = sizeof(idx_header_t) + smps.size() * sizeof(idx_sample_t) + chains.size() * sizeof(chain_t) + cells.size() * sizeof(idx_cell_t);
+  hdr.checksum    = fnv1a(smps.data(), smps.size() * sizeof(idx_sample_t));
+  hdr.checksum    = fnv1a(chains.data(), chains.size() * sizeof(chain_t), hdr.checksum);
+  hdr.checksum    = fnv1a(cells.data(), cells.size() * sizeof(idx_cell_t), hdr.checksum);
+  SDMMC_FileWriter Writer(_Card);
+  if (Writer.open(INDEX_FILE, hdr.size) != ESP_OK) {
+    DEBUG("SAMPLER: INDEX: can't create file");
+    return;
+  }
+  // the header goes last: an interrupted write leaves an index without magic
+  esp_err_t ret = Writer.write(&hdr, sizeof(hdr));
+  if (ret == ESP_OK) ret = Writer.write(smps.data(), smps.size() * sizeof(idx_sample_t));
+  if (ret == ESP_OK) ret = Writer.write(chains.data(), chains.size() * sizeof(chain_t));
+  if (ret == ESP_OK) ret = Writer.write(cells.data(), cells.size() * sizeof(idx_cell_t));
+  memcpy(hdr.magic, INDEX_MAGIC, 4);
+  if (ret == ESP_OK) ret = Writer.rewrite(0, &hdr, sizeof(hdr));
+  Writer.close();
+  DEBF("SAMPLER: INDEX: %d samples, %d chains, %d bytes written, %s\r\n", hdr.samples, hdr.chains, hdr.size, esp_err_to_name(ret));
+#endif
+}
@@ -7,6 +7,8 @@ void SamplerEngine::parseIni() {
   ini_range_t range;
   _template.clear();
   _ranges.clear();
+  int blockLen = DMA_BUF_LEN;   // unless the set asks for another one
+  int dmaBufs = DMA_NUM_BUF;
   variants_t grps;
   for (int i = 0 ; i < 128; i++) {
     for (int j = 0; j < ( ( MAX_NOTES_PER_GROUP - 1 ) * MAX_GROUPS_CROSSES ); j++) {
@@ -113,6 +115,8 @@ void SamplerEngine::parseIni() {
           }
           continue;
         }
+        if (tok == "BLOCK_SIZE" || tok == "BLOCKSIZE" || tok == "BLOCK") {blockLen = parseIntValue(iniStr); continue;}
+        if (tok == "DMA_BUFFERS" || tok == "DMABUFFERS") {dmaBufs = parseIntValue(iniStr); continue;}
         if (tok == "MAX_VOICES" || tok == "MAX_POLYPHONY" || tok == "MAXPOLYPHONY" || tok == "MAXVOICES" || tok == "POLYPHONY") {_maxVoices = min(MAX_POLYPHONY, parseIntValue(iniStr)); continue;}
         if (tok == "ATTACKTIME" || tok == "ATTACK_TIME") {_attackTime = parseFloatValue(iniStr); setAttackTime(_attackTime); continue;}
         if (tok == "DECAYTIME" || tok == "DECAY_TIME") {_decayTime = parseFloatValue(iniStr); setDecayTime(_decayTime); continue;}
@@ -124,6 +128,7 @@ void SamplerEngine::parseIni() {
   // save parsed section
   if (section==S_NOTE || section==S_RANGE) applyRange(range);
   Reader.close();
+  setAudioBlock(blockLen, dmaBufs);   // once, the audio task reinitializes I2S when it changes
   DEBUG("SAMPLER: INI: PARSING COMPLETE");
   //delay(1000);
 }
@@ -268,6 +273,7 @@ void SamplerEngine::applyRange(ini_range_t& range) {
     _keyboard[i].decay_time     = range.decay_time;
     _keyboard[i].sustain_level  = range.sustain_level;
     _keyboard[i].release_time   = range.release_time;
+    _keyboard[i].loop           = range.loop;
   }
   DEBF("INI: adding range for %s\r\n", range.instr.c_str());
 }
@@ -524,6 +530,39 @@ void SamplerEngine::parseWavHeader(entry_t* wav_entry, sample_t& smp){
     smp.byte_offset = res + 8;
     smp.data_size = *(reinterpret_cast<uint32_t*>(&buf[res+4]));
   }
+  smp.loop_mode = 0;
+  if (parseSmplChunk(reinterpret_cast<uint8_t*>(buf), BYTES_PER_SECTOR, smp) || res < 0) return;
+  // it's usually after the data: look at the two sectors there
+  uint32_t tail = smp.byte_offset + smp.data_size + (smp.data_size & 1); // chunks are word aligned
+  if (tail + 60 > smp.size) return;
+  static uint8_t sectors[2 * BYTES_PER_SECTOR];
+  uint32_t runLeft;
+  int got = 0;
+  for (int i = 0; i < 2 && tail / BYTES_PER_SECTOR + i <= (smp.size - 1) / BYTES_PER_SECTOR; i++) {
+    uint32_t sector = chainSector(smp.sectors, tail / BYTES_PER_SECTOR + i, runLeft);
+    if (runLeft == 0) break;
+    memcpy(sectors + i * BYTES_PER_SECTOR, _Card->readSector(sector), BYTES_PER_SECTOR);
+    got += BYTES_PER_SECTOR;
+  }
+  parseSmplChunk(sectors + tail % BYTES_PER_SECTOR, got - tail % BYTES_PER_SECTOR, smp);
+}
+
+
+bool SamplerEngine::parseSmplChunk(const uint8_t* buf, int len, sample_t& smp) {
+  for (int i = 0; i + 60 <= len; i++) {
+    if (buf[i]!='s' || buf[i+1]!='m' || buf[i+2]!='p' || buf[i+3]!='l') continue;
+    uint32_t loops, first, last;
+    memcpy(&loops, &buf[i + 36], 4);
+    memcpy(&first, &buf[i + 52], 4);  // the first loop: cue point id, type, start, end, fraction, play count
+    memcpy(&last, &buf[i + 56], 4);   // inclusive
+    if (loops > 0 && first <= last) { // they all play forward here
+      smp.loop_mode = 1;
+      smp.loop_first_smp = first;
+      smp.loop_last_smp = last;
+    }
+    return true;
+  }
+  return false;
 }
 
 
@@ -2,13 +2,21 @@
 
 /*
  * Simplified READ-ONLY FAT32 class for fast accessing and reading of WAV files.
+ * exFAT volumes (cards over 32 GB) are read through the same API: the directory index hides the
+ * different record formats, and files flagged NoFatChain become a single chain without any FAT walk.
  * Cluster chains are pre-cached for the current directory files, and stored in memory as 
  * a collection of linear sector chains boundaries. Ideally, when no fragmentation appears,
  * only a single pair of sectors (beginning/end) per file needed.
+ * prepareChains() builds them for the whole directory at once, reading the FAT in large windows.
+ * Directories are indexed once (case-folded name hashes to cluster, size and attributes), so name 
+ * lookups and nested paths like "/pianos/grand/" don't rescan the records.
+ * The only write operation supported is createEntry(): it places a contiguous file into the 
+ * current directory (or reuses an existing one), so that the sampler could keep its folder index.
+ * It's FAT32 only, exFAT is strictly read-only here.
  */
 /*
 Just for your information
-Of what I have tested with some random 16GB card:
+Of what I have tested with some random 16GB card (see StorageBench for latencies and more patterns):
 
 sectors per read  |  reading speed, MB/s
 ------------------+---------------------
@@ -70,6 +78,7 @@ sectors per read  |  reading speed, MB/s
  *  
  */
 #include "sdmmc_types.h"
+#include "block_device.h"
 //#define USE_MUTEX
 
 
@@ -83,17 +92,22 @@ class SDMMC_FAT32 {
     ~SDMMC_FAT32() {} ;
    
     esp_err_t ret;
-    sdmmc_card_t card;
 
-    void begin();
+    void begin(BlockDevice* dev);           // the card (SdmmcDevice) or whatever holds its sectors
     void end();
-    void testReadSpeed(uint32_t sectorsPerRead, uint32_t totalMB);
-    void setCurrentDir(fpath_t pathToDir);
+    BlockDevice* getDevice()          {return _Dev;}
+    void setCurrentDir(fpath_t pathToDir);  // "/a/b/" from the root, "b" or "../c" from the current dir
+    fpath_t getCurrentDir()           {return _currentDir;}
+    void listCurrentDir(std::vector<fname_t>& names, bool dirs); // names of the subdirs (dirs = true) or files from the index
     void printCurrentDir();
     void rewindDir();
     entry_t*  findEntry(const fpath_t& fname);
+    entry_t*  createEntry(const fname_t& fname, uint32_t size); // 8.3 names only, returns entry with is_end=1 on failure
+    uint32_t  stampCurrentDir(const fname_t& skipName, entry_t* skipped); // hash of names, sizes, dates and clusters of the current dir
     entry_t*  nextEntry();
     entry_t*  buildNextEntry();
+    void      prepareChains();              // builds the chains of all the current dir files in one forward pass over the FAT
+    void      dropChains();                 // frees them, buildChain() walks the FAT again
     entry_t*  getCurrentEntryP()            {return &_currentEntry;};
     entry_t   getCurrentEntry()             {return _currentEntry;};
     void      setCurrentEntry(entry_t ent)  {_currentEntry = ent;};
@@ -102,6 +116,7 @@ class SDMMC_FAT32 {
     esp_err_t read_sector(uint32_t sector); // reads one sector into uint8_t sector_buf[]
     esp_err_t cache_fat( uint32_t sector ); // reads FAT_CACHE_SECTORS into uint8_t fat_cache.uint8[] sets first and last sectors read
     esp_err_t cache_dir( uint32_t sector ); // reads DIR_CACHE_SECTORS into uint8_t dir_cache[] sets first and last sectors read
+    esp_err_t flush_fat();                  // writes modified fat_cache sectors to all the FAT copies
     esp_err_t write_block(const void *source, uint32_t block, uint32_t size);
     uint8_t*  readFirstSector(const fname_t& fname); // 
     uint8_t*  readFirstSector(entry_t* entry);
@@ -114,7 +129,9 @@ class SDMMC_FAT32 {
 
     uint8_t   getPartitionId()      {return _partitionId;}
     uint32_t  getFirstSector()      {return _firstSector;}
+    uint32_t  getSectorsTotal()     {return _sectorsTotal;}
     uint32_t  getFsType()           {return _fsType;}
+    bool      isExFat()             {return _exfat;}
     uint32_t  getFirstDataSector()  {return _firstDataSector;}
     uint8_t   getNumFats()          {return _numFats;}
     uint32_t  getReservedSectors()  {return _reservedSectors;}
@@ -125,6 +142,7 @@ class SDMMC_FAT32 {
     
     esp_err_t get_mbr();
     esp_err_t get_bpb(); 
+    esp_err_t get_exfat_bpb();      // called by get_bpb() when the boot sector says "EXFAT"
     
   private:
     struct __attribute__((packed)) {
@@ -167,6 +185,8 @@ class SDMMC_FAT32 {
       uint16_t  bootEndSignature; 
     } bpbStruct;
 
+    BlockDevice* _Dev = nullptr;
+
     uint8_t sector_buf[BYTES_PER_SECTOR]; // read_sector(sector) uses this buf
     volatile uint32_t  _sectorInBuf = 0;
     volatile int       _dirent_num = 0;
@@ -188,6 +208,9 @@ class SDMMC_FAT32 {
     uint32_t  _sectorsPerCluster;
     uint32_t  _rootCluster;
     uint32_t  _sectorsTotal;
+    uint32_t  _clusterCount;
+    bool      _exfat = false;
+    uint8_t   _fatDirty = 0;          // bitmask of modified sectors in fat_cache
     volatile uint32_t  _firstCachedFatSector = 0;
     volatile uint32_t  _lastCachedFatSector = 0;
     volatile uint32_t  _firstCachedDirSector = 0;
@@ -196,21 +219,43 @@ class SDMMC_FAT32 {
     volatile uint32_t  _currentCluster;
     fpath_t   _currentDir;
     entry_t   _currentEntry;
+    std::vector<dirchain_t> _dirChains;     // prepareChains() results sorted by cluster
+    std::vector<chain_t>    _chainPool;
+    dirindex_t _dirIndex[DIR_INDEX_CACHE];
+    uint32_t  _dirIndexTick = 0;
     uint32_t  _bytesPerCluster;
     volatile uint32_t  _startSector;
     volatile uint32_t  _startCluster;
+    uint32_t  _startContig = 0;     // clusters of the current dir if it's contiguous (exFAT), 0 = FAT chained
     /*
      * Cluster and sector calculations
      */
     inline uint32_t fatSectorByCluster(uint32_t cluster)    {return _firstSector + cluster * 4 / _bytesPerSector + _reservedSectors; }
     inline uint32_t fatClusterBySector(uint32_t sector)     {return (sector - _reservedSectors  - _firstSector) * _bytesPerSector / 4 ; }
     inline uint32_t fatByteOffset(uint32_t cluster)         {return cluster * 4 % _bytesPerSector; }
-    inline uint32_t firstSectorOfCluster(uint32_t cluster)  {return _firstSector + (cluster - _rootCluster) * _sectorsPerCluster + _firstDataSector ; }
+    inline uint32_t firstSectorOfCluster(uint32_t cluster)  {return _firstSector + (cluster - 2) * _sectorsPerCluster + _firstDataSector ; }
     inline uint32_t lastSectorOfCluster(uint32_t cluster)   {return firstSectorOfCluster(cluster + 1) - 1 ; }
-    inline uint32_t clusterBySector(uint32_t sector)        {return (sector - _firstSector  - _firstDataSector) / _sectorsPerCluster + _rootCluster ; }
+    inline uint32_t clusterBySector(uint32_t sector)        {return (sector - _firstSector  - _firstDataSector) / _sectorsPerCluster + 2 ; }
     inline uint32_t fat32_cluster_id(uint16_t high, uint16_t low)  {return high << 16 | low; }
     inline uint32_t fat32_cluster_id(sfn_dir_t *d)   {return d->hi_start << 16 | d->lo_start; }
     uint32_t        getNextCluster(uint32_t cluster);
+    void            setNextCluster(uint32_t cluster, uint32_t value);
+    uint32_t        allocClusters(uint32_t count);    // finds and links a contiguous run, returns its first cluster or 0
+    void            freeChain(uint32_t cluster);
+    void            updateFsInfo(uint32_t nextFree);
+    void            buildChain(uint32_t cluster, std::vector<chain_t>& sectors);
+    bool            preparedChain(uint32_t cluster, std::vector<chain_t>& sectors);
+    void            recordChain(const dirrec_t& r, std::vector<chain_t>& sectors); // contiguous exFAT files without the FAT
+    void            fillEntry(const dirindex_t& ix, const dirrec_t& r);             // _currentEntry from an index record
+    void            rewindDirRecords(dirpos_t& pos);
+    sfn_dir_t*      nextDirRecord(dirpos_t& pos);     // raw 32-byte records of the current dir, nullptr at the end of the chain
+    sfn_dir_t*      dirRecord(uint32_t sector, int index);
+    dirindex_t&     dirIndex(uint32_t cluster, uint32_t contig = 0); // cached index of a directory, built on first use
+    void            buildDirIndex(dirindex_t& ix, uint32_t cluster, uint32_t contig);
+    bool            nextDirItem(dirpos_t& pos, fname_t& name, dirrec_t& rec);      // FAT32 LFN + SFN records
+    bool            nextExFatItem(dirpos_t& pos, fname_t& name, dirrec_t& rec);    // exFAT file entry sets
+    void            dropDirIndex(uint32_t cluster);
+    const dirrec_t* lookupEntry(const dirindex_t& ix, const char* name);
     uint32_t        findEntryCluster(const fpath_t& search_name) ; // returns first sector of a file
     uint32_t        findEntrySector(const fpath_t& search_name) {return firstSectorOfCluster(findEntryCluster(search_name));}
 
@@ -236,6 +281,7 @@ class SDMMC_FAT32 {
     const char* fat_entry_type_str(uint32_t x);
     
     const char* to_8dot3(const char*);
+    void to_sfn(const char* name, char* sfn);
     const char* add_nul(const char*);
         
    // sfn_dir_t* dir_filename(char*, sfn_dir_t*, sfn_dir_t*);
@@ -1,6 +1,5 @@
 #include "esp_err.h"
-#include "driver/sdmmc_host.h"
-#include "sdmmc_cmd.h"
+#include <algorithm>
 
 
 // utility functions for other files to import
@@ -9,7 +8,7 @@ esp_err_t SDMMC_FAT32::write_block(const void *source, uint32_t block, uint32_t
   #ifdef USE_MUTEX
   xSemaphoreTake(mutex, portMAX_DELAY);
   #endif
-  ret = sdmmc_write_sectors(&card, (const void *)source, (uint32_t)block, (uint32_t)size);
+  ret = _Dev->write(source, block, size);
   #ifdef USE_MUTEX
 	xSemaphoreGive(mutex);
   #endif
@@ -21,7 +20,7 @@ esp_err_t SDMMC_FAT32::read_block(void *dst, uint32_t start_sector, uint32_t sec
   #ifdef USE_MUTEX
   xSemaphoreTake(mutex, portMAX_DELAY);
   #endif
-  ret = sdmmc_read_sectors(&card, (void *)dst, (uint32_t)start_sector, (uint32_t)sector_count);
+  ret = _Dev->read(dst, start_sector, sector_count);
   #ifdef USE_MUTEX
 	xSemaphoreGive(mutex);
   #endif
@@ -33,7 +32,7 @@ esp_err_t SDMMC_FAT32::read_sector( uint32_t sector )
   #ifdef USE_MUTEX
   xSemaphoreTake(mutex, portMAX_DELAY);
   #endif
-  ret = sdmmc_read_sectors(&card, (void *)sector_buf, (uint32_t)sector, 1UL );
+  ret = _Dev->read(sector_buf, sector, 1);
   _sectorInBuf = sector;
   #ifdef USE_MUTEX
 	xSemaphoreGive(mutex);
@@ -43,10 +42,11 @@ esp_err_t SDMMC_FAT32::read_sector( uint32_t sector )
 
 esp_err_t SDMMC_FAT32::cache_fat( uint32_t sector )
 {
+  if (_fatDirty) flush_fat();
   #ifdef USE_MUTEX
   xSemaphoreTake(mutex, portMAX_DELAY);
   #endif
-  ret = sdmmc_read_sectors(&card, (void *)(fat_cache.uint8), (uint32_t)sector, FAT_CACHE_SECTORS );
+  ret = _Dev->read(fat_cache.uint8, sector, FAT_CACHE_SECTORS);
   _firstCachedFatSector = sector;
   _lastCachedFatSector = sector + FAT_CACHE_SECTORS - 1;
   #ifdef USE_MUTEX
@@ -60,7 +60,7 @@ esp_err_t SDMMC_FAT32::cache_dir( uint32_t sector )
   #ifdef USE_MUTEX
   xSemaphoreTake(mutex, portMAX_DELAY);
   #endif
-  ret = sdmmc_read_sectors(&card, (void *)(dir_cache), (uint32_t)sector, DIR_CACHE_SECTORS );
+  ret = _Dev->read(dir_cache, sector, DIR_CACHE_SECTORS);
   _firstCachedDirSector = sector;
   _lastCachedDirSector = sector + DIR_CACHE_SECTORS - 1;
   #ifdef USE_MUTEX
@@ -69,109 +69,43 @@ esp_err_t SDMMC_FAT32::cache_dir( uint32_t sector )
   return(ret);
 }
 
-// tool to test hardware with different buffer sizes
-void SDMMC_FAT32::testReadSpeed(uint32_t sectorsPerRead, uint32_t totalMB){
-  uint32_t readCount = totalMB * 1024 * 1024 / BYTES_PER_SECTOR / sectorsPerRead;
-  //auto rcv = static_cast<uint8_t*>(malloc(BYTES_PER_SECTOR*READ_BUF_SECTORS*sizeof(uint8_t)));
-  uint8_t rcv[BYTES_PER_SECTOR*READ_BUF_SECTORS]; 
-  pinMode(18,INPUT);
-  randomSeed(analogRead(18));
-  volatile size_t ms1, ms2;
-  ms1 = micros();
-  for (uint32_t i = 0; i<readCount; ++i) {    
-    uint32_t start_sector = random(_sectorsTotal-sectorsPerRead);
-    read_block((void*)rcv, start_sector, sectorsPerRead);
-  }
-  ms2 = micros(); 
-  float MBytesPerS = (float)totalMB * 1000.0 * 1000.0 / (float)(ms2-ms1);
-  DEBF("Reading %d MBytes\r\n", totalMB);
-  DEBF("Reading block size: %d Bytes\r\n", sectorsPerRead * BYTES_PER_SECTOR);
-  DEBF("Time spent: %d ms\r\n" , (ms2-ms1)/1000);
-  DEBF("Read speed: %3.2f MB/s\r\n\r\n" , MBytesPerS);
+esp_err_t SDMMC_FAT32::flush_fat()
+{
+  ret = ESP_OK;
+  for (int i = 0; i < FAT_CACHE_SECTORS; i++) {
+    if (!bitRead(_fatDirty, i)) continue;
+    for (int f = 0; f < _numFats; f++) {
+      ret = write_block(&fat_cache.uint8[i * BYTES_PER_SECTOR], _firstCachedFatSector + i + f * _sectorsPerFat, 1);
+      if (ret != ESP_OK) return ret;
+    }
+  }
+  _fatDirty = 0;
+  return ret;
 }
-    
-void SDMMC_FAT32::begin(void)
+
+void SDMMC_FAT32::begin(BlockDevice* dev)
 {
 #ifdef USE_MUTEX
   mutex = xSemaphoreCreateMutex();
 #endif
-  sdmmc_host_t host = SDMMC_HOST_DEFAULT();
-  sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
-  host.flags = SDMMC_HOST_FLAG_4BIT;
-  host.flags &= ~SDMMC_HOST_FLAG_DDR;       // DDR mode OFF
-  // host.flags |= SDMMC_HOST_FLAG_DDR;          // DDR mode ON
-  // host.max_freq_khz = SDMMC_FREQ_52M;
-  host.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
-#if defined SDMMC_D0
-
-  gpio_pulldown_dis((gpio_num_t)SDMMC_D0);
-  gpio_pulldown_dis((gpio_num_t)SDMMC_D1);
-  gpio_pulldown_dis((gpio_num_t)SDMMC_D2); 
-  gpio_pulldown_dis((gpio_num_t)SDMMC_D3);
-  gpio_pulldown_dis((gpio_num_t)SDMMC_CLK);
-  gpio_pulldown_dis((gpio_num_t)SDMMC_CMD);
-  gpio_pullup_en((gpio_num_t)SDMMC_D0);
-  gpio_pullup_en((gpio_num_t)SDMMC_D1);
-  gpio_pullup_en((gpio_num_t)SDMMC_D3);
-  gpio_pullup_en((gpio_num_t)SDMMC_CLK);
-  gpio_pullup_en((gpio_num_t)SDMMC_CMD);
- #if defined(CONFIG_IDF_TARGET_ESP32S3)
-  gpio_pullup_en((gpio_num_t)SDMMC_D2); // formally this is required, nevertheless GPIO12 of ESP32 set HIGH in some cases leads to a bootloop or a bootstop, so it's up to you if you want it for ESP32
-  slot_config.clk = (gpio_num_t)SDMMC_CLK;
-  slot_config.cmd = (gpio_num_t)SDMMC_CMD;
-  slot_config.d0  = (gpio_num_t)SDMMC_D0;
-  slot_config.d1  = (gpio_num_t)SDMMC_D1;
-  slot_config.d2  = (gpio_num_t)SDMMC_D2;
-  slot_config.d3  = (gpio_num_t)SDMMC_D3;
- #endif
-#endif
-  
-   
-  slot_config.width = 4;
-  ret = sdmmc_host_init();
-  if(ret != ESP_OK) {    DEBF( "sdmmc_host_init : %s\r\n", esp_err_to_name(ret));  }
-  ret = sdmmc_host_set_bus_ddr_mode(SDMMC_HOST_SLOT_1, false);
-  if(ret != ESP_OK) {    DEBF( "sdmmc_host_set_bus_ddr_mode : %s\r\n", esp_err_to_name(ret));   }
-  ret = sdmmc_host_init_slot(SDMMC_HOST_SLOT_1, &slot_config);
-  if(ret != ESP_OK) {    DEBF( "sdmmc_host_init_slot : %s\r\n", esp_err_to_name(ret));  }
-  ret = sdmmc_card_init(&host, &card);  
-  if(ret != ESP_OK) {    DEBF( "sdmmc_card_init : %s\r\n", esp_err_to_name(ret));  }
-  sdmmc_card_print_info(stdout, &card);
-  uint32_t width = sdmmc_host_get_slot_width(SDMMC_HOST_SLOT_1);
-  DEBF( "Bus width: %d\r\n", width);
+  _Dev = dev;
+  ret = _Dev->begin();
+  if(ret != ESP_OK) {    DEBF( "device begin : %s\r\n", esp_err_to_name(ret));  return; }
   ret = get_mbr();
   if(ret != ESP_OK) {    DEBF( "get_mbr : %s\r\n", esp_err_to_name(ret));  }
   ret = get_bpb();
   if(ret != ESP_OK) {    DEBF( "get_bpb : %s\r\n", esp_err_to_name(ret));  }
-
-
-/*
- * 
- *  sdmmc_host_set_cclk_always_on(int slot, bool cclk_always_on);
- *  sdmmc_host_set_bus_width(int slot, size_t width);
- *  sdmmc_host_set_card_clk(int slot, uint32_t freq_khz);
- *  sdmmc_host_set_bus_ddr_mode(int slot, bool ddr_enabled);
- *  sdmmc_host_get_real_freq(int slot, int *real_freq_khz);
- *  sdmmc_host_set_input_delay(int slot, sdmmc_delay_phase_t delay_phase);
- *  
- *  SDMMC_SLOT_FLAG_INTERNAL_PULLUP macro
- *  
- */
-  
 }
 
 void SDMMC_FAT32::end() {
-  ret = sdmmc_host_deinit() ;
-  if(ret != ESP_OK){
-    DEBF( "sdmmc_host_deinit : %s\r\n", esp_err_to_name(ret));
-  }
+  _Dev->end();
 }
 
 esp_err_t SDMMC_FAT32::get_mbr() {
   ret = read_block(&mbrStruct, 0, 1);
   if (ret == ESP_OK) {
     for (int i = 0; i < 4; i++) {
-      if (mbrStruct.partitionData[i].fsType == 11  ||  mbrStruct.partitionData[i].fsType == 12) { 
+      if (mbrStruct.partitionData[i].fsType == 11  ||  mbrStruct.partitionData[i].fsType == 12  ||  mbrStruct.partitionData[i].fsType == 7) { // FAT32 CHS/LBA, exFAT
         _firstSector  = mbrStruct.partitionData[i].firstSector;
         DEBF("_firstSector %d\r\n", _firstSector);
         _fsType       = mbrStruct.partitionData[i].fsType;
@@ -192,8 +126,10 @@ esp_err_t SDMMC_FAT32::get_mbr() {
 }
 
 esp_err_t SDMMC_FAT32::get_bpb() {
-  ret = read_block(&bpbStruct, mbrStruct.partitionData[0].firstSector, 1);
+  ret = read_block(&bpbStruct, _firstSector, 1);
+  if (ret == ESP_OK && memcmp(bpbStruct.OEMName, "EXFAT   ", 8) == 0) return get_exfat_bpb();
   if (ret == ESP_OK) {
+    _exfat              = false;
     _sectorsPerFat      = bpbStruct.sectorsPerFat;
     DEBF("_sectorsPerFat %d\r\n", _sectorsPerFat);
     _bytesPerSector     = bpbStruct.bytesPerSector;
@@ -210,11 +146,43 @@ esp_err_t SDMMC_FAT32::get_bpb() {
     DEBF("_sectorsPerCluster %d\r\n", _sectorsPerCluster);
     _bytesPerCluster  = _sectorsPerCluster * _bytesPerSector ;
     DEBF("_bytesPerCluster %d\r\n", _bytesPerCluster);
+    _clusterCount = ((bpbStruct.totalSectors > 0 ? bpbStruct.totalSectors : _sectorsTotal) - _firstDataSector) / _sectorsPerCluster;
+    _clusterCount = min(_clusterCount, _sectorsPerFat * (_bytesPerSector / 4) - 2);
+    DEBF("_clusterCount %d\r\n", _clusterCount);
     DEBUG(">>>Reading BPB done.");
   }
   return ret;
 }
 
+esp_err_t SDMMC_FAT32::get_exfat_bpb() {
+  // exFAT keeps a FAT of 32-bit entries too, so once the geometry is set, getNextCluster() and prepareChains() 
+  // work as they are. The differences are in the directory records and in NoFatChain files, see nextExFatItem().
+  const exfat_bpb_t* x = reinterpret_cast<const exfat_bpb_t*>(&bpbStruct);
+  if (x->bytesPerSectorShift != 9) {
+    DEBF("SDMMC: exFAT with %d bytes per sector is not supported\r\n", 1 << x->bytesPerSectorShift);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  _exfat              = true;
+  _bytesPerSector     = BYTES_PER_SECTOR;
+  _sectorsPerFat      = x->fatLength;
+  DEBF("_sectorsPerFat %d\r\n", _sectorsPerFat);
+  _numFats            = x->numberOfFats;
+  _reservedSectors    = x->fatOffset;          // so that fatSectorByCluster() finds the FAT
+  DEBF("_reservedSectors %d\r\n", _reservedSectors);
+  _rootCluster        = x->rootCluster;
+  DEBF("_rootCluster %d\r\n", _rootCluster);
+  _firstDataSector    = x->clusterHeapOffset;
+  DEBF("_firstDataSector %d\r\n", _firstDataSector);
+  _sectorsPerCluster  = 1UL << x->sectorsPerClusterShift;
+  DEBF("_sectorsPerCluster %d\r\n", _sectorsPerCluster);
+  _bytesPerCluster    = _sectorsPerCluster * _bytesPerSector;
+  DEBF("_bytesPerCluster %d\r\n", _bytesPerCluster);
+  _clusterCount       = x->clusterCount;
+  DEBF("_clusterCount %d\r\n", _clusterCount);
+  DEBUG(">>>Reading exFAT boot sector done.");
+  return ESP_OK;
+}
+
 uint32_t SDMMC_FAT32::getNextSector(uint32_t curSector) {
   if (curSector == 0) {
     curSector = _sectorInBuf;
@@ -244,54 +212,410 @@ uint32_t SDMMC_FAT32::getNextCluster(uint32_t cluster) {
   return nextCluster;
 }
 
+void SDMMC_FAT32::setNextCluster(uint32_t cluster, uint32_t value) {
+  uint32_t neededSector = fatSectorByCluster(cluster);
+  uint32_t recOffset = fatByteOffset(cluster) / 4;
+  if (neededSector < _firstCachedFatSector || neededSector > _lastCachedFatSector) {
+    cache_fat(neededSector);
+  }
+  uint32_t& rec = fat_cache.uint32[(neededSector - _firstCachedFatSector) * (BYTES_PER_SECTOR/4) + recOffset];
+  rec = (rec & 0xF0000000) | (value & 0x0FFFFFFF); // upper 4 bits are reserved
+  bitSet(_fatDirty, neededSector - _firstCachedFatSector);
+}
+
+uint32_t SDMMC_FAT32::allocClusters(uint32_t count) {
+  uint32_t fsInfoSector = _firstSector + bpbStruct.FSinfo;
+  uint32_t end = _clusterCount + 2;
+  uint32_t cl = 2;
+  uint32_t runStart = 0;
+  uint32_t runLen = 0;
+  fsinfo_t* fsi = reinterpret_cast<fsinfo_t*>(readSector(fsInfoSector));
+  if (fsi->leadSig == 0x41615252 && fsi->structSig == 0x61417272 && fsi->nextFree >= 2 && fsi->nextFree < end) {
+    cl = fsi->nextFree;
+  }
+  for (uint32_t n = 0; n < end - 2; n++, cl++) {
+    if (cl >= end) { // wrap around, a run can't continue from the last cluster to the first one
+      cl = 2;
+      runLen = 0;
+    }
+    if ((getNextCluster(cl) & 0x0FFFFFFF) == FREE_CLUSTER) {
+      if (runLen == 0) runStart = cl;
+      runLen++;
+      if (runLen == count) break;
+    } else {
+      runLen = 0;
+    }
+  }
+  if (runLen < count) {
+    DEBF("SDMMC: no room for %d contiguous clusters\r\n", count);
+    return 0;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    setNextCluster(runStart + i, (i + 1 < count) ? runStart + i + 1 : 0x0FFFFFFF);
+  }
+  flush_fat();
+  updateFsInfo(runStart + count);
+  return runStart;
+}
+
+void SDMMC_FAT32::freeChain(uint32_t cluster) {
+  uint32_t next;
+  while (cluster >= 2 && cluster < _clusterCount + 2) {
+    next = getNextCluster(cluster) & 0x0FFFFFFF;
+    setNextCluster(cluster, FREE_CLUSTER);
+    if (fat_entry_type(next) != USED_CLUSTER) break;
+    cluster = next;
+  }
+  flush_fat();
+  updateFsInfo(0);
+}
+
+// we don't count free clusters, so we just tell the OS that the free count is unknown
+void SDMMC_FAT32::updateFsInfo(uint32_t nextFree) {
+  uint32_t fsInfoSector = _firstSector + bpbStruct.FSinfo;
+  fsinfo_t* fsi = reinterpret_cast<fsinfo_t*>(readSector(fsInfoSector));
+  if (fsi->leadSig != 0x41615252 || fsi->structSig != 0x61417272) return;
+  fsi->freeCount = 0xFFFFFFFF;
+  if (nextFree > 0) fsi->nextFree = nextFree;
+  write_block(sector_buf, fsInfoSector, 1);
+}
+
+void SDMMC_FAT32::buildChain(uint32_t cl, std::vector<chain_t>& sectors) {
+  chain_t chain;
+  uint32_t cl_addr;
+  if (preparedChain(cl, sectors)) return;
+  sectors.clear();
+  chain.first=firstSectorOfCluster(cl);
+  chain.last = chain.first;
+  cl_addr = cl;
+  while (true) {
+    cl = getNextCluster(cl_addr);
+    if (fat_entry_type(cl)==LAST_CLUSTER) {
+      chain.last = lastSectorOfCluster(cl_addr);
+      break;
+    }
+    if ( (cl - cl_addr) != 1 ) { 
+      chain.last = lastSectorOfCluster(cl_addr);
+      sectors.push_back(chain);
+      chain.first = firstSectorOfCluster(cl);
+    }
+    cl_addr = cl;
+  }
+  sectors.push_back(chain);
+}
+
+bool SDMMC_FAT32::preparedChain(uint32_t cl, std::vector<chain_t>& sectors) {
+  if (_dirChains.empty()) return false;
+  auto it = std::lower_bound(_dirChains.begin(), _dirChains.end(), cl, [](const dirchain_t& a, uint32_t c) {return a.cluster < c;});
+  if (it == _dirChains.end() || it->cluster != cl) return false;
+  sectors.assign(_chainPool.begin() + it->first, _chainPool.begin() + it->first + it->count);
+  return true;
+}
+
+void SDMMC_FAT32::dropChains() {
+  std::vector<dirchain_t>().swap(_dirChains);
+  std::vector<chain_t>().swap(_chainPool);
+}
+
+void SDMMC_FAT32::prepareChains() {
+  // Instead of following each file through getNextCluster(), all the files are sorted by their first cluster
+  // and their chains are walked over a large FAT window that mostly moves forward. Contiguous runs are found 
+  // by comparing the window words against the expected next cluster, so a non-fragmented file costs a tight loop
+  // over its entries and a fragment boundary is the only place where a chain is broken.
+  // Every FAT entry of a chained file is still read and compared: FAT32 has no contiguity flag, and an entry that
+  // points to the next cluster is the only proof that the run goes on, so jumping to the expected end of a run
+  // and checking just that entry could splice the clusters of another file into this one. What the pass saves is
+  // the read and the call per cluster; only the exFAT NoFatChain files skip the FAT entirely.
+  dirchain_t f;
+  chain_t chain;
+  uint32_t reads = 0, readSectors = 0, fragmented = 0;
+  uint32_t t0 = micros();
+  const uint32_t perSector = _bytesPerSector / 4;
+  const uint32_t fatFirst = _firstSector + _reservedSectors;
+  const uint32_t fatEnd = fatFirst + _sectorsPerFat;
+  const uint32_t clEnd = _clusterCount + 2;
+  uint32_t winFirst = 0, winEnd = 0;  // clusters covered by the window
+  dropChains();
+  for (auto& r: dirIndex(_startCluster, _startContig).recs) {
+    if (r.flags & DIRREC_CONTIGUOUS) continue;  // recordChain() doesn't need the FAT for these
+    f.cluster = r.cluster;
+    if (f.cluster < 2 || f.cluster >= clEnd) continue; // empty files and "." entries, buildChain() handles them as before
+    f.first = 0;
+    f.count = 0;
+    _dirChains.push_back(f);
+  }
+  if (_dirChains.empty()) return;
+  std::sort(_dirChains.begin(), _dirChains.end(), [](const dirchain_t& a, const dirchain_t& b) {return a.cluster < b.cluster;});
+  if (_fatDirty) flush_fat();
+  uint32_t* win = (uint32_t*)heap_caps_malloc(FAT_BULK_SECTORS * BYTES_PER_SECTOR, MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA);
+  if (win == NULL) {
+    DEBUG("SDMMC: no RAM for the FAT window, chains will be built one by one");
+    _dirChains.clear();
+    return;
+  }
+  for (size_t i = 0; i < _dirChains.size(); i++) {
+    dirchain_t& fc = _dirChains[i];
+    if (i > 0 && _dirChains[i - 1].cluster == fc.cluster) { // hard links do not exist in FAT, but broken dirs do
+      fc.first = _dirChains[i - 1].first;
+      fc.count = _dirChains[i - 1].count;
+      continue;
+    }
+    uint32_t cl = fc.cluster;
+    uint32_t hops = 0;
+    fc.first = _chainPool.size();
+    chain.first = firstSectorOfCluster(cl);
+    while (true) {
+      if (cl < winFirst || cl >= winEnd) {
+        uint32_t sector = fatSectorByCluster(cl);
+        uint32_t count = min((uint32_t)FAT_BULK_SECTORS, fatEnd - sector);
+        if (read_block(win, sector, count) != ESP_OK) {
+          winFirst = winEnd = 0;
+          chain.last = lastSectorOfCluster(cl);
+          break;
+        }
+        reads++;
+        readSectors += count;
+        winFirst = (sector - fatFirst) * perSector;
+        winEnd = winFirst + count * perSector;
+      }
+      const uint32_t* e = win + (cl - winFirst);
+      uint32_t n = min(winEnd, clEnd) - cl;
+      uint32_t k = 0;
+      while (k < n && (e[k] & 0x0FFFFFFF) == cl + k + 1) k++;
+      hops += k;
+      if (k == n) {           // the run goes on beyond the window
+        cl += k;
+        if (cl < clEnd) continue;
+        chain.last = lastSectorOfCluster(cl - 1);
+        break;
+      }
+      uint32_t next = e[k] & 0x0FFFFFFF;
+      chain.last = lastSectorOfCluster(cl + k);
+      if (fat_entry_type(next) != USED_CLUSTER || next >= clEnd || ++hops > _clusterCount) break; // EOC, or a broken chain
+      _chainPool.push_back(chain);
+      chain.first = firstSectorOfCluster(next);
+      cl = next;
+    }
+    _chainPool.push_back(chain);
+    fc.count = _chainPool.size() - fc.first;
+    if (fc.count > 1) fragmented++;
+  }
+  heap_caps_free(win);
+  DEBF("SDMMC: FAT scan: %u files, %d fragmented, %u chains, %d reads (%d sectors) in %d us\r\n", (unsigned)_dirChains.size(), fragmented, (unsigned)_chainPool.size(), reads, readSectors, micros() - t0);
+}
+
 
 entry_t* SDMMC_FAT32::findEntry(const fpath_t& search_path) {
-  entry_t* entry;
-  fpath_t name, testname;
-  name = search_path;
-  name.toUpperCase();
+  fpath_t name = search_path;
   name.replace("\\",""); 
   DEBF("Searching in <%s> for [%s] entry:\r\n", _currentDir.c_str(), search_path.c_str());
-  rewindDir();
-  entry = nextEntry();
-  while (!entry->is_end) {
-    testname = entry->name;
-    testname.toUpperCase();
-    //DEBF("compare <%s> <%s>\r\n", name.c_str(), testname.c_str());
-    if (testname == name) {
-      return entry;
-      break;
-    }
-    entry = nextEntry();
+  dirindex_t& ix = dirIndex(_startCluster, _startContig);
+  const dirrec_t* r = lookupEntry(ix, name.c_str());
+  if (r == nullptr) {
+    _currentEntry.is_dir = -1;
+    _currentEntry.is_end = 1;
+    _currentEntry.name = "";
+    _currentEntry.size = 0;
+    _currentEntry.sectors.clear();
+    return &_currentEntry;
+  }
+  fillEntry(ix, *r);
+  return &_currentEntry;
+}
+
+void SDMMC_FAT32::fillEntry(const dirindex_t& ix, const dirrec_t& r) {
+  _currentEntry.name = &ix.names[r.name];
+  _currentEntry.size = r.size;
+  _currentEntry.is_dir = (r.attr & FAT32_DIR);
+  _currentEntry.is_end = 0;
+  _currentEntry.dir_sector = r.dir_sector;
+  _currentEntry.dir_index = r.dir_index;
+  recordChain(r, _currentEntry.sectors);
+}
+
+void SDMMC_FAT32::recordChain(const dirrec_t& r, std::vector<chain_t>& sectors) {
+  if (r.flags & DIRREC_CONTIGUOUS) {  // the FAT entries of NoFatChain files are undefined, the size tells the length
+    uint32_t clusters = max((uint32_t)(((uint64_t)r.size + _bytesPerCluster - 1) / _bytesPerCluster), (uint32_t)1);
+    chain_t chain;
+    chain.first = firstSectorOfCluster(r.cluster);
+    chain.last  = chain.first + clusters * _sectorsPerCluster - 1;
+    sectors.assign(1, chain);
+    return;
   }
-  entry->is_dir = -1;
-  entry->is_end = 1;
-  entry->name = "";
-  entry->size = 0;
-  return entry;
+  buildChain(r.cluster, sectors);
 }
 
 uint32_t SDMMC_FAT32::findEntryCluster(const fpath_t& search_path) {
-  uint32_t first_cluster = 0;
-  entry_t* entry;
-  fpath_t name, testname;
-  name = search_path;
-  name.toUpperCase();
+  fpath_t name = search_path;
   name.replace("\\",""); 
   DEBF("Searching in <%s> for [%s] entry cluster:\r\n", _currentDir.c_str(), search_path.c_str());
-  rewindDir();
-  entry = nextEntry();
-  while (!entry->is_end) {
-    testname = entry->name;
-    testname.toUpperCase();
-    //DEBF("compare <%s> <%s>\r\n", name.c_str(), testname.c_str());
-    if (testname == name) {
-      first_cluster = clusterBySector(entry->sectors[0].first);
+  const dirrec_t* r = lookupEntry(dirIndex(_startCluster, _startContig), name.c_str());
+  return r ? r->cluster : 0;
+}
+
+dirindex_t& SDMMC_FAT32::dirIndex(uint32_t cluster, uint32_t contig) {
+  dirindex_t* victim = &_dirIndex[0];
+  for (auto& ix: _dirIndex) {
+    if (ix.cluster == cluster) {
+      ix.used = ++_dirIndexTick;
+      return ix;
+    }
+    if (ix.used < victim->used) victim = &ix; // unused ones have used == 0
+  }
+  buildDirIndex(*victim, cluster, contig);
+  victim->used = ++_dirIndexTick;
+  return *victim;
+}
+
+void SDMMC_FAT32::dropDirIndex(uint32_t cluster) {
+  for (auto& ix: _dirIndex) {
+    if (ix.cluster != cluster) continue;
+    ix.cluster = 0;
+    ix.used = 0;
+    std::vector<dirrec_t>().swap(ix.recs);
+    std::vector<uint16_t>().swap(ix.slots);
+    std::vector<char>().swap(ix.names);
+  }
+}
+
+void SDMMC_FAT32::buildDirIndex(dirindex_t& ix, uint32_t cluster, uint32_t contig) {
+  // One pass over the raw records through dir_cache. Cluster chains are not built here: 
+  // only findEntry() and nextEntry() need those, and only for the entries they return.
+  dirpos_t pos;
+  dirrec_t rec;
+  fname_t filename;
+  uint32_t t0 = micros();
+  ix.cluster = cluster;
+  ix.recs.clear();
+  ix.names.clear();
+  pos.cluster = cluster;
+  pos.sector  = firstSectorOfCluster(cluster);
+  pos.index   = 0;
+  pos.left    = contig;
+  while (_exfat ? nextExFatItem(pos, filename, rec) : nextDirItem(pos, filename, rec)) {
+    if (ix.recs.size() >= DIR_SLOT_EMPTY - 1) {
+      DEBF("SDMMC: too many entries, indexing stopped at <%s>\r\n", filename.c_str());
       break;
     }
-    entry = nextEntry();
+    rec.hash = foldHash(filename.c_str());
+    rec.name = ix.names.size();
+    ix.names.insert(ix.names.end(), filename.c_str(), filename.c_str() + filename.length() + 1);
+    ix.recs.push_back(rec);
+  }
+  size_t cap = 8;
+  while (cap < ix.recs.size() * 2) cap <<= 1;
+  ix.slots.assign(cap, DIR_SLOT_EMPTY);
+  for (uint32_t i = 0; i < ix.recs.size(); i++) {
+    const char* name = &ix.names[ix.recs[i].name];
+    if (lookupEntry(ix, name) != nullptr) continue; // the first one wins, as it did with the linear search
+    uint32_t k = ix.recs[i].hash & (cap - 1);
+    while (ix.slots[k] != DIR_SLOT_EMPTY) k = (k + 1) & (cap - 1);
+    ix.slots[k] = i;
+  }
+  DEBF("SDMMC: indexed dir at cluster %d: %u entries in %d us\r\n", cluster, (unsigned)ix.recs.size(), micros() - t0);
+}
+
+bool SDMMC_FAT32::nextDirItem(dirpos_t& pos, fname_t& name, dirrec_t& rec) {
+  // LFNs are assembled the same way buildNextEntry() used to do it
+  uint8_t fname[513];
+  sfn_dir_t* d;
+  memset(&fname, 0, 513);
+  while ((d = nextDirRecord(pos)) != nullptr) {
+    if (d->filename[0] == 0) return false; // no more records
+    if (d->attr == FAT32_LONG_FILE_NAME) {
+      lfn_dir_t* lfn = reinterpret_cast<lfn_dir_t*>(d);
+      if (lfn_is_deleted(lfn->seqno)) continue;
+      int n = ((lfn->seqno & 0x3F) - 1) * 26;
+      if (n < 0 || n + 26 > 512) continue; // broken sequence number
+      memcpy(&(fname[n]),  &(lfn->name1_5),  10);
+      memcpy(&(fname[10+n]), &(lfn->name6_11), 12);
+      memcpy(&(fname[22+n]), &(lfn->name12_13), 4);
+      continue;
+    }
+    if (d->attr & (FAT32_VOLUME_LABEL | FAT32_HIDDEN | FAT32_SYSTEM_FILE) || dirent_free(d)) {
+      memset(&fname, 0, 513);
+      continue; // skip deleted, system and hidden, sysvol
+    }
+    name = unicode2ascii(reinterpret_cast<uint16_t*>(&fname), MAX_NAME_LEN);
+    if (name == "") name = to_8dot3(d->filename);
+    if (name.endsWith(".")) name.remove(name.length()-1,1);
+    rec.cluster = fat32_cluster_id(d);
+    if (rec.cluster == 0 && (d->attr & FAT32_DIR)) rec.cluster = _rootCluster; // ".." of a first level dir
+    rec.size = d->file_nbytes;
+    rec.mtime = (uint32_t)d->mod_date << 16 | d->mod_time;
+    rec.attr = d->attr;
+    rec.flags = 0;
+    rec.dir_sector = pos.sector;
+    rec.dir_index = pos.index - 1;
+    return true;
+  }
+  return false;
+}
+
+bool SDMMC_FAT32::nextExFatItem(dirpos_t& pos, fname_t& name, dirrec_t& rec) {
+  // a file is an entry set: the file entry, the stream extension (cluster, size, flags) and 1..17 name entries.
+  // exFAT has no "." and ".." records, setCurrentDir() doesn't need them.
+  uint16_t uname[MAX_NAME_LEN];
+  sfn_dir_t* d;
+  while ((d = nextDirRecord(pos)) != nullptr) {
+    uint8_t type = reinterpret_cast<uint8_t*>(d)[0];
+    if (type == EXFAT_END) return false;
+    if (type != EXFAT_FILE) continue;   // bitmap, upcase table, label, deleted sets
+    const exfat_file_t* f = reinterpret_cast<const exfat_file_t*>(d);
+    int secondary = f->secondaryCount;
+    rec.attr = f->attr;
+    rec.mtime = f->modTime;
+    rec.dir_sector = pos.sector;
+    rec.dir_index = pos.index - 1;
+    if (secondary < 2 || (d = nextDirRecord(pos)) == nullptr) continue;
+    const exfat_stream_t* st = reinterpret_cast<const exfat_stream_t*>(d);
+    if (st->type != EXFAT_STREAM) {
+      pos.index--;  // broken set, this record may start the next one
+      continue;
+    }
+    rec.cluster = st->firstCluster;
+    rec.size = (uint32_t)min(st->dataLength, (uint64_t)0xFFFFFFFF);
+    rec.flags = (st->flags & EXFAT_NO_FAT_CHAIN) ? DIRREC_CONTIGUOUS : 0;
+    int len = st->nameLength;
+    int got = 0;
+    memset(uname, 0, sizeof(uname));
+    for (int i = 1; i < secondary && got < len; i++) {
+      if ((d = nextDirRecord(pos)) == nullptr) return false;
+      const exfat_name_t* n = reinterpret_cast<const exfat_name_t*>(d);
+      if (n->type != EXFAT_NAME) {
+        pos.index--;
+        break;
+      }
+      for (int k = 0; k < 15 && got < len; k++, got++) {
+        if (got < MAX_NAME_LEN) uname[got] = n->name[k];
+      }
+    }
+    if (got < len || rec.attr & (FAT32_HIDDEN | FAT32_SYSTEM_FILE)) continue;
+    name = unicode2ascii(uname, MAX_NAME_LEN);
+    return true;
+  }
+  return false;
+}
+
+const dirrec_t* SDMMC_FAT32::lookupEntry(const dirindex_t& ix, const char* name) {
+  uint32_t hash = foldHash(name);
+  uint32_t mask = ix.slots.size() - 1;
+  for (uint32_t k = hash & mask; ix.slots[k] != DIR_SLOT_EMPTY; k = (k + 1) & mask) {
+    const dirrec_t& r = ix.recs[ix.slots[k]];
+    if (r.hash == hash && strcasecmp(&ix.names[r.name], name) == 0) return &r;
+  }
+  return nullptr;
+}
+
+void SDMMC_FAT32::listCurrentDir(std::vector<fname_t>& names, bool dirs) {
+  dirindex_t& ix = dirIndex(_startCluster, _startContig);
+  names.clear();
+  for (auto& r: ix.recs) {
+    const char* name = &ix.names[r.name];
+    if ((bool)(r.attr & FAT32_DIR) != dirs) continue;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+    names.push_back(name);
   }
-  return first_cluster;
 }
 
 uint8_t* SDMMC_FAT32::readSector(uint32_t sec) {
@@ -322,29 +646,52 @@ uint8_t* SDMMC_FAT32::readNextSector(uint32_t curSector) {
 }
 
 void SDMMC_FAT32::setCurrentDir(fpath_t dir_path){
-  // not fully implemented, for now it accepts "" or "/" as a root folder, or some name without slashes as a directory in a root, yes only 1 level
-  if (dir_path == "" || dir_path == "/" || dir_path == "\\") {
-    // root
-    _currentDir = "/";
-    _startCluster   = _rootCluster;
-  } else {
-    dir_path.replace("\\","/"); // unix style
-    dir_path.replace("//","/"); // in case of some confuses
-    // now we only get the last part of the path supplied
-    if (dir_path.endsWith("/")) {
-      dir_path.remove(dir_path.length() - 1, 1);
+  // paths starting with a slash are taken from the root, the others from the current dir.
+  // "." and ".." are resolved by the path itself (exFAT has no such records), and then every level 
+  // is a lookup in the index of its parent. On a missing level we stay at the deepest dir found.
+  std::vector<fname_t> parts;
+  fname_t part;
+  auto split = [&](const char* p) {
+    for (; ; p++) {
+      if (*p != '/' && *p != 0) {
+        part += *p;
+        continue;
+      }
+      if (part == "..") {
+        if (!parts.empty()) parts.pop_back();
+      } else if (part != "" && part != ".") {
+        parts.push_back(part);
+      }
+      part = "";
+      if (*p == 0) break;
     }
-    int i = dir_path.lastIndexOf("/");
-    if (i >= 0) {
-      dir_path.remove(0, i + 1);
+  };
+  dir_path.replace("\\","/"); // unix style
+  if (!(dir_path == "" || dir_path.startsWith("/") || _startCluster < 2)) split(_currentDir.c_str());
+  split(dir_path.c_str());
+  uint32_t cl = _rootCluster;
+  uint32_t contig = 0;        // the root dir is always FAT chained
+  fpath_t path = "/";
+  for (auto& name: parts) {
+    dirindex_t& ix = dirIndex(cl, contig);
+    const dirrec_t* r = lookupEntry(ix, name.c_str());
+    if (r == nullptr || !(r->attr & FAT32_DIR)) {
+      DEBF("SDMMC: no directory <%s> in <%s>\r\n", name.c_str(), path.c_str());
+      break;
     }
-    // here we are supposed to have the last portion of the given pathname
-    _startCluster   = findEntryCluster(dir_path);
-    _currentDir = dir_path;
+    cl = r->cluster;
+    contig = (r->flags & DIRREC_CONTIGUOUS) ? max((r->size + _bytesPerCluster - 1) / _bytesPerCluster, (uint32_t)1) : 0;
+    for (const char* c = &ix.names[r->name]; *c; c++) path += *c; // as the directory spells it
+    path += '/';
   }
+  _startCluster     = cl;
+  _startContig      = contig;
+  _currentDir       = path;
   _currentCluster   = _startCluster;
   _startSector      = firstSectorOfCluster(_startCluster);
   _currentSector    = _startSector;
+  _dirent_num       = 0;
+  dropChains();
   DEBF("SDMMC: Current ROOT set to <%s>\r\n", _currentDir.c_str() );
 }
 
@@ -356,6 +703,7 @@ void SDMMC_FAT32::setCurrentPoint(point_t& p) {
   _currentDir     = p.currentDir;
   _startSector    = p.startSector;
   _startCluster   = p.startCluster;
+  _startContig    = p.startContig;
   _currentSector  = p.curSector;
   _currentCluster = p.curCluster;
   _dirent_num     = p.direntNum;
@@ -369,6 +717,7 @@ point_t SDMMC_FAT32::getCurrentPoint() {
   p.currentDir  = _currentDir;
   p.startSector = _startSector;
   p.startCluster= _startCluster;
+  p.startContig = _startContig;
   p.curSector   = _currentSector;
   p.curCluster  = _currentCluster;
   p.firstCachedFatSector = _firstCachedFatSector;
@@ -404,115 +753,168 @@ entry_t* SDMMC_FAT32::nextEntry() {
 }
 
 entry_t* SDMMC_FAT32::buildNextEntry() {
-  uint32_t cl, cl_addr;
-  uint8_t fname[513];
-  memset(&fname, 0, 513);
-  uint8_t attr, n;
-  fname_t filename, shortname;
-  chain_t chain;
-  esp_err_t ret;
-  bool entry_done = false;
+  // entries come from the directory index in the directory order, so FAT32 and exFAT look the same here
+  dirindex_t& ix = dirIndex(_startCluster, _startContig);
+  if ((size_t)_dirent_num >= ix.recs.size()) {
+    rewindDir();
+    _currentEntry.is_end = 1;
+    return &_currentEntry;
+  }
+  fillEntry(ix, ix.recs[_dirent_num]);
+  _dirent_num++;
+  return &_currentEntry;
+}
+
+void SDMMC_FAT32::rewindDirRecords(dirpos_t& pos) {
+  pos.cluster = _startCluster;
+  pos.sector  = firstSectorOfCluster(_startCluster);
+  pos.index   = 0;
+  pos.left    = _startContig;
+}
+
+sfn_dir_t* SDMMC_FAT32::nextDirRecord(dirpos_t& pos) {
+  if (pos.index >= NDIR_PER_SEC) { // going out of sector
+    pos.index = 0;
+    if (clusterBySector(pos.sector + 1) != pos.cluster) { // going out of cluster
+      if (pos.left > 0) {   // contiguous dir, its FAT entries mean nothing
+        if (--pos.left == 0) return nullptr;
+        pos.cluster++;
+      } else {
+        pos.cluster = getNextCluster(pos.cluster);
+        if (fat_entry_type(pos.cluster) != USED_CLUSTER) return nullptr;
+      }
+      pos.sector = firstSectorOfCluster(pos.cluster);
+    } else {
+      pos.sector++;
+    }
+  }
+  sfn_dir_t* d = dirRecord(pos.sector, pos.index);
+  pos.index++;
+  return d;
+}
+
+sfn_dir_t* SDMMC_FAT32::dirRecord(uint32_t sector, int index) {
+  if (sector < _firstCachedDirSector || sector > _lastCachedDirSector) {
+    cache_dir(sector);
+  }
+  return reinterpret_cast<sfn_dir_t*>(&dir_cache[(sector - _firstCachedDirSector) * BYTES_PER_SECTOR + index * DIR_ENTRY_SIZE]);
+}
+
+uint32_t SDMMC_FAT32::stampCurrentDir(const fname_t& skipName, entry_t* skipped) {
+  dirindex_t& ix = dirIndex(_startCluster, _startContig);
+  uint32_t hash = fnv1a(&_firstSector, sizeof(_firstSector)); // same files on another card layout must not match
+  hash = fnv1a(&_firstDataSector, sizeof(_firstDataSector), hash);
+  hash = fnv1a(&_sectorsPerCluster, sizeof(_sectorsPerCluster), hash);
+  skipped->is_end = 1;
+  skipped->size = 0;
+  skipped->sectors.clear();
+  for (auto& r: ix.recs) {
+    const char* name = &ix.names[r.name];
+    if (strcasecmp(name, skipName.c_str()) == 0) {
+      skipped->name = name;
+      skipped->size = r.size;
+      skipped->is_dir = (r.attr & FAT32_DIR);
+      skipped->is_end = 0;
+      skipped->dir_sector = r.dir_sector;
+      skipped->dir_index = r.dir_index;
+      recordChain(r, skipped->sectors);
+      continue;
+    }
+    hash = fnv1a(name, strlen(name), hash);
+    hash = fnv1a(&r.cluster, sizeof(r.cluster), hash);
+    hash = fnv1a(&r.size, sizeof(r.size), hash);
+    hash = fnv1a(&r.mtime, sizeof(r.mtime), hash);
+    hash = fnv1a(&r.attr, sizeof(r.attr), hash);
+    hash = fnv1a(&r.flags, sizeof(r.flags), hash);
+  }
+  return hash;
+}
+
+entry_t* SDMMC_FAT32::createEntry(const fname_t& fname, uint32_t size) {
+  char sfn[11];
+  dirpos_t pos;
+  sfn_dir_t* d;
+  bool found = false;
+  uint32_t recSector = 0;
+  int recIndex = -1;
+  uint32_t cl = 0;
+  uint32_t needClusters = max((size + _bytesPerCluster - 1) / _bytesPerCluster, (uint32_t)1);
   _currentEntry.name = "";
   _currentEntry.size = 0;
   _currentEntry.is_dir = -1;
-  _currentEntry.is_end = 0;
+  _currentEntry.is_end = 1;
   _currentEntry.sectors.clear();
-  
-  while (!entry_done) {
-    if (_dirent_num >= NDIR_PER_SEC) { // going out of sector
-      _dirent_num = 0;
-      if (clusterBySector(_currentSector+1) != _currentCluster) { // going out of cluster
-        _currentCluster = getNextCluster(_currentCluster);
-        if (fat_entry_type(_currentCluster)==LAST_CLUSTER) {
-          rewindDir();
-          _currentEntry.is_end = 1;
-          break;
-        }
-        _currentSector = firstSectorOfCluster(_currentCluster);
-      } else {
-        _currentSector++;
+  if (_exfat) {
+    DEBUG("SDMMC: exFAT is read-only");
+    return &_currentEntry;
+  }
+  dropChains();   // the FAT is going to change
+  to_sfn(fname.c_str(), sfn);
+  rewindDirRecords(pos);
+  while ((d = nextDirRecord(pos)) != nullptr) {
+    if (d->filename[0] == 0 || (uint8_t)d->filename[0] == 0xE5) { // free record
+      if (recIndex < 0) {
+        recSector = pos.sector;
+        recIndex = pos.index - 1;
       }
+      if (d->filename[0] == 0) break;
+      continue;
     }
-
-    if (_currentSector==_sectorInBuf) {
-      ret = ESP_OK; // already buffered
-    } else {
-      ret = read_sector(_currentSector);
-      if (ret!=ESP_OK) break;
-    } 
-
-    sfn_dir_t (&rec_array)[NDIR_PER_SEC] = reinterpret_cast<sfn_dir_t(&)[NDIR_PER_SEC]>(sector_buf);
-
-    attr = rec_array[_dirent_num].attr;
-    if (attr == FAT32_LONG_FILE_NAME) {     // process LFN entry part
-      entry_done = false;
-      lfn_dir_t (&lfn_entry) = reinterpret_cast<lfn_dir_t&>(rec_array[_dirent_num]);
-      // lfn_print_ent(&lfn_entry, lfn_entry.cksum);
-      n = lfn_entry.seqno;
-      // helpers: lfn_is_first(n), lfn_is_last(n), lfn_is_deleted(n)
-      if ( lfn_is_deleted(n) ) {
-//        DEBUG("\tSkipping deleted LFN entry");
-        _dirent_num++;
-        continue;
-      }
-      n = (uint8_t)((n)<<2)>>2;
-      n = (n-1)*26 ; // strip 6th bit and bring it to zero base , multiply by 26 (lfn part is 26 bytes long)
-      memcpy(&(fname[n]),  &(lfn_entry.name1_5),  10);
-      memcpy(&(fname[10+n]), &(lfn_entry.name6_11), 12);
-      memcpy(&(fname[22+n]), &(lfn_entry.name12_13), 4);
-
-    } else {                                // rec_array[i] contains SFN entry or empty record
-      // dirent_print_helper(&(rec_array[i]));
-      entry_done = true;
-      if (rec_array[_dirent_num].attr&FAT32_VOLUME_LABEL || rec_array[_dirent_num].attr&FAT32_HIDDEN || rec_array[_dirent_num].attr&FAT32_SYSTEM_FILE || dirent_free(&(rec_array[_dirent_num]))) {
-        memset(&fname, 0, 513);
-        _dirent_num++;
-        continue; // skip deleted, empty, system and hidden, sysvol
-      }
-      shortname = to_8dot3(rec_array[_dirent_num].filename);
-//      DEBF(">>>\tShort name = <%s>\r\n", shortname.c_str());
-      
-    }
-    if (entry_done) {
-      filename = unicode2ascii(reinterpret_cast<uint16_t*>(&fname), MAX_NAME_LEN)  ;
-//      DEBF(">>>\tLong name = <%s>\r\n\r\n", filename.c_str());
-      if (shortname>"" && filename == "") filename = shortname;
-      if (filename.endsWith(".")) filename.remove(filename.length()-1,1);
-      _currentEntry.name = filename;
-      _currentEntry.size =  rec_array[_dirent_num].file_nbytes;
-      _currentEntry.is_dir = (rec_array[_dirent_num].attr&FAT32_DIR);
-
-      cl = fat32_cluster_id(&rec_array[_dirent_num]);
-      
-      chain.first=firstSectorOfCluster(cl);
-      chain.last = chain.first;
-      cl_addr = cl;
-      while (true) {
-        cl = getNextCluster(cl_addr);
-        if (fat_entry_type(cl)==LAST_CLUSTER) {
-          chain.last = lastSectorOfCluster(cl_addr);
-          break;
-        }
-        if ( (cl - cl_addr) != 1 ) { 
-          chain.last = lastSectorOfCluster(cl_addr);
-          _currentEntry.sectors.push_back(chain);
-          chain.first = firstSectorOfCluster(cl);
-        }
-        cl_addr = cl;
-      }
-      _currentEntry.sectors.push_back(chain);
-
-    //  DEB("First:");
-    //  DEBUG(chain.first);
-    //  DEB("Last:");
-     // DEBUG(chain.last);            
-      memset(&fname, 0, 513);
-      _dirent_num++;
-      return &_currentEntry;
-    } else {
-      _dirent_num++;
+    if (d->attr == FAT32_LONG_FILE_NAME || d->attr & (FAT32_VOLUME_LABEL | FAT32_DIR)) continue;
+    if (memcmp(d->filename, sfn, 11) == 0) {
+      found = true;
+      recSector = pos.sector;
+      recIndex = pos.index - 1;
+      cl = fat32_cluster_id(d);
+      break;
     }
   }
+  if (recIndex < 0) {
+    DEBUG("SDMMC: no free directory records"); // we don't extend directories
+    return &_currentEntry;
+  }
+  if (found && cl >= 2) { // keep the old chain if it's long enough
+    uint32_t haveClusters = 1;
+    uint32_t next = cl;
+    while (haveClusters < needClusters) {
+      next = getNextCluster(next) & 0x0FFFFFFF;
+      if (fat_entry_type(next) != USED_CLUSTER) break;
+      haveClusters++;
+    }
+    if (haveClusters < needClusters) {
+      freeChain(cl);
+      cl = 0;
+    }
+  }
+  if (cl < 2) {
+    cl = allocClusters(needClusters);
+    if (cl == 0) return &_currentEntry;
+  }
+  d = dirRecord(recSector, recIndex);
+  if (!found) {
+    memset(d, 0, DIR_ENTRY_SIZE);
+    memcpy(d->filename, sfn, 11);
+    d->attr = FAT32_ARCHIVE;
+    fname_t upper = fname;
+    upper.toUpperCase();
+    if (upper != fname) d->reserved0 = 0x18; // NT flags: lower case name and extension
+    d->create_date = d->access_date = d->mod_date = ((2024 - 1980) << 9) | (1 << 5) | 1; // no RTC here
+  }
+  d->hi_start = cl >> 16;
+  d->lo_start = cl & 0xFFFF;
+  d->file_nbytes = size;
+  dropDirIndex(_startCluster);
+  ret = write_block(&dir_cache[(recSector - _firstCachedDirSector) * BYTES_PER_SECTOR], recSector, 1);
+  _sectorInBuf = 0; // sector_buf could hold the old copy of this dir sector
+  if (ret != ESP_OK) return &_currentEntry;
+  _currentEntry.name = fname;
+  _currentEntry.size = size;
+  _currentEntry.is_dir = 0;
+  _currentEntry.is_end = 0;
+  _currentEntry.dir_sector = recSector;
+  _currentEntry.dir_index = recIndex;
+  buildChain(cl, _currentEntry.sectors);
+  DEBF("SDMMC: file <%s> placed at cluster %d, %d bytes\r\n", fname.c_str(), cl, size);
   return &_currentEntry;
 }
 
@@ -585,6 +987,17 @@ const char* SDMMC_FAT32::to_8dot3(const char p[11]) {
     return s;
 }
 
+// "name.ext" to space padded 11 chars "NAME    EXT", no LFN for us
+void SDMMC_FAT32::to_sfn(const char* name, char* sfn) {
+  const char* dot = strrchr(name, '.');
+  int len = dot ? (dot - name) : strlen(name);
+  memset(sfn, ' ', 11);
+  for (int i = 0; i < len && i < 8; i++) sfn[i] = toupper(name[i]);
+  if (dot) {
+    for (int i = 0; i < 3 && dot[i + 1]; i++) sfn[8 + i] = toupper(dot[i + 1]);
+  }
+}
+
 void SDMMC_FAT32::dirent_name(sfn_dir_t *d,  char *fname) {
     strcpy(fname, to_8dot3(d->filename));
 }
@@ -633,7 +1046,7 @@ void SDMMC_FAT32::dirent_print_helper(sfn_dir_t *d) {
     }
     DEBF("\tfilename      = raw=<%s> 8.3=<%s>\n", add_nul(d->filename),to_8dot3(d->filename));
     DEB("\tbyte version  = {");
-    for(int i = 0; i < sizeof d->filename; i++) {
+    for(size_t i = 0; i < sizeof d->filename; i++) {
         if(i==8) {
             DEB("\n");
             DEB("\t\t\t\t");
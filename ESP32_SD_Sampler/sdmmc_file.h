@@ -10,8 +10,11 @@ class SDMMC_FileReader {
     SDMMC_FileReader(SDMMC_FAT32* Card);
     ~SDMMC_FileReader(){};
     esp_err_t   open(fpath_t fname);
+    esp_err_t   open(const entry_t& entry);     // when the entry is already known, no directory search
     esp_err_t   close();
     void        read_line(str_max_t& retStr); // we assume that line length < FixedString max size (256 bytes)
+    uint32_t    read(void* dst, uint32_t len);  // binary read, returns the number of bytes read
+    void        seek(uint32_t pos)              { _filePos = min(pos, _entry.size); }
     bool        available();
     void        rewind();
     entry_t     next_entry();
@@ -28,3 +31,25 @@ class SDMMC_FileReader {
     uint32_t        _bufCount;
     uint32_t        _dirPos;
 };
+
+
+// sequential writer for files of a known size, see SDMMC_FAT32::createEntry()
+#define WRITE_BUF_SECTORS 8
+
+class SDMMC_FileWriter {
+  public:  
+    SDMMC_FileWriter(SDMMC_FAT32* Card);
+    ~SDMMC_FileWriter();
+    esp_err_t   open(fname_t fname, uint32_t size);                   // creates or reuses a contiguous file in the current dir
+    esp_err_t   write(const void* src, uint32_t len);
+    esp_err_t   rewrite(uint32_t pos, const void* src, uint32_t len); // in-place update of the data written already, e.g. a header
+    esp_err_t   close();
+    
+  private:
+    esp_err_t       flush();
+    SDMMC_FAT32*    _Card;
+    uint8_t*        _buf = nullptr;
+    uint32_t        _bufPos;
+    uint32_t        _filePos;   // bytes flushed to the card
+    entry_t         _entry;
+};
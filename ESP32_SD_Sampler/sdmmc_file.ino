@@ -17,6 +17,16 @@ esp_err_t SDMMC_FileReader::open(fpath_t fname) {
   return 0 ; // ESP_OK
 }
 
+esp_err_t SDMMC_FileReader::open(const entry_t& entry) {
+  _filePos = 0;
+  _bufCount = 0;
+  _bufPos = 0;
+  _sectorRead = 0;
+  _entry = entry;
+  if (_entry.is_end || _entry.sectors.empty()) return 0x105; // NOT_FOUND
+  return 0 ; // ESP_OK
+}
+
 esp_err_t SDMMC_FileReader::close() {
   _entry.is_end = 1;
   return 0 ; // ESP_OK;
@@ -32,7 +42,7 @@ void SDMMC_FileReader::read_line(str_max_t& str) {
   str = "";
   char ch;
   int str_pos = 0;
-  uint32_t sec;
+  uint32_t sec, runLeft;
   if (_filePos==0) {
     sec = _entry.sectors[0].first;
     char* tmp = reinterpret_cast<char*>(_Card->readSector(sec));
@@ -44,7 +54,7 @@ void SDMMC_FileReader::read_line(str_max_t& str) {
     if (_bufPos >= BYTES_PER_SECTOR) {
     //  DEBUG("Next sector");
       _bufPos = 0;
-      sec = _Card->getNextSector(_sectorRead);
+      sec = chainSector(_entry.sectors, _filePos / BYTES_PER_SECTOR, runLeft); // exFAT NoFatChain files have no FAT entries to follow
       char* tmp = reinterpret_cast<char*>(_Card->readSector(sec));
       memcpy(_sectorBuf, tmp, BYTES_PER_SECTOR);
       _sectorRead = sec;
@@ -80,3 +90,129 @@ void SDMMC_FileReader::read_line(str_max_t& str) {
   str.trim();
  // DEBF("position: buf=%d file=%d str=%d \r\n", _bufPos, _filePos, str_pos);
 }
+
+
+uint32_t SDMMC_FileReader::read(void* dst, uint32_t len) {
+  uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+  uint32_t done = 0;
+  uint32_t runLeft, sec, n;
+  if (_entry.is_end) return 0;
+  len = min(len, _entry.size - _filePos);
+  while (done < len) {
+    sec = chainSector(_entry.sectors, _filePos / BYTES_PER_SECTOR, runLeft);
+    if (runLeft == 0) break; // size and chains disagree
+    if (_filePos % BYTES_PER_SECTOR == 0 && len - done >= BYTES_PER_SECTOR) { // whole sectors go directly
+      n = min((len - done) / BYTES_PER_SECTOR, runLeft);
+      if (_Card->read_block(out + done, sec, n) != ESP_OK) break;
+      n *= BYTES_PER_SECTOR;
+    } else {
+      if (sec != _sectorRead) {
+        memcpy(_sectorBuf, _Card->readSector(sec), BYTES_PER_SECTOR);
+        _sectorRead = sec;
+      }
+      n = min(BYTES_PER_SECTOR - _filePos % BYTES_PER_SECTOR, len - done);
+      memcpy(out + done, &_sectorBuf[_filePos % BYTES_PER_SECTOR], n);
+    }
+    done += n;
+    _filePos += n;
+  }
+  return done;
+}
+
+
+SDMMC_FileWriter::SDMMC_FileWriter( SDMMC_FAT32* Card ) {
+  _Card = Card;
+}
+
+SDMMC_FileWriter::~SDMMC_FileWriter() {
+  if (_buf != nullptr) close();
+}
+
+esp_err_t SDMMC_FileWriter::open(fname_t fname, uint32_t size) {
+  _bufPos = 0;
+  _filePos = 0;
+  _entry = *(_Card->createEntry(fname, size));
+  if (_entry.is_end) return 0x105; // NOT_FOUND
+  if (_buf == nullptr) {
+    _buf = (uint8_t*)heap_caps_malloc(WRITE_BUF_SECTORS * BYTES_PER_SECTOR, MALLOC_CAP_INTERNAL);
+    if (_buf == nullptr) {
+      _entry.is_end = 1;
+      return 0x101; // NO_MEM
+    }
+  }
+  return 0 ; // ESP_OK
+}
+
+esp_err_t SDMMC_FileWriter::write(const void* src, uint32_t len) {
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+  esp_err_t ret = 0;
+  uint32_t n;
+  if (_entry.is_end) return 0x103; // INVALID_STATE
+  if (_filePos + _bufPos + len > _entry.size) return 0x104; // INVALID_SIZE
+  while (len > 0) {
+    n = min(len, WRITE_BUF_SECTORS * BYTES_PER_SECTOR - _bufPos);
+    memcpy(&_buf[_bufPos], in, n);
+    _bufPos += n;
+    in += n;
+    len -= n;
+    if (_bufPos == WRITE_BUF_SECTORS * BYTES_PER_SECTOR) {
+      ret = flush();
+      if (ret != 0) return ret;
+    }
+  }
+  return ret;
+}
+
+// writes the buffer out, a partial last sector gets zero padding, so it's only legal at the end of the file
+esp_err_t SDMMC_FileWriter::flush() {
+  esp_err_t ret = 0;
+  uint32_t sectors = (_bufPos + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+  uint32_t fileSector = _filePos / BYTES_PER_SECTOR;
+  uint32_t done = 0;
+  uint32_t runLeft, sec, n;
+  if (_bufPos == 0) return 0;
+  memset(&_buf[_bufPos], 0, sectors * BYTES_PER_SECTOR - _bufPos);
+  while (done < sectors) {
+    sec = chainSector(_entry.sectors, fileSector + done, runLeft);
+    if (runLeft == 0) return 0x104; // INVALID_SIZE
+    n = min(sectors - done, runLeft);
+    ret = _Card->write_block(&_buf[done * BYTES_PER_SECTOR], sec, n);
+    if (ret != 0) return ret;
+    done += n;
+  }
+  _filePos += _bufPos;
+  _bufPos = 0;
+  return ret;
+}
+
+esp_err_t SDMMC_FileWriter::rewrite(uint32_t pos, const void* src, uint32_t len) {
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+  esp_err_t ret = flush();
+  uint32_t runLeft, sec, n;
+  if (ret != 0) return ret;
+  if (pos + len > _filePos) return 0x104; // INVALID_SIZE
+  while (len > 0) {
+    sec = chainSector(_entry.sectors, pos / BYTES_PER_SECTOR, runLeft);
+    n = min(len, BYTES_PER_SECTOR - pos % BYTES_PER_SECTOR);
+    ret = _Card->read_block(_buf, sec, 1);
+    if (ret != 0) return ret;
+    memcpy(&_buf[pos % BYTES_PER_SECTOR], in, n);
+    ret = _Card->write_block(_buf, sec, 1);
+    if (ret != 0) return ret;
+    pos += n;
+    in += n;
+    len -= n;
+  }
+  return ret;
+}
+
+esp_err_t SDMMC_FileWriter::close() {
+  esp_err_t ret = 0;
+  if (!_entry.is_end) ret = flush();
+  _entry.is_end = 1;
+  if (_buf != nullptr) {
+    heap_caps_free(_buf);
+    _buf = nullptr;
+  }
+  return ret;
+}
@@ -1,7 +1,8 @@
 #pragma once
 
-#include "driver/sdmmc_host.h"
+#include "esp_err.h"
 #include <vector>
+#include <ctype.h>
 #include <FixedString.h>
 
 #define MAX_NAME_LEN (64)   // must be dividible by 4
@@ -9,7 +10,9 @@
 #define MAX_STR_LEN (256)   // max string size
 #define BYTES_PER_SECTOR (512)
 #define FAT_CACHE_SECTORS (8)
+#define FAT_BULK_SECTORS (64)  // FAT window of prepareChains(), allocated only for the scan
 #define DIR_CACHE_SECTORS (8)
+#define DIR_INDEX_CACHE (4)    // directory indexes kept at a time (root, current and the ones on the way)
 #define DIR_ENTRY_SIZE (32)
 #define NDIR_PER_SEC (BYTES_PER_SECTOR/DIR_ENTRY_SIZE) 
 
@@ -31,6 +34,19 @@ enum {
   FAT32_RESERVED        = 0x80,
 } eAttr_t;
 
+// exFAT directory entry types (in-use bit set)
+enum {
+  EXFAT_END             = 0x00,
+  EXFAT_BITMAP          = 0x81,
+  EXFAT_UPCASE          = 0x82,
+  EXFAT_LABEL           = 0x83,
+  EXFAT_FILE            = 0x85,
+  EXFAT_STREAM          = 0xC0,
+  EXFAT_NAME            = 0xC1,
+};
+
+#define EXFAT_NO_FAT_CHAIN (0x02)   // stream extension flag: the file is contiguous and the FAT isn't maintained for it
+
 enum {
   FREE_CLUSTER          = 0,
   RESERVED_CLUSTER      = 0x01,
@@ -87,19 +103,128 @@ typedef struct __attribute__ ((packed)) {
   uint8_t   name12_13[4];   // 28-31   File name characters 12-13 (Unicode) 
 } lfn_dir_t;
 
+typedef struct __attribute__ ((packed)) {
+  uint8_t   type;           // 0      EXFAT_FILE
+  uint8_t   secondaryCount; // 1      stream extension + name entries
+  uint16_t  setChecksum;    // 2-3
+  uint16_t  attr;           // 4-5    same bits as FAT32 attributes
+  uint16_t  reserved1;      // 6-7
+  uint32_t  createTime;     // 8-11
+  uint32_t  modTime;        // 12-15  timestamp, date in the upper 16 bits like FAT32
+  uint32_t  accessTime;     // 16-19
+  uint8_t   create10ms;     // 20
+  uint8_t   mod10ms;        // 21
+  uint8_t   createUtc;      // 22
+  uint8_t   modUtc;         // 23
+  uint8_t   accessUtc;      // 24
+  uint8_t   reserved2[7];   // 25-31
+} exfat_file_t;
+
+typedef struct __attribute__ ((packed)) {
+  uint8_t   type;           // 0      EXFAT_STREAM
+  uint8_t   flags;          // 1      bit 0: allocation possible, bit 1: EXFAT_NO_FAT_CHAIN
+  uint8_t   reserved1;      // 2
+  uint8_t   nameLength;     // 3      UTF-16 characters in the following name entries
+  uint16_t  nameHash;       // 4-5
+  uint16_t  reserved2;      // 6-7
+  uint64_t  validLength;    // 8-15
+  uint32_t  reserved3;      // 16-19
+  uint32_t  firstCluster;   // 20-23
+  uint64_t  dataLength;     // 24-31
+} exfat_stream_t;
+
+typedef struct __attribute__ ((packed)) {
+  uint8_t   type;           // 0      EXFAT_NAME
+  uint8_t   flags;          // 1
+  uint16_t  name[15];       // 2-31   UTF-16 characters
+} exfat_name_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t   jumpBoot[3];
+  uint8_t   fsName[8];          // "EXFAT   "
+  uint8_t   mustBeZero[53];     // where FAT32 keeps its BPB
+  uint64_t  partitionOffset;    // [64, 71]
+  uint64_t  volumeLength;       // [72, 79]
+  uint32_t  fatOffset;          // [80, 83]  sectors from the volume start
+  uint32_t  fatLength;          // [84, 87]
+  uint32_t  clusterHeapOffset;  // [88, 91]
+  uint32_t  clusterCount;       // [92, 95]
+  uint32_t  rootCluster;        // [96, 99]
+  uint32_t  volumeSerial;
+  uint16_t  fsRevision;
+  uint16_t  volumeFlags;
+  uint8_t   bytesPerSectorShift;    // [108]
+  uint8_t   sectorsPerClusterShift; // [109] up to 32 MB clusters
+  uint8_t   numberOfFats;           // [110]
+  uint8_t   driveSelect;
+  uint8_t   percentInUse;
+  uint8_t   reserved[7];
+  uint8_t   bootCode[390];
+  uint16_t  bootSignature;
+} exfat_bpb_t;
+
 typedef struct {
   uint32_t first;
   uint32_t last;
 } chain_t;
 
+typedef struct __attribute__((packed)) {
+  uint32_t  leadSig;        // 0x41615252
+  uint8_t   reserved1[480];
+  uint32_t  structSig;      // 0x61417272
+  uint32_t  freeCount;      // last known free cluster count, 0xFFFFFFFF = unknown
+  uint32_t  nextFree;       // hint: where to start looking for free clusters
+  uint8_t   reserved2[12];
+  uint32_t  trailSig;       // 0xAA550000
+} fsinfo_t;
+
 typedef struct {
   fname_t   name;
   uint32_t  size;
   int       is_dir;
   int       is_end;
+  uint32_t  dir_sector;     // sector holding the SFN record of this entry
+  int       dir_index;      // record number within that sector
   std::vector<chain_t> sectors;
 } entry_t;
 
+typedef struct {
+  uint32_t  cluster;
+  uint32_t  sector;
+  int       index;
+  uint32_t  left;           // clusters left in a contiguous (exFAT NoFatChain) dir, 0 = follow the FAT
+} dirpos_t;
+
+typedef struct {
+  uint32_t  cluster;        // first cluster of the file
+  uint32_t  first;          // index of its first chain in the prepared pool
+  uint32_t  count;          // number of chains
+} dirchain_t;
+
+typedef struct {
+  uint32_t  hash;           // foldHash() of the name
+  uint32_t  name;           // offset of the name in the names pool of the index
+  uint32_t  cluster;        // first cluster, ".." pointing to the root gets the root cluster instead of 0
+  uint32_t  size;           // exFAT dirs have their size too
+  uint32_t  mtime;          // modification date << 16 | time
+  uint32_t  dir_sector;     // sector holding the SFN (exFAT: file) record
+  uint16_t  dir_index;      // record number within that sector
+  uint8_t   attr;
+  uint8_t   flags;          // DIRREC_CONTIGUOUS
+} dirrec_t;
+
+#define DIRREC_CONTIGUOUS (0x01)  // exFAT NoFatChain: one run from the first cluster, no FAT walk
+
+#define DIR_SLOT_EMPTY (0xFFFF)
+
+typedef struct {
+  uint32_t  cluster = 0;    // first cluster of the indexed directory, 0 = unused
+  uint32_t  used = 0;       // LRU tick
+  std::vector<dirrec_t> recs;   // in the directory order
+  std::vector<uint16_t> slots;  // open addressing table of recs[] indices, power of two, at most half full
+  std::vector<char>     names;  // NUL-terminated names as the directory lists them
+} dirindex_t;
+
 typedef struct {
   entry_t entry;
   fpath_t currentDir;
@@ -107,9 +232,44 @@ typedef struct {
   uint32_t curCluster ;
   uint32_t startSector;
   uint32_t startCluster;
+  uint32_t startContig;
   uint32_t firstCachedFatSector;
   uint32_t firstCachedDirSector;
   int      direntNum ; 
 } point_t;
 
 typedef std::vector<entry_t> dirList_t;
+
+// FNV-1a, used for directory stamps and index checksums
+static inline uint32_t fnv1a(const void* data, size_t len, uint32_t hash = 2166136261UL) {
+  const uint8_t* p = (const uint8_t*)data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+// FNV-1a of the upper-cased name, the key of the directory index
+static inline uint32_t foldHash(const char* s, uint32_t hash = 2166136261UL) {
+  for (; *s; s++) {
+    hash ^= (uint8_t)toupper(*s);
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+// maps a sector number relative to the file start onto the card, runLeft gets the number of 
+// sectors that can be accessed linearly from there (0 if we are beyond the chains)
+static inline uint32_t chainSector(const std::vector<chain_t>& chains, uint32_t fileSector, uint32_t& runLeft) {
+  for (auto& ch: chains) {
+    uint32_t len = ch.last - ch.first + 1;
+    if (fileSector < len) {
+      runLeft = len - fileSector;
+      return ch.first + fileSector;
+    }
+    fileSector -= len;
+  }
+  runLeft = 0;
+  return 0;
+}
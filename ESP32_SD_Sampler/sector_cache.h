@@ -0,0 +1,62 @@
+#pragma once
+
+// Second level cache of sample sectors in PSRAM, shared by all the voices and keyed by the absolute card sector,
+// so drum hits and repeated phrases stop reading the same sectors from the card again and again.
+// Segmented LRU: new sectors enter the probation segment, a second hit moves them to the protected one.
+// A long sustained sample passes through probation only, so it can't flush what's really been reused.
+// A read is served only if all its sectors are here, otherwise it goes to the card as a whole and is inserted.
+// Everything is done in the Control Task (Core1).
+
+#define SC_NIL        0xFFFF    // no slot
+
+enum eScList_t { SC_FREE, SC_PROBATION, SC_PROTECTED, SC_LISTS };
+
+typedef struct {
+  uint32_t  sector;             // absolute card sector
+  uint16_t  prev;               // LRU list of its segment, head is the most recent
+  uint16_t  next;
+  uint16_t  chain;              // hash bucket chain
+  uint8_t   list;               // eScList_t
+} sc_slot_t;
+
+class SectorCache {
+  public:
+    SectorCache() {};
+    bool              init(uint32_t budgetBytes, uint32_t protectedPercent);
+    void              clear();
+    bool              read(uint8_t* dst, uint32_t sector, uint32_t count);          // all or nothing, counts hits and misses
+    void              insert(const uint8_t* src, uint32_t sector, uint32_t count);  // after a card read
+    inline uint32_t   getCapacity()           {return _capacity;}
+    inline uint32_t   getSectorsUsed()        {return _count[SC_PROBATION] + _count[SC_PROTECTED];}
+    inline uint32_t   getSectorsProtected()   {return _count[SC_PROTECTED];}
+    inline uint32_t   getHits()               {return _hits;}
+    inline uint32_t   getMisses()             {return _misses;}
+    inline uint32_t   getEvictions()          {return _evictions;}
+    inline uint32_t   getPromotions()         {return _promotions;}
+    inline uint64_t   getBytesSaved()         {return _hitSectors * BYTES_PER_SECTOR;}
+    inline float      getHitRate()            {return (_hits + _misses) ? (float)_hits / (float)(_hits + _misses) : 0.0f;}
+    inline void       resetStats()            {_hits = 0; _misses = 0; _evictions = 0; _promotions = 0; _hitSectors = 0;}
+
+  private:
+    inline uint32_t   bucketOf(uint32_t sector) {return (sector ^ (sector >> 13)) & _mask;}
+    inline uint8_t*   data(uint16_t slot)     {return _data + (uint32_t)slot * BYTES_PER_SECTOR;}
+    uint16_t          find(uint32_t sector);
+    void              unlink(uint16_t slot);
+    void              pushFront(eScList_t list, uint16_t slot);
+    void              unhash(uint16_t slot);
+    uint16_t          take();                 // a free slot, or the least recent one of probation
+    uint8_t*          _data                   = nullptr;  // PSRAM
+    sc_slot_t*        _slots                  = nullptr;  // PSRAM as well, it's 12 bytes per sector
+    uint16_t*         _buckets                = nullptr;
+    uint32_t          _mask                   = 0;
+    uint32_t          _capacity               = 0;        // sectors
+    uint32_t          _protectedMax           = 0;        // sectors
+    uint16_t          _head[SC_LISTS]         ;
+    uint16_t          _tail[SC_LISTS]         ;
+    uint32_t          _count[SC_LISTS]        ;
+    uint32_t          _hits                   = 0;        // reads served
+    uint32_t          _misses                 = 0;
+    uint32_t          _evictions              = 0;        // sectors
+    uint32_t          _promotions             = 0;        // sectors
+    uint64_t          _hitSectors             = 0;
+};
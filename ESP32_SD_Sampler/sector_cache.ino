@@ -0,0 +1,130 @@
+#include "sector_cache.h"
+
+bool SectorCache::init(uint32_t budgetBytes, uint32_t protectedPercent) {
+  _capacity = min(budgetBytes / BYTES_PER_SECTOR, (uint32_t)SC_NIL - 1);
+  uint32_t buckets = 1;
+  while (buckets < _capacity) buckets <<= 1;
+  _mask = buckets - 1;
+  _data = (uint8_t*)heap_caps_malloc( _capacity * BYTES_PER_SECTOR, MALLOC_CAP_SPIRAM);
+  _slots = (sc_slot_t*)heap_caps_malloc( _capacity * sizeof(sc_slot_t), MALLOC_CAP_SPIRAM);
+  _buckets = (uint16_t*)heap_caps_malloc( buckets * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+  if (_capacity == 0 || _data == NULL || _slots == NULL || _buckets == NULL) {
+    DEBUG("SECTOR CACHE: no PSRAM, disabled");
+    _capacity = 0;
+    return false;
+  }
+  _protectedMax = _capacity * min(protectedPercent, (uint32_t)100) / 100;
+  clear();
+  DEBF("SECTOR CACHE: %d Bytes PSRAM allocated, %d%% protected\r\n", _capacity * BYTES_PER_SECTOR, protectedPercent);
+  return true;
+}
+
+
+void SectorCache::clear() {
+  for (int i = 0; i < SC_LISTS; i++) {
+    _head[i] = SC_NIL;
+    _tail[i] = SC_NIL;
+    _count[i] = 0;
+  }
+  if (_capacity == 0) return;
+  for (uint32_t i = 0; i <= _mask; i++) _buckets[i] = SC_NIL;
+  for (uint32_t i = 0; i < _capacity; i++) {
+    _slots[i].chain = SC_NIL;
+    _slots[i].list = SC_FREE;
+    pushFront(SC_FREE, i);
+  }
+}
+
+
+bool SectorCache::read(uint8_t* dst, uint32_t sector, uint32_t count) {
+  if (_capacity == 0) return false;
+  for (uint32_t i = 0; i < count; i++) {
+    if (find(sector + i) == SC_NIL) {
+      _misses++;
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint16_t s = find(sector + i);
+    memcpy(dst + i * BYTES_PER_SECTOR, data(s), BYTES_PER_SECTOR);
+    unlink(s);
+    if (_protectedMax == 0) { // plain LRU
+      pushFront(SC_PROBATION, s);
+      continue;
+    }
+    if (_slots[s].list == SC_PROBATION) {
+      _promotions++;
+      if (_count[SC_PROTECTED] >= _protectedMax) { // the least recent protected one gets another chance in probation
+        uint16_t d = _tail[SC_PROTECTED];
+        unlink(d);
+        pushFront(SC_PROBATION, d);
+      }
+    }
+    pushFront(SC_PROTECTED, s);
+  }
+  _hits++;
+  _hitSectors += count;
+  return true;
+}
+
+
+void SectorCache::insert(const uint8_t* src, uint32_t sector, uint32_t count) {
+  if (_capacity == 0) return;
+  for (uint32_t i = 0; i < count; i++) {
+    if (find(sector + i) != SC_NIL) continue; // it was there, but not the whole read
+    uint16_t s = take();
+    _slots[s].sector = sector + i;
+    uint32_t b = bucketOf(sector + i);
+    _slots[s].chain = _buckets[b];
+    _buckets[b] = s;
+    pushFront(SC_PROBATION, s);
+    memcpy(data(s), src + i * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+  }
+}
+
+
+uint16_t SectorCache::find(uint32_t sector) {
+  uint16_t s = _buckets[bucketOf(sector)];
+  while (s != SC_NIL && _slots[s].sector != sector) s = _slots[s].chain;
+  return s;
+}
+
+
+void SectorCache::unlink(uint16_t slot) {
+  sc_slot_t& e = _slots[slot];
+  if (e.prev != SC_NIL) _slots[e.prev].next = e.next; else _head[e.list] = e.next;
+  if (e.next != SC_NIL) _slots[e.next].prev = e.prev; else _tail[e.list] = e.prev;
+  _count[e.list]--;
+}
+
+
+void SectorCache::pushFront(eScList_t list, uint16_t slot) {
+  sc_slot_t& e = _slots[slot];
+  e.list = list;
+  e.prev = SC_NIL;
+  e.next = _head[list];
+  if (e.next != SC_NIL) _slots[e.next].prev = slot; else _tail[list] = slot;
+  _head[list] = slot;
+  _count[list]++;
+}
+
+
+void SectorCache::unhash(uint16_t slot) {
+  uint16_t* p = &_buckets[bucketOf(_slots[slot].sector)];
+  while (*p != slot) p = &_slots[*p].chain;
+  *p = _slots[slot].chain;
+  _slots[slot].chain = SC_NIL;
+}
+
+
+uint16_t SectorCache::take() {
+  uint16_t s = _tail[SC_FREE];
+  if (s == SC_NIL) {
+    s = _tail[SC_PROBATION];
+    if (s == SC_NIL) s = _tail[SC_PROTECTED]; // all protected, only if probation has no room at all
+    unhash(s);
+    _evictions++;
+  }
+  unlink(s);
+  return s;
+}
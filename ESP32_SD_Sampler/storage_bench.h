@@ -0,0 +1,59 @@
+#pragma once
+
+// Storage profiler, a grown up SDMMC_FAT32::testReadSpeed().
+// It sweeps read sizes over three access patterns:
+//   sequential  -- one stream, the best case of a single voice
+//   random      -- every read at a random place, the worst case (that's what testReadSpeed() did)
+//   streams     -- K sequential streams served round robin, the way fillBuffer() feeds K voices
+// Every request is timed, so besides MB/s we get latency histograms and tail percentiles.
+// The last table turns the numbers into voices: how many 16 bit stereo streams each read size sustains
+// by bandwidth, and by the time K-1 other reads may take while a voice waits for its turn.
+// It only uses read_block(), so the host build runs the same code on a disk image or a card reader.
+
+#include "sdmmc.h"
+
+#define BENCH_TOTAL_KB        4096        // data read per pattern and size
+#define BENCH_MAX_SECTORS     128         // the largest read of the sweep
+#define BENCH_SUB_BUCKETS     8           // latency histogram: linear below 8 us, then 8 buckets per octave (~9% wide)
+#define BENCH_OCTAVES         25          // up to ~67 seconds
+#define BENCH_BUCKETS         ((BENCH_OCTAVES + 1) * BENCH_SUB_BUCKETS)
+
+enum eBenchPattern_t { BP_SEQUENTIAL, BP_RANDOM, BP_STREAMS, BP_COUNT };
+
+typedef struct {
+  uint32_t  count;
+  uint32_t  min_us;
+  uint32_t  max_us;
+  uint64_t  sum_us;
+  uint32_t  buckets[BENCH_BUCKETS];
+} bench_hist_t;
+
+typedef struct {
+  eBenchPattern_t pattern;
+  uint32_t  sectors;        // per read
+  uint32_t  streams;
+  uint32_t  errors;
+  uint32_t  elapsed_us;
+  uint64_t  bytes;
+  bench_hist_t hist;
+} bench_result_t;
+
+class StorageBench {
+  public:
+    StorageBench(SDMMC_FAT32* Card) : _Card(Card) {};
+    void      run(uint32_t totalKB = BENCH_TOTAL_KB, uint32_t streams = MAX_POLYPHONY);  // the whole sweep with the summary
+    bool      measure(eBenchPattern_t pattern, uint32_t sectors, uint32_t streams, uint32_t totalKB, bench_result_t& res);
+    void      printResult(const bench_result_t& res);
+    void      printHistogram(const bench_hist_t& h);
+    uint32_t  percentile(const bench_hist_t& h, float p);         // upper bound of the bucket holding it, us
+    static float mbps(const bench_result_t& res)                  { return res.elapsed_us ? (float)res.bytes / (float)res.elapsed_us : 0.0f; }
+    static const char* patternName(eBenchPattern_t p);
+    inline void setSeed(uint32_t seed)                            { _seed = seed ? seed : 1; }
+
+  private:
+    static uint32_t bucketOf(uint32_t us);
+    static uint32_t bucketTop(uint32_t bucket);
+    inline uint32_t rnd()                                         { _seed ^= _seed << 13; _seed ^= _seed >> 17; _seed ^= _seed << 5; return _seed; }
+    SDMMC_FAT32*  _Card;
+    uint32_t      _seed     = 2463534242UL; // fixed, so that a card and its image get the very same requests
+};
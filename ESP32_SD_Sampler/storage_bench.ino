@@ -0,0 +1,126 @@
+#include "storage_bench.h"
+
+const char* StorageBench::patternName(eBenchPattern_t p) {
+  switch (p) {
+    case BP_SEQUENTIAL: return "sequential";
+    case BP_RANDOM:     return "random";
+    case BP_STREAMS:    return "streams";
+    default:            return "?";
+  }
+}
+
+uint32_t StorageBench::bucketOf(uint32_t us) {
+  if (us < BENCH_SUB_BUCKETS) return us;
+  uint32_t octave = 31 - __builtin_clz(us);                   // >= 3
+  uint32_t sub = (us >> (octave - 3)) & (BENCH_SUB_BUCKETS - 1);
+  return min((octave - 2) * BENCH_SUB_BUCKETS + sub, (uint32_t)BENCH_BUCKETS - 1);
+}
+
+uint32_t StorageBench::bucketTop(uint32_t bucket) {
+  if (bucket < BENCH_SUB_BUCKETS) return bucket;
+  uint32_t octave = bucket / BENCH_SUB_BUCKETS + 2;
+  uint32_t sub = bucket % BENCH_SUB_BUCKETS;
+  return ((BENCH_SUB_BUCKETS + sub + 1) << (octave - 3)) - 1;
+}
+
+uint32_t StorageBench::percentile(const bench_hist_t& h, float p) {
+  if (h.count == 0) return 0;
+  uint64_t rank = (uint64_t)ceilf(p * 0.01f * (float)h.count);
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < BENCH_BUCKETS; i++) {
+    seen += h.buckets[i];
+    if (seen >= rank) return min(bucketTop(i), h.max_us);
+  }
+  return h.max_us;
+}
+
+bool StorageBench::measure(eBenchPattern_t pattern, uint32_t sectors, uint32_t streams, uint32_t totalKB, bench_result_t& res) {
+  const uint32_t first = _Card->getFirstSector();
+  const uint32_t span = _Card->getSectorsTotal() - sectors;
+  uint32_t reads = max(totalKB * 1024 / BYTES_PER_SECTOR / sectors, (uint32_t)1);
+  std::vector<uint32_t> pos(max(streams, (uint32_t)1));
+  uint8_t* buf = (uint8_t*)heap_caps_malloc(sectors * BYTES_PER_SECTOR, MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA);
+  memset(&res, 0, sizeof(res));
+  res.pattern = pattern;
+  res.sectors = sectors;
+  res.streams = (pattern == BP_STREAMS) ? pos.size() : 1;
+  res.hist.min_us = UINT32_MAX;
+  if (buf == NULL) {
+    DEBF("BENCH: no RAM for a %d sector buffer\r\n", sectors);
+    return false;
+  }
+  for (auto& p: pos) p = rnd() % span;
+  uint32_t t0 = micros();
+  for (uint32_t i = 0; i < reads; i++) {
+    uint32_t& p = pos[(pattern == BP_STREAMS) ? i % pos.size() : 0];
+    if (pattern == BP_RANDOM) p = rnd() % span;
+    if (p >= span) p = rnd() % span;              // a stream ran into the end of the card, it restarts elsewhere
+    uint32_t t1 = micros();
+    if (_Card->read_block(buf, first + p, sectors) != ESP_OK) res.errors++;
+    uint32_t us = micros() - t1;
+    p += sectors;
+    res.hist.count++;
+    res.hist.sum_us += us;
+    res.hist.min_us = min(res.hist.min_us, us);
+    res.hist.max_us = max(res.hist.max_us, us);
+    res.hist.buckets[bucketOf(us)]++;
+  }
+  res.elapsed_us = micros() - t0;
+  res.bytes = (uint64_t)reads * sectors * BYTES_PER_SECTOR;
+  heap_caps_free(buf);
+  return true;
+}
+
+void StorageBench::printResult(const bench_result_t& r) {
+  const bench_hist_t& h = r.hist;
+  DEBF("%-10s %3d %6d %3d %8.2f %7d %7d %7d %7d %7d %7d %7d %4d\r\n", patternName(r.pattern), r.streams, r.sectors * BYTES_PER_SECTOR, r.sectors, mbps(r),
+    h.min_us, h.count ? (uint32_t)(h.sum_us / h.count) : 0, percentile(h, 50.0f), percentile(h, 90.0f), percentile(h, 99.0f), percentile(h, 99.9f), h.max_us, r.errors);
+}
+
+void StorageBench::printHistogram(const bench_hist_t& h) {
+  uint32_t peak = 1;
+  for (uint32_t i = 0; i < BENCH_BUCKETS; i++) peak = max(peak, h.buckets[i]);
+  for (uint32_t i = 0; i < BENCH_BUCKETS; i++) {
+    if (h.buckets[i] == 0) continue;
+    char bar[41];
+    uint32_t n = (h.buckets[i] * 40 + peak - 1) / peak;
+    memset(bar, '#', n);
+    bar[n] = 0;
+    DEBF("  <= %8d us %7d %s\r\n", bucketTop(i), h.buckets[i], bar);
+  }
+}
+
+void StorageBench::run(uint32_t totalKB, uint32_t streams) {
+  // a voice of 16 bit stereo at normal pitch consumes this many bytes per second
+  const float voiceRate = (float)SAMPLE_RATE * 4.0f;
+  const uint32_t sizes = 31 - __builtin_clz(BENCH_MAX_SECTORS) + 1;
+  std::vector<bench_result_t> res(sizes * BP_COUNT);
+  DEBF("BENCH: %d KB per run, %d streams, partition of %d sectors\r\n", totalKB, streams, _Card->getSectorsTotal());
+  DEBF("pattern    str  bytes sec     MB/s  min us  avg us  p50 us  p90 us  p99 us p999 us  max us errs\r\n");
+  for (int p = 0; p < BP_COUNT; p++) {
+    for (uint32_t k = 0; k < sizes; k++) {
+      bench_result_t& r = res[p * sizes + k];
+      if (!measure((eBenchPattern_t)p, 1UL << k, streams, totalKB, r)) continue;
+      printResult(r);
+    }
+  }
+  // the current READ_BUF_SECTORS under K streams, in detail
+  bench_result_t cur;
+  if (measure(BP_STREAMS, READ_BUF_SECTORS, streams, totalKB, cur)) {
+    DEBF("\r\nBENCH: %d streams of READ_BUF_SECTORS = %d:\r\n", streams, READ_BUF_SECTORS);
+    printResult(cur);
+    printHistogram(cur.hist);
+  }
+  // A voice reads ahead by one read (the ring holds two), so its next read must be done within the time
+  // one read plays. With K voices waiting in turn, K reads have to fit in there: K * p99 <= read play time.
+  DEBF("\r\nBENCH: 16 bit stereo voices sustained with %d streams, by bandwidth / by p99 latency:\r\n", streams);
+  for (uint32_t k = 0; k < sizes; k++) {
+    const bench_result_t& r = res[BP_STREAMS * sizes + k];
+    if (r.hist.count == 0) continue;
+    float playUs = (float)(r.sectors * BYTES_PER_SECTOR) / voiceRate * 1000000.0f;
+    uint32_t p99 = max(percentile(r.hist, 99.0f), (uint32_t)1);
+    uint32_t byRate = (uint32_t)(mbps(r) * 1000000.0f / voiceRate);
+    uint32_t byTail = (uint32_t)(playUs / (float)p99);
+    DEBF("  %3d sectors: %3d / %3d -> %3d voices\r\n", r.sectors, byRate, byTail, min(byRate, byTail));
+  }
+}
@@ -1,16 +1,21 @@
 #pragma once
-#define   BUF_EXTRA_BYTES   32    // for buffer overlapping
-#define   BUF_NUMBER        2     // tic-tac don't change, for readability only
 #define   CHANNELS          2     // 1 = mono, 2 = stereo
 #define   BYTES_PER_CHANNEL 2
+#define   RING_GUARD_BYTES  128   // mirror of the ring start after its end, so that the interpolation taps never wrap
 
-const int   BUF_SIZE_BYTES      = (READ_BUF_SECTORS * BYTES_PER_SECTOR);
-const float DIV_BUF_SIZE_BYTES  = (1.0f / BUF_SIZE_BYTES);
 const int   INTS_PER_SECTOR     = (BYTES_PER_SECTOR / 2);
-const int   start_byte[5]       = { 0, 0, 0, 1, 2 }; // offset values for [-], 8, 16, 24, 32 pcm bits per channel 
+const float US_PER_SAMPLE       = (1000000.0f / (float)SAMPLE_RATE);
+const uint32_t DEADLINE_NONE    = 0xFFFFFFFF;        // Voice::deadline() when no read is needed
+const float FRAC_TO_FLOAT       = (1.0f / 4294967296.0f);  // 0.32 fixed point position to float
+const float FRAC24_TO_FLOAT     = (1.0f / 16777216.0f);    // its top 24 bits, exact in a float
+const float LEVEL_FALL          = 0.999524f;         // per sample, the peak follower of Voice::getAmplitude() falls 20 dB in ~110 ms
+const float LEVEL_FLOOR         = 0.0001f;           // -80 dBFS, the voices below it are equally inaudible
 
+#include <atomic>
+#include "fixed_point.h"
 #include "adsr.h"
 #include "sdmmc.h"
+#include "ring_arena.h"
 
 typedef struct __attribute__((packed)){
   char riff[4] = {'R', 'I', 'F', 'F'};
@@ -47,36 +52,83 @@ typedef struct {
   int32_t   loop_first_smp= -1;
   int32_t   loop_last_smp = -1;
   bool      native_freq   = false;
+  int       head          = -1;   // HeadCache entry id
+  int       loop          = -1;   // LoopCache entry id
   // FixedString<4>    name; // only used in SamplerEngine::printMapping()
   std::vector<chain_t>   sectors;
 } sample_t;
 
+#include "head_cache.h"
+#include "sector_cache.h"
+#include "loop_cache.h"
+
+// how SamplerEngine picks the voice to steal, see Voice::getKillScore()
+enum eVoiceAlloc_t  { VA_OLDEST, VA_MOST_QUIET, VA_PERCEPTUAL, VA_NUMBER };
+const char* const voiceAllocNames[VA_NUMBER] = { "oldest", "most quiet", "perceptual" };
+
+// Hot playback state of all the voices, structure of arrays. Voice::renderBlock() loads the fields of one voice
+// into registers, runs the whole block and stores them back; the cold fields stay in Voice.
+// Set up by Core1 in Voice::start(), owned by Core0 while the voice is playing.
+typedef struct {
+  const uint8_t*  ring[MAX_POLYPHONY];
+  uint32_t        ringBytes[MAX_POLYPHONY];
+  uint32_t        readOff[MAX_POLYPHONY];     // ring offset of the current frame
+  uint32_t        posFrac[MAX_POLYPHONY];     // fractional part of the play position, 0.32 fixed point
+  uint32_t        incInt[MAX_POLYPHONY];      // frames per output sample, integer part
+  uint32_t        incFrac[MAX_POLYPHONY];     //   and 0.32 fraction: the position advances with an add and a carry
+  float           amp[MAX_POLYPHONY];         // gain before the envelope
+  uint32_t        frameBytes[MAX_POLYPHONY];  // all channels
+  const coef_t*   sinc[MAX_POLYPHONY];        // sinc table for the pitch, INTERP_SINC only
+  mix_t           peak[MAX_POLYPHONY];        // of the samples added in the current block
+} voice_bank_t;
+
+#include "voice_kernels.h"
+
+// A voice is prepared by the Control Task (Core1) while it's free, then SamplerEngine hands it over to the audio task
+// (Core0) with CMD_START. From then on the playback state belongs to Core0 and changes only by the commands it applies
+// between the renderBlock() runs, at their frames of the block, until it publishes _doneGen, and the voice is free again. The only data shared on the fly is
+// the ring stream: _fileSector (producer, Core1) and _playByte (consumer, Core0).
 class Voice {
   public:
     Voice(){};
-    void              init(SDMMC_FAT32* Card, bool* sustain, bool* normalized);
-    bool              allocateBuffers();
-    void              getSample(float& L, float& R);
-    inline float      interpolate(float& s1, float& s2, float i);
-    void              start(const sample_t nextSmp, uint8_t nextNote, uint8_t nextVelo);
-    void              end(Adsr::eEnd_t);
-    void              fadeOut();
-    void              feed();
-    inline uint32_t   hunger();
-    inline void       setStarted(bool st)   {_started = st;}
-    inline void       setPressed(bool pr)   {_pressed = pr;}
+    void              init(SDMMC_FAT32* Card, RingArena* Arena, HeadCache* Heads, SectorCache* Sectors, LoopCache* Loops, voice_bank_t* Bank, Voice* Siblings, bool* sustain, bool* normalized);
+    // Core1
+    bool              start(const sample_t& nextSmp, uint8_t nextNote, uint8_t nextVelo); // false if it can't, the voice stays free
+    bool              feed();           // returns true if it had to read the card
+    void              releaseRing();    // gives the ring back to the arena, if the voice is over
+    inline uint32_t   deadline();       // microseconds left till the voice runs out of data, 0 for the first fill
     inline void       setPitch(float speedModifier);
-    inline int        getChannels()   {return _sampleFile.channels;}
-    inline bool       isActive()      {return _active;}
+    inline void       setDying()      {_dying = true;}  // it's been told to end fast
+    inline bool       isActive()      {return _doneGen.load(std::memory_order_acquire) != _startGen;}
     inline bool       isDying()       {return _dying;}
+    inline bool       isStarted()     {return _started.load(std::memory_order_acquire);}
+    inline float      getKillScore(eVoiceAlloc_t method); // the higher, the better victim
+    inline float      getAmplitude()  {return _amplitude.load(std::memory_order_relaxed);}  // recent output peak, 1.0 = full scale
+    inline bool       isLooping()     {return _looping;}
+    inline float      getCardRate();    // bytes per us it takes from the card, as much as the siblings and the sector cache don't give
+    inline bool       isHeld()        {return _segment.load(std::memory_order_relaxed) < Adsr::ADSR_SEG_RELEASE;}  // not released yet, as of the last block
+    inline int        getChannels()   {return _sampleFile.channels;}
     inline uint8_t    getMidiNote()   {return _midiNote;}
     inline uint8_t    getMidiVelo()   {return _midiVelo;}
-    inline uint32_t   getBufPlayed()  {return _bufPlayed;}
-    inline float      getAmplitude()  {return _amplitude;}
-    inline float      getKillScore()        ;
-    inline int        getPlayPos()    {return _bufPosSmp[_idToPlay];}
-    inline uint32_t   getBufSize()    {return _bufSizeSmp;}
-    inline void       toggleBuf();
+    inline uint32_t   getUnderruns()  {return _underruns.load(std::memory_order_relaxed);}
+    inline uint32_t   getCardSectors()    {return _cardSectors;}
+    inline uint32_t   getSharedSectors()  {return _sharedSectors;}
+    inline uint32_t   getHeadSectors()    {return _headSectors;}
+    inline uint32_t   getCachedSectors()  {return _cachedSectors;}
+    // Core0
+    inline void       play()          {_active = true;}
+    void              renderBlock(mix_t* L, mix_t* R, int n);   // adds n <= MAX_BLOCK_LEN samples of the voice, the block may take several runs
+    void              endBlock(float fall);                     // publishes the level of the whole block, fall = LEVEL_FALL over the block
+    void              getSample(mix_t& L, mix_t& R);            // one sample with all the checks, for the end of a block
+    void              end(Adsr::eEnd_t);
+    inline void       release(Adsr::eEnd_t end_type)  {_pressed = false; end(end_type);}
+    inline void       bend(float speedModifier)       {setIncrement(_sampleFile.speed * speedModifier);}
+    inline bool       isPlaying()     {return _active;}
+    inline float      getSpeed()      {return (float)_Bank->incInt[my_id] + (float)_Bank->incFrac[my_id] * FRAC_TO_FLOAT;}
+    inline bool       needsInterpolation();             // false if the frames fall exactly on the output samples
+    inline void       setInterpolation(eInterp_t q)   {if (q != _interp) {_interp = q; selectKernel();}}
+    inline eInterp_t  getInterpolation()  {return _interp;}
+    // Core1 on a free voice, Core0 on a playing one
     inline void       setAttackTime(float timeInS)    {AmpEnv.setAttackTime(timeInS, 0.0f);}
     inline void       setDecayTime(float timeInS)     {AmpEnv.setDecayTime(timeInS);}
     inline void       setReleaseTime(float timeInS)   {AmpEnv.setReleaseTime(timeInS);}
@@ -84,59 +136,73 @@ class Voice {
     int my_id =0;
     
   private:
-  // some members are volatile because they are used in different tasks on both cores, while real-time conditions require immediate changes without caching 
+    bool              fromSibling(uint32_t fileSector, uint32_t count, uint8_t* dst); // copies sectors that another voice has in its ring
+    int               renderStream(mix_t* L, mix_t* R, int n);  // from the ring, returns the samples done before it went to the loop
+    void              renderLoop(mix_t* L, mix_t* R, int n);    // from the loop body
+    inline bool       enterLoop(uint32_t playByte);             // Core0: switches to the loop body, if it's ready
+    inline void       envelope(env_t* env, int n);              // Core0: the next n voice gains, the envelope times the amp
+    inline void       finish();         // Core0: the voice is over, Core1 may take it
+    inline void       setIncrement(float speed);
+    inline void       selectKernel();   // for the format, the tier and the speed
+    inline void       publishLevel(float fall);   // Core0, every block: the output level and the envelope stage for getKillScore()
     SDMMC_FAT32*        _Card                   ;
-    bool*               _sustain                ; // every voice needs to know if sustain is ON. 
+    RingArena*          _Arena                  ; // all the rings live there
+    HeadCache*          _Heads                  ; // beginnings of the samples in PSRAM
+    SectorCache*        _Sectors                ; // recently read sectors in PSRAM
+    LoopCache*          _Loops                  ; // loop bodies in PSRAM
+    voice_bank_t*       _Bank                   ; // hot playback state, [my_id]
+    voice_kernel_t      _kernel                 = nullptr; // for the sample format, speed and _interp, Core0 while playing
+    voice_kernel_t      _safeKernel             = nullptr; // linear, it reads no frames before the current one and just one after it
+    eInterp_t           _interp                 = INTERP_LINEAR;  // tier, set by the governor
+    Voice*              _Siblings               ; // all the voices, to share the data of the same sample
+    bool*               _sustain                ; // Core0 copy of the sustain pedal, every voice needs to know if it's ON
     bool*               _normalized             ;
-    float               _amp                    = 1.0f;    
-    bool                _active                 = false;
-    volatile bool       _dying                  = false;
-    volatile bool       _started                = false;
-    uint8_t*            _buffer0;                         // pointer to the 1st allocated SD-reader buffer
-    uint8_t*            _buffer1;                         // pointer to the 2nd allocated SD-reader buffer
-    uint8_t*            _playBuffer;                      // pointer to the buffer which is being played (one of the two toggling buffers)
-    uint8_t*            _fillBuffer;                      // pointer to the buffer which awaits filling (one of the two toggling buffers)
-    uint32_t            _bufSizeBytes           = BUF_SIZE_BYTES;
-    uint32_t            _bufSizeSmp             = 0;
-    int                 _changedBufBytes        = 0;
-    uint32_t            _hunger                 = 0;
-    int                 _bytesToRead            = 0;      // can be negative
+    // ownership: Core1 increments _startGen when it prepares the voice, Core0 copies it to _doneGen when the voice is over
+    uint32_t            _startGen               = 0;
+    std::atomic<uint32_t> _doneGen              {0};
+    // the stream, shared
+    std::atomic<uint32_t> _fileSector           {0};      // sectors of the file read so far (producer, Core1)
+    std::atomic<uint32_t> _playByte             {0};      // file position of the current frame (consumer, Core0)
+    std::atomic<bool>   _started                {false};  // the first portion of data is in the ring
+    std::atomic<bool>   _eof                    {true};   // the whole file is in the ring
+    std::atomic<uint32_t> _underruns            {0};      // times the ring ran out of data before the next read
+    std::atomic<const uint8_t*> _loopBody       {nullptr}; // the complete loop body (producer, Core1)
+    std::atomic<float>  _amplitude              {0.0f};   // peak follower of the output (Core0 publishes it every block)
+    std::atomic<uint8_t> _segment               {Adsr::ADSR_SEG_IDLE};  //   and the envelope stage, Adsr::eSegment_t
+    // Core1: set up in start(), read-only for Core0 while the voice is playing
+    sample_t            _sampleFile             ;
+    // ring buffer: file sector N is stored at ring sector (N % _ringSectors), the data is addressed by absolute file byte positions
+    uint8_t*            _ring                   = nullptr;
+    uint32_t            _ringSectors            = 0;      // ring depth, it scales with the byte rate of the voice
+    uint32_t            _ringBytes              = 0;
+    uint32_t            _readSectors            = 0;      // sectors per read, half of the ring
+    uint32_t            _key                    = 0;      // first sector of the sample file, it identifies the sample for the siblings
+    uint32_t            _fileSectors            = 0;      // file size in sectors
     uint32_t            _bytesToPlay            = 0;
-    int                 _playBufOffset          = 0;      // play-buffer byte offset till the 1st sample
-    int                 _fillBufOffset          = 0;      // fill-buffer byte offset till the 1st sample
-    volatile int        _pL1, _pL2, _pR1, _pR2  ;
-    int                 _samplesInFillBuf       = 0;
-    int                 _samplesInPlayBuf       = 0;
-    volatile int        _posSmp                 = 0;      // global position in terms of samples
-    volatile int        _bufPosSmp[2]           = {0, 0}; // sample pos, it depends on the number of channels and bit depth of a wav file assigned to this voice;
-    float               _bufPosSmpF             = 0.0f;   // exact calculated sample reading position including speed, pitchbend etc. 
-    bool                _bufEmpty[2]            = {true, true};
     uint32_t            _fullSampleBytes        = 4;      // bytes
+    int                 _loopId                 = -1;     // LoopCache entry, -1 if the voice doesn't loop
+    uint32_t            _loopStartByte          = 0;      // file position of the loop start
+    uint32_t            _loopBytes              = 0;
+    uint32_t            _loopEntryByte          = 0;      // the stream goes to the body only after it, past the crossfade
+    // Core1 only
+    int                 _bytesToRead            = 0;      // can be negative
     float               _divFileSize            = 0.001f;
     float               _divVelo                = 0;
-    volatile int        _idToFill               = 0;      // tic-tac buffer id
-    volatile int        _idToPlay               = 1;
-    uint8_t             _midiNote               = 0;
+    float               _killScoreCoef          = 1.0f;
+    uint8_t             _midiNote               = 255;
     uint8_t             _midiVelo               = 0;    
-    float               _speed                  = 1.0f;   // _speed param corrects the central freq of a sample 
     float               _speedModifier          = 1.0f;   // pitchbend, portamento etc. 
-    volatile uint32_t   _lastSectorRead         = 0;      // last sector that was read during this sample playback
-    uint32_t            _curChain               = 0;      // current chain (linear non-fragmented segment of a sample file) index
-    uint32_t            _bufPlayed              = 0;      // number of buffers played (for float correction)
-    uint32_t            _coarseBytesPlayed      = 0;
-    uint32_t            _bytesPlayed            = 0;
-    float               _amplitude              = 0.0f;
-    volatile bool       _pressed                = false;
-    volatile bool       _eof                    = true;
-    volatile float      _killScoreCoef          = 1.0f;
-    volatile float      _hungerCoef             = 1.0f;
-    bool                _loop                   = false;
-    int                 _loopState              = 0;
-    uint32_t            _loopFirstSmp           = 0;
-    uint32_t            _loopLastSmp            = 0;
-    uint32_t            _loopFirstSector        = 0;
-    uint32_t            _loopLastSector         = 0;
+    float               _feedSpeed              = 1.0f;   // the pitch the scheduler counts with
+    bool                _dying                  = false;
+    float               _cardShare              = 1.0f;   // of the recent feeds, the part that came from the card
+    uint32_t            _cardSectors            = 0;      // statistics: where the sectors came from
+    uint32_t            _sharedSectors          = 0;
+    uint32_t            _headSectors            = 0;
+    uint32_t            _cachedSectors          = 0;
+    // Core0 while playing
+    bool                _active                 = false;
+    bool                _pressed                = false;
+    bool                _looping                = false;  // playing from the loop body, the ring isn't used anymore
     int                 _lowest                 = 1;
     Adsr                AmpEnv                  ;
-    sample_t            _sampleFile             ;
 };
@@ -1,82 +1,68 @@
 #include "voice.h"
 
-bool Voice::allocateBuffers() {
-  // heap_caps_print_heap_info(MALLOC_CAP_8BIT);
-  _buffer0 = (uint8_t*)heap_caps_malloc( BUF_SIZE_BYTES + BUF_EXTRA_BYTES , MALLOC_CAP_INTERNAL);
-  _buffer1 = (uint8_t*)heap_caps_malloc( BUF_SIZE_BYTES + BUF_EXTRA_BYTES , MALLOC_CAP_INTERNAL);
-  if( _buffer0 == NULL || _buffer1 == NULL){
-    DEBUG("No more RAM for sampler buffer!");
-    return false;
-  } else {
-    DEBF("%d Bytes RAM allocated for sampler buffers, &_buffer0=%#010x\r\n", BUF_NUMBER * ( BUF_SIZE_BYTES + BUF_EXTRA_BYTES ) , _buffer0);
-  }
-  return true;
-}
-
-
-void Voice::init(SDMMC_FAT32* Card, bool* sustain, bool* normalized){
+void Voice::init(SDMMC_FAT32* Card, RingArena* Arena, HeadCache* Heads, SectorCache* Sectors, LoopCache* Loops, voice_bank_t* Bank, Voice* Siblings, bool* sustain, bool* normalized){
   _Card = Card;
+  _Arena = Arena;
+  _Heads = Heads;
+  _Sectors = Sectors;
+  _Loops = Loops;
+  _Bank = Bank;
+  _Siblings = Siblings;
   _sustain = sustain;
   _normalized = normalized;
   _speedModifier = 1.0f;
-  if (!allocateBuffers()) {
-    DEBUG("VOICE: INIT: NOT ENOUGH MEMORY");
-    delay(100);
-    while(1){;}
-  }
+  _interp = (eInterp_t)INTERP_QUALITY;
   AmpEnv.init(SAMPLE_RATE);
   AmpEnv.end(Adsr::END_NOW);
   _active   = false;
   _midiNote = 255;
   _pressed  = false;
   _eof      = true;
+  _doneGen  = _startGen;
 }
 
 
-// If the voice is free, it sets the new sample to play
+// The voice must be free: it sets the new sample to play, and SamplerEngine hands it over to Core0 with CMD_START
  
-void Voice::start(const sample_t smpFile, uint8_t midiNote, uint8_t midiVelo) { // executed in Control Task (Core1)
+bool Voice::start(const sample_t& smpFile, uint8_t midiNote, uint8_t midiVelo) { // executed in Control Task (Core1)
+    releaseRing();
     _sampleFile             = smpFile;
     _bytesToRead            = smpFile.size;
     _bytesToPlay            = smpFile.byte_offset + smpFile.data_size;
-    _amplitude              = 0.0f;
-    _bytesPlayed            = 0;
-    _coarseBytesPlayed      = 0;
+    _amplitude.store(0.0f, std::memory_order_relaxed);
+    _segment.store(Adsr::ADSR_SEG_ATTACK, std::memory_order_relaxed);
     _fullSampleBytes        = smpFile.channels * smpFile.bit_depth / 8;
-    _speed                  = smpFile.speed * _speedModifier;
-    _bufSizeBytes           = BUF_SIZE_BYTES;
-    _bufSizeSmp             = _bufSizeBytes / _fullSampleBytes;
-    _bufEmpty[0]            = true;
-    _bufEmpty[1]            = true;
-    _bufPosSmp[0]           = _bufSizeSmp;
-    _bufPosSmp[1]           = _bufSizeSmp;
-    _eof                    = false; 
-    // _bufPlayed              = 0;
-    _fillBuffer             = _buffer0;
-    _playBuffer             = _buffer1;
-    _idToFill               = 0;
-    _idToPlay               = 1;
-    _curChain               = 0;
-    _loop                   = (smpFile.loop_mode > 0);
-    if (_loop) {
-      if (_sampleFile.loop_first_smp >=0 ) {
-        _loopFirstSmp = smpFile.loop_first_smp;
-      } else {
-        _loopFirstSmp = 0;
+    _feedSpeed              = smpFile.speed * _speedModifier;
+    // a read is READ_BUF_SECTORS at the nominal byte rate (16 bit stereo at SAMPLE_RATE), and the ring holds two reads
+    _readSectors            = ceilf((float)READ_BUF_SECTORS * (float)_fullSampleBytes * 0.25f * (float)_feedSpeed);
+    _readSectors            = constrain(_readSectors, (uint32_t)RING_MIN_SECTORS / 2, (uint32_t)RING_MAX_SECTORS / 2);
+    _ringSectors            = 2 * _readSectors;
+    while ((_ring = _Arena->alloc(_ringSectors + 1)) == nullptr) { // one more sector for the guard
+      if (_ringSectors <= RING_MIN_SECTORS) {
+        DEBUG("VOICE: START: no room for the ring");
+        return false;
       }
-      if (_sampleFile.loop_last_smp >=0 ) {
-        _loopLastSmp = smpFile.loop_last_smp;
-      } else {
-        _loopLastSmp = _bytesToPlay / _fullSampleBytes - 1;
-      }
-      _loopFirstSector = (smpFile.byte_offset + _fullSampleBytes * _loopFirstSmp ) / BYTES_PER_SECTOR;
-      _loopLastSector  = (smpFile.byte_offset + _fullSampleBytes * _loopLastSmp ) / BYTES_PER_SECTOR;
-      
+      _ringSectors = max(_ringSectors / 2, (uint32_t)RING_MIN_SECTORS);
+      _readSectors = _ringSectors / 2;
+    }
+    _ringBytes              = _ringSectors * BYTES_PER_SECTOR;
+    _key                    = smpFile.sectors[0].first;
+    _fileSector             = 0;
+    _fileSectors            = (smpFile.size + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+    _playByte               = smpFile.byte_offset;
+    _started                = false;
+    _eof                    = false; 
+    _looping                = false;
+    _loopId                 = _Loops->valid(smpFile.loop, _key) ? smpFile.loop : -1;
+    if (_loopId >= 0) {
+      // the stream is played up to the loop end, and it's read only as far as the loop body needs
+      _loopStartByte        = _Loops->getStart(_loopId);
+      _loopBytes            = _Loops->getBytes(_loopId);
+      _loopEntryByte        = _loopStartByte + max(_Loops->getStartXfade(_loopId), (uint32_t)INTERP_BEHIND) * _fullSampleBytes;
+      _bytesToPlay          = _loopStartByte + _loopBytes;
+      _fileSectors          = min(_fileSectors, (_Loops->getCaptureEnd(_loopId) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR);
     }
-    _pL1                    = start_byte[_fullSampleBytes / smpFile.channels];
-    _pL2                    = _pL1 + _fullSampleBytes;
-    _pR1                    = _pL1 + ( _fullSampleBytes / smpFile.channels );
-    _pR2                    = _pR1 + _fullSampleBytes;
+    _loopBody.store(_loopId >= 0 ? _Loops->body(_loopId) : nullptr, std::memory_order_release); // it may be complete already
     if (_sampleFile.size == 0) {
       _divFileSize          = 0.001f;
     } else {
@@ -87,39 +73,51 @@ void Voice::start(const sample_t smpFile, uint8_t midiNote, uint8_t midiVelo) {
     } else {
       _divVelo = 256.0f;
     }
-    _lastSectorRead         = smpFile.sectors[0].first - 1; 
     _midiNote = midiNote;
     _midiVelo = midiVelo; 
+    float amp;
     if (*_normalized) {
-      _amp = (float)_midiVelo * MIDI_NORM * 0.000033f;
+      amp = (float)_midiVelo * MIDI_NORM * 0.000033f;
     } else {
-      _amp =   0.000033f;
+      amp =   0.000033f;
     }
-    _amp *= smpFile.amp;
+    amp *= smpFile.amp;
+    // the hot part, the voice isn't playing so it's ours
+    const int v = my_id;
+    _Bank->ring[v]          = _ring;
+    _Bank->ringBytes[v]     = _ringBytes;
+    _Bank->readOff[v]       = smpFile.byte_offset % _ringBytes;
+    _Bank->posFrac[v]       = 0;
+    _Bank->amp[v]           = amp;
+    _Bank->frameBytes[v]    = _fullSampleBytes;
+    _Bank->peak[v]          = 0;
+    setIncrement(_feedSpeed); // and the kernel for the format
     _killScoreCoef = (float)_divFileSize * (float)_divVelo;
     
 //    _killScoreCoef =  (float)_divFileSize;
-    _hungerCoef = (float)_fullSampleBytes * (float)_speed;
  //    DEBF("VOICE %d: START note %d velo %d offset %d\r\n", my_id, midiNote, midiVelo, smpFile.byte_offset);
     AmpEnv.retrigger(Adsr::END_NOW);
-    _active = true;
     _dying = false;
+    _cardShare = 1.0f;  // until the siblings or the sector cache prove otherwise
     _pressed = true;
+    _startGen++;  // it's ours until Core0 plays it and gives it back
+    if (_Heads->ready(smpFile.head, _key, _readSectors)) {
+      feed(); // the first portion comes from PSRAM, no need to wait for the scheduler
+    }
+    return true;
 }
 
 
-void Voice::end(Adsr::eEnd_t end_type){ // most likely being executed in Control Task (Core1)
+void Voice::end(Adsr::eEnd_t end_type){ // executed in the audio task (Core0), by itself or by a command
+  if (!_active) return;
   switch ((int)end_type) {
     case Adsr::END_NOW:{
       AmpEnv.end(Adsr::END_NOW);
  //     DEBF("VOICE %d: END: NOW midi note %d\r\n", my_id, _midiNote); 
-      _active = false;
-      _midiNote = 255;
-      _amplitude = 0.0;
+      finish();
       break;
     }
     case Adsr::END_FAST:{
-      _dying = true;
       AmpEnv.end(Adsr::END_FAST);
  //     DEBF("VOICE %d: END: FAST %d\r\n", my_id, _midiNote);
       break;
@@ -134,196 +132,292 @@ void Voice::end(Adsr::eEnd_t end_type){ // most likely being executed in Control
   }
 }
 
-void Voice::getSample(float& sampleL, float& sampleR) {
-  float env;
-  int bufPosBytes;
-  float l1, l2, r1, r2;
-  sampleL = 0.0f; 
-  sampleR = 0.0f;
+void Voice::renderBlock(mix_t* L, mix_t* R, int n) { // audio task, Core0
   if (!_active ) return;
-  if (_bufEmpty[0] && _bufEmpty[1]) {
-    return;
-  } else {
-    env =  (float)AmpEnv.process() * (float)_amp ;
-   //  env = _amp;
-    if (AmpEnv.isIdle()) {      
-      _active = false;
-      _dying = false;
-      _midiNote = 255;
-      _amplitude = 0.0f;
-      //  DEBF("Voice::getSample: note %d active=false\r\n", _midiNote);
-      return;
-    } else {
-      bufPosBytes = (int)_playBufOffset + (int)_fullSampleBytes * (int)_bufPosSmp[_idToPlay ];  // pos in a byte buffer
-
-      //DEBF("pos %d \t posF %f\r\n", _bufPosSmp[_idToPlay ], _bufPosSmpF);
-      l1 = *( reinterpret_cast<volatile int16_t*>( &_playBuffer[ bufPosBytes + _pL1 ] ) );
-      l2 = *( reinterpret_cast<volatile int16_t*>( &_playBuffer[ bufPosBytes + _pL2 ] ) );
-      sampleL = (float)interpolate( l1, l2, _bufPosSmpF ) * (float)env;
-      
-      if (_sampleFile.channels == 2){
-        r1 = *( reinterpret_cast<volatile int16_t*>( &_playBuffer[ bufPosBytes + _pR1 ] ) );
-        r2 = *( reinterpret_cast<volatile int16_t*>( &_playBuffer[ bufPosBytes + _pR2 ] ) );
-        sampleR = (float)interpolate( r1, r2, _bufPosSmpF ) * (float)env;
-      } else {        
-        sampleR = sampleL;
-      }
-      
-      _bufPosSmpF += (float)_speed ; // * _speedModifier;
-      _bufPosSmp[_idToPlay ] = _bufPosSmpF;
-
-      _bytesPlayed = _coarseBytesPlayed + (int)_bufPosSmp[_idToPlay] * (int)_fullSampleBytes;
-      
-  /*    
-      if ( _bytesPlayed % 16 == 0 ) {
-        _amplitude = 0.96f * (float)_amplitude + (float)fabs(sampleL) + 0.04f * (float)fabs(sampleR);
-      } 
-   */   
-      if ( _bytesPlayed >= _bytesToPlay ) {
-        end(Adsr::END_NOW);
-        // DEBF("VOICE %d: DATA END: bytes played = %d , bytes to play = %d , pos in buffer = %d \r\n", my_id, _bytesPlayed , _bytesToPlay, _bufPosSmp[_idToPlay]);
-      } else { 
-        if (_bufPosSmp[_idToPlay ]  > _samplesInPlayBuf ) {
-          if (_started) toggleBuf();
-        }
-      }
-    }
-  }
+  if (!_started.load(std::memory_order_acquire)) return;
+  int i = _looping ? 0 : renderStream(L, R, n);
+  if (_looping && _active) renderLoop(L + i, R + i, n - i);
 }
 
-void  Voice::feed() { // executed in Control Task (Core1)
-  if (_bufEmpty[_idToFill] && !_eof) {
-    
-    if (_loop) {
-      int bytes_till_loop_end = _loopLastSmp * _fullSampleBytes - _bytesPlayed;
-      float fill_coef =  (float)bytes_till_loop_end * (float)DIV_BUF_SIZE_BYTES ;
-      if (fill_coef >= 1.0f && fill_coef < 1.42f) { // this situation needs correction
-        // change buffer size to allow looping wav data to be loaded from SD (not just a few bytes to play before rewinding to the loop start)
-        // divide the remaining bytes appx by half
-        
-      } 
-    }
 
-    int sectorsToRead = READ_BUF_SECTORS;
-    int sectorsAvailable;
-    volatile uint8_t* bufAddr =  _fillBuffer;
-    volatile uint32_t lastSec, firstSec;
-    firstSec = lastSec = _lastSectorRead;
-    // DEBF("VOICE %d: FEED: lastSec before %d", my_id,  lastSec);
-    // DEBF("fill buf addr %d\r\n", bufAddr);
-    while (sectorsToRead > 0) {
-      sectorsAvailable = min(_sampleFile.sectors[_curChain].last - lastSec, (uint32_t) sectorsToRead) ;
-      if (sectorsAvailable > 0) { // we have some sectors in the current chain to read
-        // DEBF("block available = %d Pointer = %010x\r\n", sectorsAvailable, bufAddr);
-        _Card->read_block((uint8_t*)bufAddr, lastSec+1, sectorsAvailable);
-        lastSec += sectorsAvailable;
-        _bufEmpty[_idToFill]    = false; // bufToFill is now filled with the first sectors of sample file
-        sectorsToRead -= sectorsAvailable;
-        _bytesToRead -= sectorsAvailable * BYTES_PER_SECTOR;
-        bufAddr += sectorsAvailable * BYTES_PER_SECTOR;
-      } else { // we've done with the current chain
-        if (_curChain + 1 < _sampleFile.sectors.size()) { // we still got some sectors to read
-          _curChain++;
-          lastSec = _sampleFile.sectors[_curChain].first - 1;
-        } else { // this was the last chain of sectors
-          _eof = true;
-          break;
-        }
-      }
+void Voice::endBlock(float fall) { // audio task, Core0, after all the runs of the block
+  if (!_active) return;
+  publishLevel(fall);
+  _Bank->peak[my_id] = 0;
+}
+
+
+int Voice::renderStream(mix_t* L, mix_t* R, int n) {
+  const int v = my_id;
+  const float speed = (float)_Bank->incInt[v] + (float)_Bank->incFrac[v] * FRAC_TO_FLOAT;
+  const uint32_t fb = _Bank->frameBytes[v];
+  uint32_t playByte = _playByte.load(std::memory_order_relaxed);
+  if (enterLoop(playByte)) return 0;
+  // the acquire loads order the ring data written by feed() before the frame reads
+  uint32_t avail = _fileSector.load(std::memory_order_acquire) * BYTES_PER_SECTOR;
+  bool eof = _eof.load(std::memory_order_acquire);
+  // samples that can neither run out of data nor reach the end of the sample go without any checks,
+  // with a frame of margin for the rounding of the position, and the taps of the widest kernel
+  int m = 0;
+  if (speed > 0.0f) {
+    m = n;
+    float toEnd = (float)(((int)_bytesToPlay - (int)playByte) / (int)fb);
+    m = min(m, (int)((toEnd - (float)(INTERP_AHEAD + 2)) / speed));
+    if (!eof) {
+      float inRing = (float)(((int)avail - (int)playByte) / (int)fb);
+      m = min(m, (int)((inRing - (float)(INTERP_AHEAD + 3)) / speed) + 1);
     }
-    // _lastSectorRead could have changed while we were reading here
-    if (firstSec == _lastSectorRead) {
-      _lastSectorRead = lastSec;
-      // copy first bytes of fillBuffer to playBuffer's extra zone for speeding up interpolation on bufToggle
-      memcpy((void*)(_playBuffer + _bufSizeBytes), (const void*)(_fillBuffer ), BUF_EXTRA_BYTES);
-      if (!_started) { // init state: bufToFill = 0, bufToPlay = 1
-        _idToFill               = 1;
-        _idToPlay               = 0;
-        _playBuffer             = _buffer0;
-        _fillBuffer             = _buffer1;
-        _bufPosSmp[_idToFill]   = _bufSizeSmp;
-        _bufPosSmp[_idToPlay]   = 0;  
-        _bufPosSmpF             = _bufPosSmp[_idToPlay];
-        _playBufOffset          = _sampleFile.byte_offset ;
-        _samplesInPlayBuf       = (_bufSizeBytes - _playBufOffset) / _fullSampleBytes ;
-     //   DEBF("VOICE %d: FEED-0: pos: %d, inBuf: %d, offset: %d, BPlyd: %d, firstSec %d, lastSec %d \r\n", my_id, _bufPosSmp[_idToPlay ], _samplesInPlayBuf, _playBufOffset, _bytesPlayed, firstSec, _lastSectorRead );
-        _started = true;
-      } else {
-        _bufPosSmp[_idToFill]   = 0;
-        // _fillBufOffset = ( _fullSampleBytes - ( (BUF_SIZE_BYTES - _playBufOffset) % _fullSampleBytes )) % _fullSampleBytes ;
-        // _samplesInFillBuf = ((int)BUF_SIZE_BYTES - (int)_fillBufOffset ) / (int)_fullSampleBytes ;
-      //  DEBF("VOICE %d: FEED: pos: %d, inBuf: %d, offset: %d, BPlyd: %d, firstSec %d, lastSec %d \r\n", my_id, _bufPosSmp[_idToPlay ], _samplesInPlayBuf, _playBufOffset, _bytesPlayed, firstSec, _lastSectorRead );
-     
-      }
-    } else {
-      DEBUG ("HERE IT IS!!! ");
+  }
+  if (m > 0) {
+    env_t env[MAX_BLOCK_LEN];
+    envelope(env, m);
+    // the frames before the first one are the wav header
+    voice_kernel_t kernel = (playByte >= (uint32_t)_sampleFile.byte_offset + INTERP_BEHIND * fb) ? _kernel : _safeKernel;
+    playByte += kernel(_Bank, v, L, R, env, m);
+    _playByte.store(playByte, std::memory_order_release); // the frames before it are free for feed()
+    if (AmpEnv.isIdle()) {
+      finish();
+      return n;
     }
+  } else {
+    m = 0;
+  }
+  for (int i = m; i < n && _active; i++) { // the last ones, near the end or close to an underrun
+    if (enterLoop(_playByte.load(std::memory_order_relaxed))) return i;
+    mix_t l, r;
+    getSample(l, r);
+    L[i] = mixAdd(L[i], l);
+    R[i] = mixAdd(R[i], r);
   }
+  return n;
 }
 
 
-inline void Voice::toggleBuf(){  // Core0
-  if (!_started ) return;
-  if (_bufEmpty[_idToFill ]) {
+void Voice::renderLoop(mix_t* L, mix_t* R, int n) {
+  const int v = my_id;
+  env_t env[MAX_BLOCK_LEN];
+  envelope(env, n);
+  // the ring is the loop body now: no data to wait for, no end to reach, the kernel wraps at the loop end
+  uint32_t played = _kernel(_Bank, v, L, R, env, n);
+  _playByte.store(_playByte.load(std::memory_order_relaxed) + played, std::memory_order_relaxed); // only the voice stealing looks at it
+  if (AmpEnv.isIdle()) finish();
+}
+
+
+inline void Voice::envelope(env_t* env, int n) {
+  float e[MAX_BLOCK_LEN];
+  const float amp = _Bank->amp[my_id];
+  AmpEnv.processBlock(e, n);
+  for (int i = 0; i < n; i++) env[i] = envGain(e[i] * amp);
+}
+
+
+inline bool Voice::enterLoop(uint32_t playByte) {
+  const uint8_t* body = _loopBody.load(std::memory_order_acquire);
+  if (body == nullptr || playByte < _loopEntryByte || playByte >= _bytesToPlay) return false;
+  const int v = my_id;
+  _Bank->ring[v]      = body;
+  _Bank->ringBytes[v] = _loopBytes;
+  _Bank->readOff[v]   = playByte - _loopStartByte;
+  _looping = true;
+  return true;
+}
+
+
+void Voice::getSample(mix_t& sampleL, mix_t& sampleR) {
+  env_t env;
+  sampleL = 0; 
+  sampleR = 0;
+  if (!_active ) return;
+  if (!_started.load(std::memory_order_acquire)) return;
+  const int v = my_id;
+  env =  envGain((float)AmpEnv.process() * (float)_Bank->amp[v]);
+ //  env = _amp;
+  if (AmpEnv.isIdle()) {      
+    finish();
+    //  DEBF("Voice::getSample: note %d active=false\r\n", _midiNote);
+    return;
+  }
+  const uint32_t fb = _Bank->frameBytes[v];
+  uint32_t playByte = _playByte.load(std::memory_order_relaxed);
+  // the acquire loads order the ring data written by feed() before the frame reads below
+  if (playByte + 2 * fb > _fileSector.load(std::memory_order_acquire) * BYTES_PER_SECTOR && !_eof.load(std::memory_order_acquire)) {
+    _underruns.store(_underruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
     end(Adsr::END_NOW); // O-oh!!! We are late ((
     return;
   }
-  int filePosBytes = (int)_coarseBytesPlayed + (int)_playBufOffset + (int)((int)_bufPosSmp[_idToPlay] * (int)_fullSampleBytes);
-  // _bufPlayed++;
-  _coarseBytesPlayed += _bufSizeBytes;
-  _bufEmpty[_idToPlay ] = true;
-  _bufPosSmpF -= (float)_bufPosSmp[_idToPlay];
-  _bufPosSmp[_idToFill]   = _bufPosSmpF;
-  _bytesPlayed = (int)filePosBytes - (int)_sampleFile.byte_offset ;
-  _playBufOffset = (int)filePosBytes - (int)_coarseBytesPlayed;
-  _samplesInPlayBuf = ( (int)_bufSizeBytes -  (int)_playBufOffset ) /  (int)_fullSampleBytes ;
- // DEBF("VOICE %d: TOGGLE: pos: %d, inBuf: %d, off: %d, BPlyd: %d, ampl %f lastSec %d \r\n", my_id, _bufPosSmp[_idToPlay ], _samplesInPlayBuf, _playBufOffset, _bytesPlayed, _amplitude, _lastSectorRead );
-  switch(_idToPlay ) { 
-    case 0:
-      _playBuffer  = _buffer1;
-      _fillBuffer  = _buffer0;
-      _idToPlay  = 1;
-      _idToFill  = 0;
-      break;
-    case 1:
-      _playBuffer  = _buffer0;
-      _fillBuffer  = _buffer1;
-      _idToPlay  = 0;
-      _idToFill  = 1;
+  playByte += _safeKernel(_Bank, v, &sampleL, &sampleR, &env, 1);
+  _playByte.store(playByte, std::memory_order_release); // the frames before it are free for feed()
+  if ( playByte >= _bytesToPlay ) {
+    end(Adsr::END_NOW);
+    // DEBF("VOICE %d: DATA END: bytes played = %d , bytes to play = %d \r\n", my_id, _bytesPlayed , _bytesToPlay);
   }
-  _bufEmpty[_idToFill ] = true;
-  //  DEBF("&playBuf=%#010x &fillBuf=%#010x\r\n", _buffer0, _fillBuffer);
 }
 
 
+bool  Voice::feed() { // executed in Control Task (Core1)
+  bool cardRead = false;
+  uint32_t runLeft, sector, ringSector, n;
+  if (_ring == nullptr || _eof.load(std::memory_order_relaxed)) return false;
+  uint32_t fileSector = _fileSector.load(std::memory_order_relaxed);
+  // sectors before the one being played are free, but for the frames the interpolation looks back at
+  uint32_t room = (_playByte.load(std::memory_order_acquire) - INTERP_BEHIND * _fullSampleBytes) / BYTES_PER_SECTOR + _ringSectors - fileSector;
+  if (room < _readSectors) return false;
+  room = _readSectors;
+  while (room > 0) {
+    sector = chainSector(_sampleFile.sectors, fileSector, runLeft);
+    if (runLeft == 0 || fileSector >= _fileSectors) break;
+    ringSector = fileSector % _ringSectors;
+    n = min(min(room, runLeft), min(_ringSectors - ringSector, _fileSectors - fileSector)); // reads never wrap
+    uint8_t* dst = _ring + ringSector * BYTES_PER_SECTOR;
+    if (_Heads->covers(_sampleFile.head, _key, fileSector, n)) {
+      memcpy(dst, _Heads->data(_sampleFile.head, fileSector), n * BYTES_PER_SECTOR);
+      _headSectors += n;
+    } else if (fromSibling(fileSector, n, dst)) {
+      _sharedSectors += n;
+      _cardShare -= 0.25f * _cardShare;
+    } else if (_Sectors->read(dst, sector, n)) {
+      _cachedSectors += n;
+      _cardShare -= 0.25f * _cardShare;
+    } else {
+      if (_Card->read_block(dst, sector, n) == ESP_OK) _Sectors->insert(dst, sector, n);
+      _cardSectors += n;
+      _cardShare += 0.25f * (1.0f - _cardShare);
+      cardRead = true;
+    }
+    if (ringSector == 0) memcpy(_ring + _ringBytes, _ring, RING_GUARD_BYTES);
+    if (_loopId >= 0 && _loopBody.load(std::memory_order_relaxed) == nullptr) {
+      const uint8_t* body = _Loops->capture(_loopId, _key, fileSector * BYTES_PER_SECTOR, dst, n * BYTES_PER_SECTOR);
+      if (body != nullptr) _loopBody.store(body, std::memory_order_release); // before the sectors are published, so Core0 never plays past the loop end
+    }
+    _bytesToRead -= n * BYTES_PER_SECTOR;
+    fileSector += n;
+    _fileSector.store(fileSector, std::memory_order_release); // it's published for the consumer only after the data is in place
+    room -= n;
+  }
+  bool eof = (runLeft == 0 || fileSector >= _fileSectors);
+  if (eof) _eof.store(true, std::memory_order_release);
+  if (eof || fileSector * BYTES_PER_SECTOR >= _playByte.load(std::memory_order_relaxed) + 2 * _fullSampleBytes) {
+    _started.store(true, std::memory_order_release); // the first frames are there
+  }
+  return cardRead;
+}
 
 
-uint32_t Voice::hunger() { // called by SamplerEngine::fillBuffer() in ControlTask, Core1
-    if (!_active) return 0;
-    if ( _eof) return 0;
-    if ( _dying) return 0;
-    if (!_bufEmpty[0] && !_bufEmpty[1]) return 0;
-    return (/*(float)_speedModifier * */(float)_hungerCoef * ((float)_bufPosSmp[0] + (float)_bufPosSmp[1])); // the bigger the value, the sooner we empty the buffer
+bool Voice::fromSibling(uint32_t fileSector, uint32_t count, uint8_t* dst) {
+  // the last _ringSectors read by a voice stay in its ring until its next read, and all the reads are in this task
+  for (int i = 0; i < MAX_POLYPHONY; i++) {
+    Voice& v = _Siblings[i];
+    if (&v == this || v._ring == nullptr || v._key != _key) continue;
+    uint32_t siblingSector = v._fileSector.load(std::memory_order_relaxed); // written by this very task
+    if (fileSector + count > siblingSector || fileSector + v._ringSectors < siblingSector) continue;
+    for (uint32_t j = 0; j < count; j++) {
+      memcpy(dst + j * BYTES_PER_SECTOR, v._ring + ((fileSector + j) % v._ringSectors) * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+    }
+    return true;
+  }
+  return false;
 }
 
 
-// linear interpolation of 2 neighbour values by float index (mantissa only used)
-inline float Voice::interpolate(float& v1, float& v2, float index) {
-  float res;
-  int32_t i = (int32_t)index;
-  float f = (float)index - i;
-  res = (float)f * (float)(v2 - v1) + (float)v1;
-  return res;
+void Voice::releaseRing() { // Core1, the voice must be free
+  if (_ring == nullptr) return;
+  _started = false;
+  _Arena->free(_ring, _ringSectors + 1);
+  _ring = nullptr;
 }
 
 
-inline float Voice::getKillScore() { // called by SamplerEngine::assignVoice() and freeSomeVoices in ControlTast, Core1
+uint32_t Voice::deadline() { // called by SamplerEngine::fillBuffer() in ControlTask, Core1
+    if (!isActive()) return DEADLINE_NONE;
+    if (_ring == nullptr) return DEADLINE_NONE;
+    if ( _eof.load(std::memory_order_relaxed)) return DEADLINE_NONE;
+    if ( _dying) return DEADLINE_NONE;
+    if (!_started.load(std::memory_order_relaxed)) return 0;  // nothing to play yet
+    uint32_t playByte = _playByte.load(std::memory_order_relaxed);
+    uint32_t fileSector = _fileSector.load(std::memory_order_relaxed);
+    if ((playByte - INTERP_BEHIND * _fullSampleBytes) / BYTES_PER_SECTOR + _ringSectors < fileSector + _readSectors) return DEADLINE_NONE; // no room for a read
+    if (_feedSpeed <= 0.0f) return DEADLINE_NONE;
+    float left = (float)((int)(fileSector * BYTES_PER_SECTOR) - (int)playByte) / (float)_fullSampleBytes - 2.0f; // frames till the end of data
+    if (left <= 0.0f) return 0;
+    return (float)left / (float)_feedSpeed * US_PER_SAMPLE;  // output samples at the current pitch, converted to us
+}
+
+
+inline float Voice::getKillScore(eVoiceAlloc_t method) { // called by SamplerEngine::assignVoice() and freeSomeVoices in ControlTast, Core1
   if (_dying ) return 0.0f; // don't kill twice
-  return (float)_bytesPlayed * (float)_killScoreCoef ;
+  float bytesPlayed = (float)(_playByte.load(std::memory_order_relaxed) - _sampleFile.byte_offset);
+  if (method == VA_OLDEST) return bytesPlayed * (float)_killScoreCoef ;
+  float level = _amplitude.load(std::memory_order_relaxed);
+  const uint8_t segment = _segment.load(std::memory_order_relaxed);
+  if (segment == Adsr::ADSR_SEG_ATTACK) level = max(level, _Bank->amp[my_id] * 32768.0f); // it's only getting louder: as if it was full scale
+  if (method == VA_MOST_QUIET) return 1.0f / (level + LEVEL_FLOOR);
+  // VA_PERCEPTUAL: the quiet ones first, the released ones before the held ones, the ones that keep the card busy
+  // before the ones that are all in the ring, and of the equal ones the one that has played the most of its sample
+  float weight = 1.0f;
+  switch (segment) {
+    case Adsr::ADSR_SEG_ATTACK:
+      weight = 0.5f;
+      break;
+    case Adsr::ADSR_SEG_RELEASE:
+    case Adsr::ADSR_SEG_SEMI_FAST_RELEASE:
+    case Adsr::ADSR_SEG_FAST_RELEASE:
+      weight = 2.0f;
+      break;
+  }
+  if (!_eof.load(std::memory_order_relaxed)) {
+    weight *= 1.0f + 0.125f * (float)_fullSampleBytes * _feedSpeed; // 16 bit stereo at the unity speed makes it 1.5
+  }
+  weight *= 1.0f + bytesPlayed * _divFileSize;
+  return weight / (level + LEVEL_FLOOR);
+}
+
+
+inline float Voice::getCardRate() { // Core1, for SamplerEngine::admit(); the head cache only delays the reads, so it doesn't count
+  if (_dying || _eof.load(std::memory_order_relaxed)) return 0.0f;
+  return (float)_fullSampleBytes * _feedSpeed * _cardShare / US_PER_SAMPLE;
+}
+
+
+inline void Voice::publishLevel(float fall) { // Core0, at the end of a block
+  float peak = mixToFloat(_Bank->peak[my_id]);
+  _amplitude.store(max(peak, _amplitude.load(std::memory_order_relaxed) * fall), std::memory_order_relaxed);
+  _segment.store(AmpEnv.getCurrentSegment(), std::memory_order_relaxed);
 }
 
 
-inline void Voice::setPitch(float speedModifier) { // called by SamplerEngine::setPitch, Core1
+inline void Voice::setPitch(float speedModifier) { // called by SamplerEngine::setPitch, Core1, the audio side gets CMD_PITCH
   _speedModifier = speedModifier;
-  _speed = _sampleFile.speed * speedModifier;
+  _feedSpeed = _sampleFile.speed * speedModifier;
+}
+
+
+inline void Voice::setIncrement(float speed) { // Core1 on a free voice, Core0 on a playing one
+  if (speed < 0.0f) speed = 0.0f;
+  const int v = my_id;
+  uint32_t i = (uint32_t)speed;
+  _Bank->incInt[v] = i;
+  _Bank->incFrac[v] = (uint32_t)(((double)speed - (double)i) * 4294967296.0);
+  _Bank->sinc[v] = sincBand(speed); // the higher the pitch, the lower the cutoff, to keep the aliases out
+  selectKernel();
+}
+
+
+inline bool Voice::needsInterpolation() {
+  const int v = my_id;
+  return !(_Bank->incInt[v] == 1 && _Bank->incFrac[v] == 0 && _Bank->posFrac[v] == 0);
+}
+
+
+inline void Voice::selectKernel() { // Core1 on a free voice, Core0 on a playing one
+  // frames are just copied when they fall exactly on the output samples
+  _kernel = selectVoiceKernel(_sampleFile.bit_depth, _sampleFile.channels, needsInterpolation() ? _interp : INTERP_COPY);
+  _safeKernel = selectVoiceKernel(_sampleFile.bit_depth, _sampleFile.channels, INTERP_LINEAR);
+}
+
+
+inline void Voice::finish() { // Core0
+  _active = false;
+  _amplitude.store(0.0f, std::memory_order_relaxed);
+  _doneGen.store(_startGen, std::memory_order_release); // after this Core0 doesn't touch the voice
 }
@@ -0,0 +1,210 @@
+#pragma once
+
+// Decode and interpolation kernels, one per sample format and interpolation tier, generated from a single template:
+// 8, 16, 24 or 32 bit PCM, mono or stereo; nearest, linear, 4 point Hermite or 8 tap windowed sinc, and a copy
+// variant for the unity speed. Voice::setIncrement() picks one when the voice starts, the pitch changes or
+// the governor (SamplerEngine::governInterpolation()) moves the voice to another tier, so the sample loop has no
+// branches left. Values come out in the 16 bit range (the voice gain expects that), the deeper formats keep
+// their lower bits as the fraction. Plain C++, the host tools run the very same kernels; the number types are
+// those of fixed_point.h, so FIXED_POINT_ENGINE builds them in integers.
+// A kernel adds n samples, scaled by env[], to L and R, advances the voice in the bank and returns the bytes played.
+// It also keeps the peak of what it added in the bank, for the voice stealing (Voice::publishLevel()).
+
+enum eInterp_t { INTERP_NEAREST, INTERP_LINEAR, INTERP_HERMITE, INTERP_SINC, INTERP_TIERS, INTERP_COPY = INTERP_TIERS };
+
+#define INTERP_BEHIND     3     // frames before the current one the widest kernel reads
+#define INTERP_AHEAD      4     //   and after it
+#define SINC_TAPS         (INTERP_BEHIND + 1 + INTERP_AHEAD)
+#define SINC_PHASES       128   // fractional positions in the table, power of 2
+#define SINC_BANDS        3     // cutoffs, the voices pitched up get the lower ones, see sincBand()
+
+const float sincCutoff[SINC_BANDS] = { 0.90f, 0.64f, 0.45f };  // of the sample Nyquist frequency
+const char* const interpNames[INTERP_TIERS] = { "nearest", "linear", "hermite", "sinc" };
+const float interpWeight[INTERP_COPY + 1] = { 0.6f, 1.0f, 2.1f, 3.1f, 0.5f }; // cost of a voice block, linear = 1, by the operations per sample
+
+static coef_t sincTable[SINC_BANDS][SINC_PHASES][SINC_TAPS];
+
+// Blackman windowed sinc, each phase normalized to the unity DC gain. SamplerEngine::init() calls it once.
+inline void initSincTables() {
+  for (int b = 0; b < SINC_BANDS; b++) {
+    const double fc = sincCutoff[b];
+    for (int p = 0; p < SINC_PHASES; p++) {
+      const double f = (double)p / (double)SINC_PHASES;
+      double sum = 0.0;
+      double h[SINC_TAPS];
+      for (int k = 0; k < SINC_TAPS; k++) {
+        double x = (double)(k - INTERP_BEHIND) - f;
+        double s = (x == 0.0) ? fc : sin(PI * fc * x) / (PI * x);
+        double w = 0.42 + 0.5 * cos(PI * x / 4.0) + 0.08 * cos(TWO_PI * x / 4.0);
+        h[k] = (fabs(x) < 4.0) ? s * w : 0.0;
+        sum += h[k];
+      }
+      for (int k = 0; k < SINC_TAPS; k++) sincTable[b][p][k] = COEF(h[k] / sum);
+    }
+  }
+}
+
+inline const coef_t* sincBand(float speed) {
+  int b = (speed < 1.2f) ? 0 : (speed < 1.7f) ? 1 : 2;
+  return &sincTable[b][0][0];
+}
+
+
+typedef uint32_t (*voice_kernel_t)(voice_bank_t* bank, int v, mix_t* L, mix_t* R, const env_t* env, int n);
+
+template<int BITS> inline smp_t decodeSample(const uint8_t* p);
+
+#ifdef FIXED_POINT_ENGINE
+
+template<> inline smp_t decodeSample<8>(const uint8_t* p) {   // unsigned
+  return ((int32_t)p[0] - 128) << 16;
+}
+
+template<> inline smp_t decodeSample<16>(const uint8_t* p) {
+  return (int32_t)( *( reinterpret_cast<const int16_t*>( p ) ) ) << 8;
+}
+
+template<> inline smp_t decodeSample<24>(const uint8_t* p) {  // 3 bytes, no alignment
+  return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)) >> 8;
+}
+
+template<> inline smp_t decodeSample<32>(const uint8_t* p) {
+  return *( reinterpret_cast<const int32_t*>( p ) ) >> 8;
+}
+
+#else
+
+template<> inline smp_t decodeSample<8>(const uint8_t* p) {   // unsigned
+  return (float)(((int)p[0] - 128) << 8);
+}
+
+template<> inline smp_t decodeSample<16>(const uint8_t* p) {
+  return (float)( *( reinterpret_cast<const int16_t*>( p ) ) );
+}
+
+template<> inline smp_t decodeSample<24>(const uint8_t* p) {  // 3 bytes, no alignment
+  int32_t s = (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24));
+  return (float)s * (1.0f / 65536.0f);
+}
+
+template<> inline smp_t decodeSample<32>(const uint8_t* p) {
+  return (float)( *( reinterpret_cast<const int32_t*>( p ) ) ) * (1.0f / 65536.0f);
+}
+
+#endif
+
+
+// one channel at p, the current frame, fb bytes per frame
+template<int BITS, int INTERP>
+inline smp_t interpSample(const uint8_t* p, const uint32_t fb, const uint32_t posFrac, const coef_t* sinc) {
+  switch (INTERP) {
+    case INTERP_COPY:
+      return decodeSample<BITS>(p);
+    case INTERP_NEAREST:
+      return decodeSample<BITS>((posFrac & 0x80000000) ? p + fb : p);
+#ifdef FIXED_POINT_ENGINE
+    case INTERP_LINEAR: {
+      smp_t s1 = decodeSample<BITS>(p);
+      smp_t s2 = decodeSample<BITS>(p + fb);
+      return mulQ31(s2 - s1, posFrac) + s1;
+    }
+    case INTERP_HERMITE: {
+      smp_t s0 = decodeSample<BITS>(p - fb);
+      smp_t s1 = decodeSample<BITS>(p);
+      smp_t s2 = decodeSample<BITS>(p + fb);
+      smp_t s3 = decodeSample<BITS>(p + 2 * fb);
+      smp_t c1 = (s2 - s0) >> 1;
+      smp_t c2 = s0 - ((5 * s1) >> 1) + 2 * s2 - (s3 >> 1);
+      smp_t c3 = ((s3 - s0) >> 1) + ((3 * (s1 - s2)) >> 1);
+      return mulQ31(mulQ31(mulQ31(c3, posFrac) + c2, posFrac) + c1, posFrac) + s1;
+    }
+    default: {  // INTERP_SINC
+      const coef_t* h = sinc + (posFrac >> (32 - 7)) * SINC_TAPS; // SINC_PHASES = 2^7
+      const uint8_t* q = p - INTERP_BEHIND * fb;
+      int64_t acc = 0;
+      for (int k = 0; k < SINC_TAPS; k++) acc += (int64_t)h[k] * decodeSample<BITS>(q + k * fb);
+      return (smp_t)(acc >> 30);
+    }
+#else
+    case INTERP_LINEAR: {
+      float f = (float)(posFrac >> 8) * FRAC24_TO_FLOAT;
+      float s1 = decodeSample<BITS>(p);
+      float s2 = decodeSample<BITS>(p + fb);
+      return f * (s2 - s1) + s1;
+    }
+    case INTERP_HERMITE: {
+      float f = (float)(posFrac >> 8) * FRAC24_TO_FLOAT;
+      float s0 = decodeSample<BITS>(p - fb);
+      float s1 = decodeSample<BITS>(p);
+      float s2 = decodeSample<BITS>(p + fb);
+      float s3 = decodeSample<BITS>(p + 2 * fb);
+      float c1 = 0.5f * (s2 - s0);
+      float c2 = s0 - 2.5f * s1 + 2.0f * s2 - 0.5f * s3;
+      float c3 = 0.5f * (s3 - s0) + 1.5f * (s1 - s2);
+      return ((c3 * f + c2) * f + c1) * f + s1;
+    }
+    default: {  // INTERP_SINC
+      const float* h = sinc + (posFrac >> (32 - 7)) * SINC_TAPS; // SINC_PHASES = 2^7
+      const uint8_t* q = p - INTERP_BEHIND * fb;
+      float acc = 0.0f;
+      for (int k = 0; k < SINC_TAPS; k++) acc += h[k] * decodeSample<BITS>(q + k * fb);
+      return acc;
+    }
+#endif
+  }
+}
+
+
+template<int BITS, int CH, int INTERP>
+uint32_t voiceKernel(voice_bank_t* bank, int v, mix_t* L, mix_t* R, const env_t* env, int n) {
+  const int bytes = BITS / 8;
+  const uint32_t fb = bytes * CH;
+  const uint8_t* ring = bank->ring[v];
+  const uint32_t ringBytes = bank->ringBytes[v];
+  const uint32_t incInt = bank->incInt[v];
+  const uint32_t incFrac = bank->incFrac[v];
+  const coef_t* sinc = bank->sinc[v];
+  uint32_t readOff = bank->readOff[v];
+  uint32_t posFrac = bank->posFrac[v];
+  mix_t peak = bank->peak[v];
+  uint32_t played = 0;
+  for (int i = 0; i < n; i++) {
+    // the frames ahead are always contiguous in memory thanks to the guard, and so are the ones behind
+    // if we take them from the end of the ring: the guard continues it with the start
+    const uint8_t* frame = ring + readOff;
+    if ((INTERP == INTERP_HERMITE || INTERP == INTERP_SINC) && readOff < INTERP_BEHIND * fb) frame += ringBytes;
+    mix_t sampleL = voiceMul(interpSample<BITS, INTERP>(frame, fb, posFrac, sinc), env[i]);
+    mix_t sampleR = (CH == 2) ? voiceMul(interpSample<BITS, INTERP>(frame + bytes, fb, posFrac, sinc), env[i]) : sampleL;
+    L[i] = mixAdd(L[i], sampleL);
+    R[i] = mixAdd(R[i], sampleR);
+    peak = max(peak, mixAbs(sampleL));
+    if (CH == 2) peak = max(peak, mixAbs(sampleR));
+    uint32_t step = fb;
+    if (INTERP != INTERP_COPY) {
+      uint32_t frac = posFrac + incFrac;
+      step = (incInt + (frac < posFrac)) * fb;  // carry
+      posFrac = frac;
+    }
+    readOff += step;
+    if (readOff >= ringBytes) readOff -= ringBytes;
+    played += step;
+  }
+  bank->readOff[v] = readOff;
+  bank->posFrac[v] = posFrac;
+  bank->peak[v] = peak;
+  return played;
+}
+
+
+#define VOICE_KERNELS_CH(BITS, CH) { voiceKernel<BITS, CH, INTERP_NEAREST>, voiceKernel<BITS, CH, INTERP_LINEAR>, \
+  voiceKernel<BITS, CH, INTERP_HERMITE>, voiceKernel<BITS, CH, INTERP_SINC>, voiceKernel<BITS, CH, INTERP_COPY> }
+#define VOICE_KERNELS(BITS) { VOICE_KERNELS_CH(BITS, 1), VOICE_KERNELS_CH(BITS, 2) }
+
+// [bytes per sample - 1][channels - 1][eInterp_t]
+static const voice_kernel_t voiceKernels[4][2][INTERP_COPY + 1] = { VOICE_KERNELS(8), VOICE_KERNELS(16), VOICE_KERNELS(24), VOICE_KERNELS(32) };
+
+inline voice_kernel_t selectVoiceKernel(int bitDepth, int channels, eInterp_t interp) {
+  int b = constrain(bitDepth / 8, 1, 4) - 1;
+  int c = constrain(channels, 1, 2) - 1;
+  return voiceKernels[b][c][interp];
+}
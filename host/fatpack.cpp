@@ -0,0 +1,558 @@
+// Fragmentation analyzer and contiguous card image packer.
+//
+//   fatpack [-v] [-m us_per_read,us_per_sector] <image>
+//       walks the card (FAT32 or exFAT) with the sampler's own FAT code and reports, per sample set
+//       (a folder holding sampler.ini), the chains per sample, the reads that Voice::feed() has to split
+//       at chain ends, and the predicted time to stream the whole set. -v lists every sample.
+//       The cost model is t = reads * us_per_read + sectors * us_per_sector, take the numbers from sd_bench,
+//       the default comes from the 1 and 128 sector rows of the table in sdmmc.h.
+//
+//   fatpack -o <packed.img> [-k cluster_KB] [-a align_sectors] [-s size_MB] <image>
+//       writes a fresh FAT32 image with the same tree where every file is a single chain. Files are laid out
+//       in the order the sampler reads them (folder by folder, sampler.ini and then the samples in directory
+//       order), every sample starts on an align_sectors boundary (a cluster by default, 8192 for 4 MB SD
+//       allocation units), and the data region starts on a 4 MB boundary like the SD Formatter does it.
+//       Hidden and system files are left out, and so is the folder index, as it's rebuilt on the first load.
+//       The packed image is analyzed at the end.
+
+#include "host.h"
+#include <string>
+#include <set>
+#include <functional>
+
+struct node_t {
+  fname_t   name;
+  bool      dir       = false;
+  bool      set       = false;    // holds INI_FILE
+  uint32_t  size      = 0;
+  std::vector<chain_t> chains;
+  std::vector<node_t>  kids;
+  uint32_t  cluster   = 0;        // in the packed image
+  uint32_t  clusters  = 0;
+};
+
+typedef struct {
+  uint32_t  samples   = 0;
+  uint32_t  fragmented = 0;
+  uint32_t  chains    = 0;
+  uint64_t  sectors   = 0;
+  uint64_t  reads     = 0;
+  uint64_t  splits    = 0;
+  uint32_t  unaligned = 0;        // samples not starting on an align boundary
+} set_stat_t;
+
+static float  usPerRead     = 541.0f;   // 1 sector: 0.90 MB/s, 128 sectors: 15.75 MB/s
+static float  usPerSector   = 28.3f;
+static bool   verbose       = false;
+
+static bool isWav(const fname_t& name) {
+  return name.length() > 4 && strcasecmp(name.c_str() + name.length() - 4, ".wav") == 0;
+}
+
+// sectors per read the way Voice::start() sizes it, from the frame size in the WAV header
+static uint32_t readSectorsOf(SDMMC_FAT32& Card, const node_t& f) {
+  uint32_t frameBytes = 4;
+  if (!f.chains.empty()) {
+    const uint8_t* p = Card.readSector(f.chains[0].first);
+    for (int i = 12; i + 16 <= BYTES_PER_SECTOR; ) {
+      uint32_t len = p[i + 4] | p[i + 5] << 8 | p[i + 6] << 16 | p[i + 7] << 24;
+      if (memcmp(p + i, "fmt ", 4) == 0) {
+        frameBytes = p[i + 8 + 12] | p[i + 8 + 13] << 8;   // block align
+        break;
+      }
+      i += 8 + len + (len & 1);
+    }
+  }
+  uint32_t n = (uint32_t)ceilf((float)READ_BUF_SECTORS * (float)frameBytes * 0.25f);
+  return constrain(n, (uint32_t)RING_MIN_SECTORS / 2, (uint32_t)RING_MAX_SECTORS / 2);
+}
+
+static void scan(SDMMC_FAT32& Card, const fpath_t& path, node_t& dir) {
+  std::vector<entry_t> ents;
+  Card.setCurrentDir(path);
+  Card.prepareChains();
+  Card.rewindDir();
+  for (entry_t* e = Card.nextEntry(); !e->is_end; e = Card.nextEntry()) {
+    if (e->name == "." || e->name == "..") continue;
+    ents.push_back(*e);
+  }
+  Card.dropChains();
+  for (auto& e: ents) {
+    node_t n;
+    n.name = e.name;
+    n.dir = e.is_dir;
+    n.size = n.dir ? 0 : e.size;
+    if (!n.dir && n.size > 0) n.chains = e.sectors;
+    if (!n.dir && strcasecmp(n.name.c_str(), INI_FILE) == 0) dir.set = true;
+    dir.kids.push_back(n);
+  }
+  for (auto& k: dir.kids) {
+    if (!k.dir) continue;
+    fpath_t sub = path;
+    for (const char* c = k.name.c_str(); *c; c++) sub += *c;
+    sub += '/';
+    scan(Card, sub, k);
+  }
+}
+
+static void analyzeSet(SDMMC_FAT32& Card, const fpath_t& path, const node_t& dir, uint32_t align, set_stat_t& total) {
+  set_stat_t st;
+  for (auto& f: dir.kids) {
+    if (f.dir || !isWav(f.name) || f.chains.empty()) continue;
+    uint32_t rs = readSectorsOf(Card, f);
+    uint32_t sectors = (f.size + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+    uint32_t splits = 0, at = 0;
+    for (size_t i = 0; i + 1 < f.chains.size(); i++) {
+      at += f.chains[i].last - f.chains[i].first + 1;
+      if (at < sectors && at % rs != 0) splits++;     // a boundary on a read edge costs nothing extra
+    }
+    st.samples++;
+    st.chains += f.chains.size();
+    if (f.chains.size() > 1) st.fragmented++;
+    if (align > 1 && f.chains[0].first % align != 0) st.unaligned++;
+    st.sectors += sectors;
+    st.reads += (sectors + rs - 1) / rs;
+    st.splits += splits;
+    if (verbose || f.chains.size() > 1) {
+      printf("    %-40s %9u bytes %4u chains %3u sectors/read %4u split reads\n", f.name.c_str(), f.size, (uint32_t)f.chains.size(), rs, splits);
+    }
+  }
+  double costUs = (double)(st.reads + st.splits) * usPerRead + (double)st.sectors * usPerSector;
+  double idealUs = (double)st.reads * usPerRead + (double)st.sectors * usPerSector;
+  printf("  %s: %u samples, %.1f MB, %u fragmented, %u chains, %llu of %llu reads split (+%.2f%%)",
+    path.c_str(), st.samples, st.sectors * BYTES_PER_SECTOR / 1048576.0, st.fragmented, st.chains,
+    (unsigned long long)st.splits, (unsigned long long)st.reads, st.reads ? 100.0 * st.splits / st.reads : 0.0);
+  if (align > 1) printf(", %u not aligned to %u sectors", st.unaligned, align);
+  printf("\n    streaming it all once: %.2f s, %.2f s contiguous, %.1f voices of 16 bit stereo\n",
+    costUs / 1e6, idealUs / 1e6, costUs > 0 ? (double)st.sectors * BYTES_PER_SECTOR / (costUs / 1e6) / (SAMPLE_RATE * 4.0) : 0.0);
+  total.samples += st.samples;
+  total.fragmented += st.fragmented;
+  total.chains += st.chains;
+  total.sectors += st.sectors;
+  total.reads += st.reads;
+  total.splits += st.splits;
+  total.unaligned += st.unaligned;
+}
+
+static void analyzeTree(SDMMC_FAT32& Card, const fpath_t& path, const node_t& dir, uint32_t align, set_stat_t& total, uint32_t& sets) {
+  if (dir.set) {
+    analyzeSet(Card, path, dir, align, total);
+    sets++;
+  }
+  for (auto& k: dir.kids) {
+    if (!k.dir) continue;
+    fpath_t sub = path;
+    for (const char* c = k.name.c_str(); *c; c++) sub += *c;
+    sub += '/';
+    analyzeTree(Card, sub, k, align, total, sets);
+  }
+}
+
+static void analyze(SDMMC_FAT32& Card, const node_t& root, uint32_t align) {
+  set_stat_t total;
+  uint32_t sets = 0;
+  printf("%s, %u sectors per cluster\n", Card.isExFat() ? "exFAT" : "FAT32", Card.getSectorsPerCluster());
+  analyzeTree(Card, "/", root, align, total, sets);
+  printf("total: %u sets, %u samples, %u fragmented, %u chains, %llu split reads of %llu\n", sets, total.samples, total.fragmented, total.chains,
+    (unsigned long long)total.splits, (unsigned long long)total.reads);
+}
+
+// =============================================================== FAT32 image writer ===============================================================
+
+class Fat32Packer {
+  public:
+    Fat32Packer(SDMMC_FAT32& Src, int fd) : _Src(Src), _fd(fd) {};
+    bool      format(uint64_t sectors, uint32_t spc, uint32_t align);
+    bool      pack(node_t& root);
+
+  private:
+    uint32_t  alloc(uint32_t bytes, uint32_t alignSectors);
+    void      place(node_t& dir, bool isRoot);
+    bool      writeDir(node_t& dir, uint32_t self, uint32_t parent);
+    bool      copyFile(const node_t& f);
+    bool      writeTables();
+    bool      put(const void* src, uint64_t sector, uint32_t count);
+    void      dirRecords(node_t& dir, uint32_t self, uint32_t parent, std::vector<sfn_dir_t>& recs);
+    static void makeSfn(const char* name, std::set<std::string>& used, char* sfn, bool& needLfn);
+    inline uint64_t sectorOf(uint32_t cluster) { return _dataStart + (uint64_t)(cluster - 2) * _spc; }
+
+    SDMMC_FAT32&  _Src;
+    int           _fd;
+    uint64_t      _sectors;         // whole image
+    uint32_t      _partStart;
+    uint32_t      _partSectors;
+    uint32_t      _spc;
+    uint32_t      _align;
+    uint32_t      _reserved;
+    uint32_t      _fatSectors;
+    uint64_t      _dataStart;       // absolute sector of cluster 2
+    uint32_t      _clusterCount;
+    uint32_t      _next = 3;        // cluster 2 is the root
+    uint16_t      _date, _time;
+    std::vector<uint32_t> _fat;
+};
+
+bool Fat32Packer::format(uint64_t sectors, uint32_t spc, uint32_t align) {
+  const uint32_t au = 8192;         // 4 MB
+  _sectors = sectors;
+  _spc = spc;
+  _align = max(align, spc);
+  uint32_t dataAlign = max(au, _align);
+  _partStart = au;
+  _partSectors = (uint32_t)min(sectors - _partStart, (uint64_t)0xFFFFFFFF);
+  // the FAT size depends on the cluster count, which depends on the FAT size: iterate till it settles
+  _fatSectors = 1;
+  for (int i = 0; i < 8; i++) {
+    _reserved = 32;
+    uint32_t meta = _reserved + 2 * _fatSectors;
+    uint32_t pad = (dataAlign - (_partStart + meta) % dataAlign) % dataAlign;
+    _reserved += pad;
+    _clusterCount = (_partSectors - _reserved - 2 * _fatSectors) / _spc;
+    _fatSectors = ((_clusterCount + 2) * 4 + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+  }
+  _dataStart = _partStart + _reserved + 2 * _fatSectors;
+  if ((_dataStart % dataAlign) != 0 || _clusterCount < 16) {
+    fprintf(stderr, "fatpack: can't lay out %llu sectors with %u sectors per cluster\n", (unsigned long long)sectors, spc);
+    return false;
+  }
+  if (_clusterCount < 65525) fprintf(stderr, "fatpack: warning: %u clusters is too few for FAT32 by the spec, other systems may refuse it\n", _clusterCount);
+  _fat.assign(_clusterCount + 2, 0);
+  _fat[0] = 0x0FFFFFF8;
+  _fat[1] = 0x0FFFFFFF;
+  time_t now = time(nullptr);
+  struct tm* t = localtime(&now);
+  _date = ((t->tm_year - 80) << 9) | ((t->tm_mon + 1) << 5) | t->tm_mday;
+  _time = (t->tm_hour << 11) | (t->tm_min << 5) | (t->tm_sec / 2);
+  printf("packing: %u clusters of %u sectors, FAT %u sectors, data at sector %llu, files aligned to %u sectors\n",
+    _clusterCount, _spc, _fatSectors, (unsigned long long)_dataStart, _align);
+  return ftruncate(_fd, (off_t)sectors * BYTES_PER_SECTOR) == 0;
+}
+
+uint32_t Fat32Packer::alloc(uint32_t bytes, uint32_t alignSectors) {
+  uint32_t count = max((uint32_t)(((uint64_t)bytes + _spc * BYTES_PER_SECTOR - 1) / (_spc * BYTES_PER_SECTOR)), (uint32_t)1);
+  if (alignSectors > _spc) {
+    uint32_t step = alignSectors / _spc;
+    _next = 2 + ((_next - 2 + step - 1) / step) * step;
+  }
+  if (_next + count > _clusterCount + 2) return 0;
+  uint32_t first = _next;
+  for (uint32_t i = 0; i < count; i++) _fat[first + i] = (i + 1 < count) ? first + i + 1 : 0x0FFFFFFF;
+  _next += count;
+  return first;
+}
+
+void Fat32Packer::makeSfn(const char* name, std::set<std::string>& used, char* sfn, bool& needLfn) {
+  // basis name as Windows makes it: upper case, invalid characters to '_', 8.3 from the last dot, ~N when lossy
+  std::string base, ext;
+  const char* dot = strrchr(name, '.');
+  bool lossy = false;
+  needLfn = false;
+  auto conv = [&](char c) -> char {
+    if (c == ' ' || c == '.') { lossy = true; return 0; }
+    if (strchr("+,;=[]", c) || (uint8_t)c > 126) { lossy = true; return '_'; }
+    if (toupper(c) != c) needLfn = true;
+    return toupper(c);
+  };
+  for (const char* p = name; *p && (dot == nullptr || p < dot); p++) {
+    char c = conv(*p);
+    if (c) base += c;
+  }
+  if (dot) {
+    for (const char* p = dot + 1; *p; p++) {
+      char c = conv(*p);
+      if (c) ext += c;
+    }
+  }
+  if (base.size() > 8 || ext.size() > 3 || (dot == name)) lossy = true;
+  if (base.empty()) base = "_";
+  if (ext.size() > 3) ext.resize(3);
+  memset(sfn, ' ', 11);
+  if (!lossy && used.count(base + "." + ext) == 0) {
+    memcpy(sfn, base.data(), base.size());
+    memcpy(sfn + 8, ext.data(), ext.size());
+    used.insert(base + "." + ext);
+    return;
+  }
+  needLfn = true;
+  for (int n = 1; n < 1000000; n++) {
+    std::string tail = "~" + std::to_string(n);
+    std::string b = base.substr(0, 8 - tail.size()) + tail;
+    if (used.count(b + "." + ext)) continue;
+    memcpy(sfn, b.data(), b.size());
+    memcpy(sfn + 8, ext.data(), ext.size());
+    used.insert(b + "." + ext);
+    return;
+  }
+}
+
+void Fat32Packer::dirRecords(node_t& dir, uint32_t self, uint32_t parent, std::vector<sfn_dir_t>& recs) {
+  std::set<std::string> used;
+  sfn_dir_t d;
+  auto sfnRec = [&](const char* sfn, uint8_t attr, uint32_t cl, uint32_t size) {
+    memset(&d, 0, sizeof(d));
+    memcpy(d.filename, sfn, 11);
+    d.attr = attr;
+    d.create_date = d.access_date = d.mod_date = _date;
+    d.ctime = d.mod_time = _time;
+    d.hi_start = cl >> 16;
+    d.lo_start = cl & 0xFFFF;
+    d.file_nbytes = size;
+    recs.push_back(d);
+  };
+  recs.clear();
+  if (self != 2) {
+    sfnRec(".          ", FAT32_DIR, self, 0);
+    sfnRec("..         ", FAT32_DIR, parent == 2 ? 0 : parent, 0);
+  }
+  for (auto& k: dir.kids) {
+    char sfn[11];
+    bool lfn;
+    makeSfn(k.name.c_str(), used, sfn, lfn);
+    if (lfn) {
+      uint8_t sum = 0;
+      for (int i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)sfn[i];
+      int len = k.name.length();
+      int parts = (len + 1 + 12) / 13;      // with the terminating NUL
+      for (int p = parts; p >= 1; p--) {
+        uint16_t u[13];
+        for (int i = 0; i < 13; i++) {
+          int at = (p - 1) * 13 + i;
+          u[i] = at < len ? (uint8_t)k.name.c_str()[at] : (at == len ? 0x0000 : 0xFFFF);
+        }
+        lfn_dir_t l;
+        memset(&l, 0, sizeof(l));
+        l.seqno = p | (p == parts ? 0x40 : 0);
+        memcpy(l.name1_5, &u[0], 10);
+        l.attr = FAT32_LONG_FILE_NAME;
+        l.cksum = sum;
+        memcpy(l.name6_11, &u[5], 12);
+        memcpy(l.name12_13, &u[11], 4);
+        recs.push_back(*reinterpret_cast<sfn_dir_t*>(&l));
+      }
+    }
+    sfnRec(sfn, k.dir ? FAT32_DIR : FAT32_ARCHIVE, k.size ? k.cluster : (k.dir ? k.cluster : 0), k.dir ? 0 : k.size);
+  }
+}
+
+void Fat32Packer::place(node_t& dir, bool isRoot) {
+  // directories first (they are small and read on every folder change), then the files of this folder
+  // in directory order, then the subfolders, depth first
+  std::vector<sfn_dir_t> recs;
+  for (auto& k: dir.kids) {
+    if (!k.dir) continue;
+    dirRecords(k, 3, 3, recs);            // the count doesn't depend on the clusters
+    uint32_t bytes = recs.size() * DIR_ENTRY_SIZE + DIR_ENTRY_SIZE; // + the end marker
+    k.clusters = (bytes + _spc * BYTES_PER_SECTOR - 1) / (_spc * BYTES_PER_SECTOR);
+    k.cluster = alloc(bytes, 1);
+  }
+  for (auto& k: dir.kids) {
+    if (k.dir || k.size == 0) continue;
+    k.cluster = alloc(k.size, isWav(k.name) ? _align : 1);
+  }
+  for (auto& k: dir.kids) {
+    if (k.dir) place(k, false);
+  }
+}
+
+bool Fat32Packer::writeDir(node_t& dir, uint32_t self, uint32_t parent) {
+  std::vector<sfn_dir_t> recs;
+  dirRecords(dir, self, parent, recs);
+  uint32_t bytes = ((recs.size() * DIR_ENTRY_SIZE) / (_spc * BYTES_PER_SECTOR) + 1) * _spc * BYTES_PER_SECTOR; // + the end marker
+  std::vector<uint8_t> buf(bytes, 0);
+  memcpy(buf.data(), recs.data(), recs.size() * DIR_ENTRY_SIZE);
+  if (!put(buf.data(), sectorOf(self), bytes / BYTES_PER_SECTOR)) return false;
+  for (auto& k: dir.kids) {
+    if (k.dir) {
+      if (!writeDir(k, k.cluster, self)) return false;
+    } else if (k.size > 0) {
+      if (!copyFile(k)) return false;
+    }
+  }
+  return true;
+}
+
+bool Fat32Packer::copyFile(const node_t& f) {
+  const uint32_t chunk = 256;     // sectors
+  std::vector<uint8_t> buf(chunk * BYTES_PER_SECTOR);
+  uint32_t left = (f.size + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+  uint64_t dst = sectorOf(f.cluster);
+  for (auto& ch: f.chains) {
+    for (uint32_t s = ch.first; s <= ch.last && left > 0; ) {
+      uint32_t n = min(min(chunk, ch.last - s + 1), left);
+      if (_Src.read_block(buf.data(), s, n) != ESP_OK || !put(buf.data(), dst, n)) {
+        fprintf(stderr, "fatpack: I/O error copying %s\n", f.name.c_str());
+        return false;
+      }
+      s += n;
+      dst += n;
+      left -= n;
+    }
+  }
+  return left == 0;
+}
+
+bool Fat32Packer::put(const void* src, uint64_t sector, uint32_t count) {
+  return pwrite(_fd, src, (size_t)count * BYTES_PER_SECTOR, (off_t)sector * BYTES_PER_SECTOR) == (ssize_t)count * BYTES_PER_SECTOR;
+}
+
+bool Fat32Packer::writeTables() {
+  uint8_t sec[BYTES_PER_SECTOR];
+  // MBR with a single FAT32 LBA partition
+  memset(sec, 0, sizeof(sec));
+  part_t* part = reinterpret_cast<part_t*>(sec + 446);
+  part->fsType = 0x0C;
+  part->firstSector = _partStart;
+  part->sectorsTotal = _partSectors;
+  part->headStart = part->headEnd = 0xFE;
+  part->cylSectStart = part->cylSectEnd = 0xFFFF;
+  sec[510] = 0x55;
+  sec[511] = 0xAA;
+  if (!put(sec, 0, 1)) return false;
+  // boot sector, and its backup at 6
+  memset(sec, 0, sizeof(sec));
+  uint8_t* b = sec;
+  b[0] = 0xEB; b[1] = 0x58; b[2] = 0x90;
+  memcpy(b + 3, "MSWIN4.1", 8);
+  auto w16 = [&](int at, uint16_t v) { b[at] = v; b[at + 1] = v >> 8; };
+  auto w32 = [&](int at, uint32_t v) { w16(at, v); w16(at + 2, v >> 16); };
+  w16(11, BYTES_PER_SECTOR);
+  b[13] = _spc;
+  w16(14, _reserved);
+  b[16] = 2;
+  b[21] = 0xF8;
+  w16(24, 63);
+  w16(26, 255);
+  w32(28, _partStart);
+  w32(32, _partSectors);
+  w32(36, _fatSectors);
+  w32(44, 2);                     // root cluster
+  w16(48, 1);                     // FSInfo
+  w16(50, 6);                     // backup boot sector
+  b[64] = 0x80;
+  b[66] = 0x29;
+  w32(67, (uint32_t)time(nullptr));
+  memcpy(b + 71, "NO NAME    ", 11);
+  memcpy(b + 82, "FAT32   ", 8);
+  b[510] = 0x55;
+  b[511] = 0xAA;
+  if (!put(sec, _partStart, 1) || !put(sec, _partStart + 6, 1)) return false;
+  // FSInfo, and its backup at 7
+  fsinfo_t fsi;
+  memset(&fsi, 0, sizeof(fsi));
+  fsi.leadSig = 0x41615252;
+  fsi.structSig = 0x61417272;
+  fsi.freeCount = _clusterCount + 2 - _next;
+  fsi.nextFree = _next;
+  fsi.trailSig = 0xAA550000;
+  if (!put(&fsi, _partStart + 1, 1) || !put(&fsi, _partStart + 7, 1)) return false;
+  // both FATs
+  _fat.resize(_fatSectors * BYTES_PER_SECTOR / 4, 0);
+  for (int f = 0; f < 2; f++) {
+    if (!put(_fat.data(), _partStart + _reserved + f * _fatSectors, _fatSectors)) return false;
+  }
+  return true;
+}
+
+bool Fat32Packer::pack(node_t& root) {
+  std::vector<sfn_dir_t> recs;
+  dirRecords(root, 2, 2, recs);
+  uint32_t rootClusters = (recs.size() * DIR_ENTRY_SIZE + DIR_ENTRY_SIZE + _spc * BYTES_PER_SECTOR - 1) / (_spc * BYTES_PER_SECTOR);
+  for (uint32_t i = 0; i < rootClusters; i++) _fat[2 + i] = (i + 1 < rootClusters) ? 3 + i : 0x0FFFFFFF;
+  _next = 2 + rootClusters;
+  place(root, true);
+  std::function<bool(const node_t&)> allPlaced = [&](const node_t& d) {
+    for (auto& k: d.kids) {
+      if ((k.dir || k.size > 0) && k.cluster == 0) return false;
+      if (k.dir && !allPlaced(k)) return false;
+    }
+    return true;
+  };
+  if (!allPlaced(root)) {
+    fprintf(stderr, "fatpack: the files don't fit the image\n");
+    return false;
+  }
+  return writeDir(root, 2, 2) && writeTables();
+}
+
+// =============================================================== main ===============================================================
+
+static void dropIndexFiles(node_t& dir) {
+  for (int i = dir.kids.size() - 1; i >= 0; i--) {
+    if (dir.kids[i].dir) {
+      dropIndexFiles(dir.kids[i]);
+    } else if (strcasecmp(dir.kids[i].name.c_str(), INDEX_FILE) == 0) {
+      dir.kids.erase(dir.kids.begin() + i);
+    }
+  }
+}
+
+static bool openCard(SDMMC_FAT32& Card, FileDevice& Image) {
+  Card.begin(&Image);
+  if (Image.getSectors() == 0) {
+    perror(Image.getPath());
+    return false;
+  }
+  if (Card.ret != ESP_OK) {
+    fprintf(stderr, "%s: no FAT32/exFAT partition\n", Image.getPath());
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  const char* out = nullptr;
+  uint32_t clusterKB = 0, align = 0, sizeMB = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "vm:o:k:a:s:")) != -1) {
+    switch (opt) {
+      case 'v': verbose = true; break;
+      case 'm': sscanf(optarg, "%f,%f", &usPerRead, &usPerSector); break;
+      case 'o': out = optarg; break;
+      case 'k': clusterKB = atoi(optarg); break;
+      case 'a': align = atoi(optarg); break;
+      case 's': sizeMB = atoi(optarg); break;
+      default: optind = argc; break;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-v] [-m us_per_read,us_per_sector] <image>\n"
+                    "       %s -o <packed.img> [-k cluster_KB] [-a align_sectors] [-s size_MB] <image>\n", argv[0], argv[0]);
+    return 1;
+  }
+  SDMMC_FAT32 Card;
+  FileDevice Image(argv[optind]);
+  node_t root;
+  if (!openCard(Card, Image)) return 1;
+  scan(Card, "/", root);
+  if (out == nullptr) {
+    analyze(Card, root, align);
+    return 0;
+  }
+  uint32_t spc = clusterKB ? clusterKB * 2 : min(Card.getSectorsPerCluster(), (uint32_t)128);
+  if (spc == 0 || (spc & (spc - 1)) != 0 || spc > 128) {
+    fprintf(stderr, "fatpack: the cluster size must be a power of two up to 64 KB\n");
+    return 1;
+  }
+  if (align && align % spc != 0) {
+    fprintf(stderr, "fatpack: the alignment must be a multiple of the cluster (%u sectors)\n", spc);
+    return 1;
+  }
+  dropIndexFiles(root);
+  int fd = open(out, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(out);
+    return 1;
+  }
+  Fat32Packer Packer(Card, fd);
+  uint64_t sectors = sizeMB ? (uint64_t)sizeMB * 2048 : Image.getSectors();
+  bool ok = Packer.format(sectors, spc, align ? align : spc) && Packer.pack(root);
+  close(fd);
+  if (!ok) return 1;
+  SDMMC_FAT32 Packed;
+  FileDevice PackedImage(out);
+  node_t packedRoot;
+  if (!openCard(Packed, PackedImage)) return 1;
+  scan(Packed, "/", packedRoot);
+  analyze(Packed, packedRoot, align);
+  return 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+// The block device of the host tools: 512 byte sectors of a disk image, or of a real card in a card reader
+// (/dev/sdX, /dev/mmcblkN), opened with O_DIRECT so that the page cache doesn't hide the card.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include "block_device.h"
+
+class FileDevice : public BlockDevice {
+  public:
+    FileDevice(const char* path, bool writable = false, bool direct = false) : _path(path), _writable(writable), _direct(direct) {};
+    ~FileDevice()                       { end(); }
+    esp_err_t begin() {
+      int flags = (_writable ? O_RDWR : O_RDONLY);
+#ifdef O_DIRECT
+      if (_direct) flags |= O_DIRECT;
+#endif
+      _fd = open(_path, flags);
+      if (_fd < 0) return ESP_FAIL;
+      off_t size = lseek(_fd, 0, SEEK_END);
+      _sectors = size > 0 ? (uint64_t)size / BYTES_PER_SECTOR : 0;
+      DEBF("Image: %llu sectors\r\n", (unsigned long long)_sectors);
+      return ESP_OK;
+    }
+    void end() {
+      if (_fd >= 0) close(_fd);
+      _fd = -1;
+    }
+    uint32_t  getSectors()              { return (uint32_t)min(_sectors, (uint64_t)UINT32_MAX); }
+    const char* getPath()               { return _path; }
+
+  protected:
+    esp_err_t readSectors(void* dst, uint32_t sector, uint32_t count) {
+      ssize_t n = pread(_fd, dst, (size_t)count * BYTES_PER_SECTOR, (off_t)sector * BYTES_PER_SECTOR);
+      return (n == (ssize_t)count * BYTES_PER_SECTOR) ? ESP_OK : ESP_FAIL;
+    }
+    esp_err_t writeSectors(const void* src, uint32_t sector, uint32_t count) {
+      ssize_t n = pwrite(_fd, src, (size_t)count * BYTES_PER_SECTOR, (off_t)sector * BYTES_PER_SECTOR);
+      return (n == (ssize_t)count * BYTES_PER_SECTOR) ? ESP_OK : ESP_FAIL;
+    }
+
+  private:
+    const char* _path;
+    bool      _writable;
+    bool      _direct;
+    int       _fd       = -1;
+    uint64_t  _sectors  = 0;
+};
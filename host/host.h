@@ -0,0 +1,13 @@
+#pragma once
+// Common part of the host tools: the sketch configuration and the FAT layer, built as one unit the way
+// the Arduino IDE builds the .ino files.
+
+#include <Arduino.h>
+#include <getopt.h>
+#include "config.h"
+#include "misc.h"
+#include "sdmmc.h"
+#include "file_device.h"
+#include "sdmmc.ino"
+
+HostSerial Serial;
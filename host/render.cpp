@@ -0,0 +1,602 @@
+// Offline renderer: plays a Standard MIDI File through the sampler engine (SamplerEngine, Voice, Adsr,
+// FxReverb and the mixer of the sketch) into a 16 bit stereo WAV file, as fast as the host can do it.
+//
+//   render [-f folder] [-c channel] [-o out.wav] [-m us_per_read,us_per_sector] [-t tail_s] [-i interval_ms] [-q interpolation] [-u budget_us] [-a alloc] [-b budget_%] [-r ref.wav[,max_lsb]] [-s] [-k block[,dma_buffers]] [-j] <image> <song.mid>
+//   render -e
+//   render -l
+//
+//   -f   sample set: its number in the root folder (0 by default) or its name
+//   -c   MIDI channel to listen to, RECEIVE_MIDI_CHAN by default, 0 = all of them
+//   -o   output file, render.wav by default
+//   -m   card timing model: every card read costs us_per_read + sectors * us_per_sector of the control core,
+//        which gets one audio block of time per block, so a slow card underruns here like it does on the board.
+//        Without it the reads are free and only the engine is measured. Take the numbers from sd_bench.
+//   -t   seconds rendered after the last event, 3 by default
+//   -i   voice count and I/O report interval, 1000 ms of the song by default
+//   -q   best interpolation: 0 nearest, 1 linear, 2 hermite, 3 sinc, INTERP_QUALITY by default
+//   -u   voice rendering budget per block in us for the interpolation governor, 0 = none; the host is much faster
+//        than the board, so a few us make it step the voices down like RENDER_BUDGET does there
+//   -a   voice to steal when the polyphony runs out: 0 oldest, 1 most quiet, 2 perceptual (default); the SAMPLER line
+//        at the end tells how many steals there were and how loud the stolen voices were
+//   -b   bandwidth admission budget, percent of the card throughput the streaming voices may take, 0 = admit every note;
+//        ADMISSION_BUDGET by default. With -m the throughput is the one of the model, otherwise the reads are so fast
+//        here that every note goes; the SAMPLER admission line tells how many notes made room or were refused
+//   -r   compare the output with another render, e.g. the float engine one for a FIXED_POINT_ENGINE build
+//        (make check does both): prints the max and RMS error in 16 bit LSBs, the exit code is 2 if the max is above max_lsb
+//   -s   mix the blocks the way the sketch did before the fused mixer(): the voices into a stereo mix buffer with the
+//        clipper, then a pass packing the 16 bit frames. For the time of the mix stage and of the whole block (the
+//        delay from the start of the block to the frames ready for I2S), with -r on a render without it for the output
+//   -k   audio block length and I2S DMA buffers, instead of the ones of the sample set (sampler.ini block_size and
+//        dma_buffers, DMA_BUF_LEN x DMA_NUM_BUF by default). The note-on latency line at the end is the time from
+//        a note-on to its first sample at the DAC: the block that plays it, the DMA queue, and the notes that had
+//        to wait for a voice; the jitter is its standard deviation
+//   -j   the MIDI events take effect at the start of the block after them, like without SAMPLE_ACCURATE_MIDI, to compare
+//        the latency and the jitter
+//   -e   no rendering, checks Adsr::processBlock() of the voices against the per sample Adsr::process() over a grid
+//        of envelopes and block sizes, the exit code is 2 if they differ
+//   -l   no rendering, checks the loop cache seams: a sine looped in the middle, as a whole sample (ini LOOP = true)
+//        and up to the last frame; the exit code is 2 if a loop steps more than the sine does
+//
+// The two cores of the board are interleaved here: before every block of samples the MIDI events that came
+// in during the block before are dispatched and the control task work is done (freeSomeVoices() and fillBuffer() until nothing
+// needs the card), then the block is generated and mixed the way the audio task does it.
+
+#include "host.h"
+#include <string>
+
+// the stamps of the engine are in the audio time: the event time of the song, the start of a block for the audio task,
+// and a block is out when it's over
+static uint32_t renderClockUs = 0;
+#define LATENCY_CLOCK()     renderClockUs
+#undef MIDI_VIA_SERIAL2             // no MIDI ports, the events come from the file
+#include "sampler.h"
+#include "fx_reverb.h"
+
+SamplerEngine   Sampler;
+FxReverb        Reverb;
+
+// the buffers of ESP32_SD_Sampler.ino that the mixer works on
+static mix_t WORD_ALIGNED_ATTR sampler_l[MAX_BLOCK_LEN];
+static mix_t WORD_ALIGNED_ATTR sampler_r[MAX_BLOCK_LEN];
+static int16_t WORD_ALIGNED_ATTR out_buf[MAX_BLOCK_LEN * 2];
+
+#include "adsr.ino"
+#include "head_cache.ino"
+#include "loop_cache.ino"
+#include "midi_handler.ino"
+#include "mixer.ino"
+#include "ring_arena.ino"
+#include "sampler.ino"
+#include "sampler_index.ino"
+#include "sampler_ini.ino"
+#include "sdmmc_file.ino"
+#include "sector_cache.ino"
+#include "voice.ino"
+
+// the three stage mix of before (-s): sampler_l/r -> mix_buf_l/r -> out_buf, with the stereo reverb bus
+static mix_t WORD_ALIGNED_ATTR mix_buf_l[MAX_BLOCK_LEN];
+static mix_t WORD_ALIGNED_ATTR mix_buf_r[MAX_BLOCK_LEN];
+
+static void mixerStaged(int n) {
+  const gain_t attenuator = GAIN(0.5f);
+  const gain_t reverbSend = GAIN(Sampler.getReverbSendLevel());
+  const gain_t master = GAIN(0.6f);
+  mix_t rvb_l[MAX_BLOCK_LEN], rvb_r[MAX_BLOCK_LEN];
+  for (int i = 0; i < n; i++) {
+    rvb_l[i] = mixMul(mixMul(sampler_l[i], attenuator), reverbSend);
+    rvb_r[i] = mixMul(mixMul(sampler_r[i], attenuator), reverbSend);
+  }
+  Reverb.ProcessBlock(rvb_l, rvb_r, n);
+  for (int i = 0; i < n; i++) {
+    mix_t l = mixAdd(mixMul(sampler_l[i], attenuator), rvb_l[i]);
+    mix_t r = mixAdd(mixMul(sampler_r[i], attenuator), rvb_r[i]);
+    mix_buf_l[i] = mixClamp(mixMul(l, master));
+    mix_buf_r[i] = mixClamp(mixMul(r, master));
+  }
+  for (int i = 0; i < n; i++) {
+    out_buf[i * 2] = mixToInt16(mix_buf_l[i]);
+    out_buf[i * 2 + 1] = mixToInt16(mix_buf_r[i]);
+  }
+}
+
+// =============================================================== Standard MIDI File ===============================================================
+
+typedef struct {
+  uint64_t  tick;
+  uint32_t  order;          // position in the file, keeps the events of the same tick in their order
+  uint32_t  tempo;          // us per quarter note for tempo events, 0 for channel messages
+  uint8_t   status;
+  uint8_t   d1;
+  uint8_t   d2;
+  uint64_t  frame;          // output sample the event is due at
+} midi_event_t;
+
+static uint32_t readBE(const uint8_t* p, int n) {
+  uint32_t v = 0;
+  for (int i = 0; i < n; i++) v = v << 8 | p[i];
+  return v;
+}
+
+static bool readVarLen(const uint8_t*& p, const uint8_t* end, uint32_t& v) {
+  v = 0;
+  for (int i = 0; i < 4 && p < end; i++) {
+    v = v << 7 | (*p & 0x7F);
+    if ((*p++ & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+static bool loadMidiFile(const char* path, std::vector<midi_event_t>& events) {
+  FILE* f = fopen(path, "rb");
+  if (f == nullptr) {
+    perror(path);
+    return false;
+  }
+  std::vector<uint8_t> buf;
+  uint8_t chunk[65536];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) buf.insert(buf.end(), chunk, chunk + n);
+  fclose(f);
+  const uint8_t* p = buf.data();
+  const uint8_t* end = p + buf.size();
+  if (buf.size() < 14 || memcmp(p, "MThd", 4) != 0) {
+    fprintf(stderr, "%s: not a Standard MIDI File\n", path);
+    return false;
+  }
+  uint32_t headerLen = readBE(p + 4, 4);
+  uint32_t tracks = readBE(p + 10, 2);
+  uint32_t division = readBE(p + 12, 2);
+  p += 8 + headerLen;
+  uint32_t order = 0;
+  for (uint32_t t = 0; t < tracks && p + 8 <= end; t++) {
+    uint32_t len = readBE(p + 4, 4);
+    const uint8_t* q = p + 8;
+    const uint8_t* trackEnd = min(q + len, end);
+    bool isTrack = memcmp(p, "MTrk", 4) == 0;
+    p = trackEnd;
+    if (!isTrack) continue;
+    uint64_t tick = 0;
+    uint8_t status = 0;
+    while (q < trackEnd) {
+      uint32_t delta, size;
+      if (!readVarLen(q, trackEnd, delta)) break;
+      tick += delta;
+      if (q >= trackEnd) break;
+      if (*q == 0xFF) {                             // meta event, only the tempo matters
+        if (q + 2 > trackEnd) break;
+        uint8_t type = q[1];
+        q += 2;
+        if (!readVarLen(q, trackEnd, size) || q + size > trackEnd) break;
+        if (type == 0x51 && size == 3) events.push_back({tick, order++, readBE(q, 3), 0, 0, 0, 0});
+        if (type == 0x2F) break;                    // end of track
+        q += size;
+        continue;
+      }
+      if (*q == 0xF0 || *q == 0xF7) {               // sysex
+        q++;
+        if (!readVarLen(q, trackEnd, size)) break;
+        q += size;
+        continue;
+      }
+      if (*q & 0x80) status = *q++;                 // otherwise it's the running status
+      if (status < 0x80) break;
+      uint8_t type = status & 0xF0;
+      int dataLen = (type == 0xC0 || type == 0xD0) ? 1 : 2;
+      if (q + dataLen > trackEnd) break;
+      events.push_back({tick, order++, 0, status, q[0], (uint8_t)(dataLen > 1 ? q[1] : 0), 0});
+      q += dataLen;
+    }
+  }
+  std::stable_sort(events.begin(), events.end(), [](const midi_event_t& a, const midi_event_t& b) {
+    return a.tick != b.tick ? a.tick < b.tick : a.order < b.order;
+  });
+  // ticks to output samples along the tempo map
+  double usPerTick;
+  bool smpte = (division & 0x8000) != 0;
+  if (smpte) {
+    usPerTick = 1000000.0 / ((double)(256 - (division >> 8)) * (double)(division & 0xFF));
+  } else {
+    usPerTick = 500000.0 / (double)max(division, (uint32_t)1);
+  }
+  double us = 0.0;
+  uint64_t lastTick = 0;
+  for (auto& e: events) {
+    us += (double)(e.tick - lastTick) * usPerTick;
+    lastTick = e.tick;
+    e.frame = (uint64_t)(us * 1e-6 * (double)SAMPLE_RATE + 0.5);
+    if (e.tempo && !smpte) usPerTick = (double)e.tempo / (double)max(division, (uint32_t)1);
+  }
+  return true;
+}
+
+static void dispatch(const midi_event_t& e, int channel) {
+  if (e.tempo) return;
+  uint8_t chan = (e.status & 0x0F) + 1;
+  if (channel > 0 && chan != channel) return;
+  switch (e.status & 0xF0) {
+    case 0x90:
+      if (e.d2 > 0) {
+        handleNoteOn(chan, e.d1, e.d2);
+        break;
+      }
+      // fall through, velocity 0 is a note off
+    case 0x80:
+      handleNoteOff(chan, e.d1, e.d2);
+      break;
+    case 0xB0:
+      handleCC(chan, e.d1, e.d2);
+      break;
+    case 0xC0:
+      handleProgramChange(chan, e.d1);
+      break;
+    case 0xE0:
+      handlePitchBend(chan, (int)(e.d2 << 7 | e.d1) - 8192);
+      break;
+  }
+}
+
+// =============================================================== render ===============================================================
+
+static uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t nowUs() {
+  return nowNs() / 1000;
+}
+
+// Adsr::processBlock() against as many Adsr::process() calls: every combination of the times and sustain levels,
+// in blocks of varying length (the voices also play the ends of their blocks sample by sample), the note off
+// and the fast ends between two blocks, like the commands of Core0 come
+static bool checkEnvelopes() {
+  const float times[] = {0.0f, 0.0002f, 0.01f, 0.3f, 2.0f};
+  const float levels[] = {0.0f, 0.4f, 1.0f};
+  const Adsr::eEnd_t ends[] = {Adsr::END_REGULAR, Adsr::END_SEMI_FAST, Adsr::END_FAST};
+  const int blockSizes[] = {DMA_BUF_LEN, DMA_BUF_LEN, 23, 1, DMA_BUF_LEN - 1, 40, MAX_BLOCK_LEN};
+  const int noteOff = SAMPLE_RATE / 4 + 17;
+  const int maxFrames = 3 * SAMPLE_RATE;
+  float blk[MAX_BLOCK_LEN];
+  uint32_t envelopes = 0, segmentErrors = 0;
+  uint64_t samples = 0;
+  float maxErr = 0.0f;
+  for (float a: times) for (float d: times) for (float r: times) for (float s: levels) for (Adsr::eEnd_t e: ends) {
+    Adsr blockEnv, sampleEnv;
+    for (Adsr* env: {&blockEnv, &sampleEnv}) {
+      env->init(SAMPLE_RATE);
+      env->setAttackTime(a);
+      env->setDecayTime(d);
+      env->setSustainLevel(s);
+      env->setReleaseTime(r);
+      env->retrigger(Adsr::END_NOW);
+    }
+    envelopes++;
+    int frame = 0, k = 0;
+    while (frame < maxFrames && !(frame > noteOff && blockEnv.isIdle() && sampleEnv.isIdle())) {
+      int n = blockSizes[k++ % (sizeof(blockSizes) / sizeof(blockSizes[0]))];
+      if (frame < noteOff) n = min(n, noteOff - frame);
+      blockEnv.processBlock(blk, n);
+      for (int i = 0; i < n; i++) maxErr = max(maxErr, fabsf(blk[i] - sampleEnv.process()));
+      if (blockEnv.getCurrentSegment() != sampleEnv.getCurrentSegment()) segmentErrors++;
+      frame += n;
+      samples += n;
+      if (frame == noteOff) {
+        blockEnv.end(e);
+        sampleEnv.end(e);
+      }
+    }
+  }
+  bool ok = maxErr <= 1e-6f && segmentErrors == 0;
+  printf("RENDER: envelope check: %u envelopes, %llu samples, max difference %g, segment mismatches %u: %s\n", envelopes,
+    (unsigned long long)samples, maxErr, segmentErrors, ok ? "OK" : "FAILED");
+  return ok;
+}
+
+// a 16 bit stereo sine whose period doesn't fit any of the loops a whole number of times, captured by the loop cache
+// the way the voices stream it: a loop in the middle, the whole sample (ini LOOP = true), loops ending on the last
+// frame and a few frames before it. Played round, seam included, a loop body steps from frame to frame like the sine
+static bool checkLoops() {
+  const int frames = 20000;
+  const float period = 100.37f, amp = 16000.0f;
+  const int32_t ranges[][2] = {{2000, 15000}, {-1, -1}, {5000, frames - 1}, {10, frames - 1}, {3000, frames - 20}};
+  std::vector<uint8_t> file(sizeof(wav_header_t) + frames * 4 + 2 * BYTES_PER_SECTOR, 0);
+  int16_t* pcm = (int16_t*)(file.data() + sizeof(wav_header_t));
+  for (int i = 0; i < frames; i++) pcm[2 * i] = pcm[2 * i + 1] = (int16_t)lroundf(amp * sinf(TWO_PI * (float)i / period));
+  const float sineStep = amp * 2.0f * sinf(PI / period);
+  LoopCache cache;
+  cache.init(1024 * 1024);
+  bool ok = true;
+  for (uint32_t k = 0; k < sizeof(ranges) / sizeof(ranges[0]); k++) {
+    sample_t smp;
+    smp.channels = 2;
+    smp.bit_depth = 16;
+    smp.data_size = frames * 4;
+    smp.loop_mode = 1;
+    smp.loop_first_smp = ranges[k][0];
+    smp.loop_last_smp = ranges[k][1];
+    smp.sectors.push_back({k + 1, k + 1});    // the key of the entry
+    int id = cache.add(smp);
+    const uint8_t* body = nullptr;
+    for (uint32_t b = 0; id >= 0 && body == nullptr && b + BYTES_PER_SECTOR <= file.size(); b += BYTES_PER_SECTOR) {
+      body = cache.capture(id, k + 1, b, file.data() + b, BYTES_PER_SECTOR);
+    }
+    if (body == nullptr) {
+      printf("RENDER: loop check: frames %d..%d not cached: FAILED\n", ranges[k][0], ranges[k][1]);
+      ok = false;
+      continue;
+    }
+    const int16_t* s = (const int16_t*)body;
+    const int n = cache.getBytes(id) / 4;
+    int maxStep = 0;
+    for (int i = 0; i < n; i++) maxStep = max(maxStep, abs((int)s[2 * ((i + 1) % n)] - (int)s[2 * i]));
+    int seam = abs((int)s[0] - (int)s[2 * (n - 1)]);
+    bool guard = true;
+    for (int i = 0; i < RING_GUARD_BYTES; i++) guard = guard && body[cache.getBytes(id) + i] == body[i % cache.getBytes(id)];
+    bool loopOk = guard && (float)maxStep <= 1.25f * sineStep;
+    int first = (cache.getStart(id) - smp.byte_offset) / 4;
+    printf("RENDER: loop check: frames %d..%d loop %d..%d, crossfade %u at the %s, seam step %d, max step %d (sine %.0f)%s: %s\n",
+      ranges[k][0], ranges[k][1], first, first + n - 1, cache.getXfade(id), cache.getStartXfade(id) ? "start" : "end", seam, maxStep,
+      sineStep, guard ? "" : ", guard differs", loopOk ? "OK" : "FAILED");
+    ok = ok && loopOk;
+  }
+  return ok;
+}
+
+// both files are renders, so the same header and length if they come from the same song
+static bool compareWav(const char* path, const char* refPath, int maxLsb) {
+  FILE* a = fopen(path, "rb");
+  FILE* b = fopen(refPath, "rb");
+  if (a == nullptr || b == nullptr) {
+    perror(a ? refPath : path);
+    if (a) fclose(a);
+    if (b) fclose(b);
+    return false;
+  }
+  fseek(a, sizeof(wav_header_t), SEEK_SET);
+  fseek(b, sizeof(wav_header_t), SEEK_SET);
+  int16_t sa, sb;
+  uint64_t n = 0, over = 0, at = 0;
+  int maxErr = 0;
+  double sq = 0.0;
+  while (fread(&sa, 2, 1, a) == 1 && fread(&sb, 2, 1, b) == 1) {
+    int e = abs((int)sa - (int)sb);
+    if (e > maxErr) {
+      maxErr = e;
+      at = n;
+    }
+    if (e > maxLsb) over++;
+    sq += (double)e * e;
+    n++;
+  }
+  bool sameLength = feof(a) && fread(&sb, 2, 1, b) == 0;
+  fclose(a);
+  fclose(b);
+  printf("RENDER: vs %s: %llu samples, max error %d LSB at %.3f s, RMS %.3f LSB, %llu samples above %d LSB%s\n", refPath,
+    (unsigned long long)n, maxErr, (double)(at / 2) / SAMPLE_RATE, n ? sqrt(sq / n) : 0.0, (unsigned long long)over, maxLsb,
+    sameLength ? "" : ", the lengths differ");
+  return sameLength && maxErr <= maxLsb;
+}
+
+static bool hasSampleSets(SDMMC_FAT32& Card) {
+  std::vector<fname_t> dirs;
+  Card.setCurrentDir(ROOT_FOLDER);
+  Card.listCurrentDir(dirs, true);
+  for (auto& d: dirs) {
+    Card.setCurrentDir(ROOT_FOLDER);
+    Card.setCurrentDir(d);
+    if (Card.findEntry(INI_FILE)->is_end == 0) return true;
+  }
+  return false;
+}
+
+int main(int argc, char** argv) {
+  const char* folder = "0";
+  const char* outPath = "render.wav";
+  int channel = RECEIVE_MIDI_CHAN;
+  float usPerRead = 0.0f, usPerSector = 0.0f;
+  bool model = false;
+  float tail = 3.0f;
+  uint32_t intervalMs = 1000;
+  int quality = -1;
+  int64_t budgetUs = -1;
+  const char* refPath = nullptr;
+  int maxLsb = 0;
+  int alloc = -1;
+  int admitBudget = -1;
+  bool envCheck = false;
+  bool loopCheck = false;
+  bool staged = false;
+  int blockArg = 0, dmaArg = 0;
+  bool blockStart = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:c:o:m:t:i:q:u:a:b:r:sk:jel")) != -1) {
+    switch (opt) {
+      case 'f': folder = optarg; break;
+      case 'c': channel = atoi(optarg); break;
+      case 'o': outPath = optarg; break;
+      case 'm': model = sscanf(optarg, "%f,%f", &usPerRead, &usPerSector) == 2; break;
+      case 't': tail = atof(optarg); break;
+      case 'i': intervalMs = max(atoi(optarg), 1); break;
+      case 'q': quality = constrain(atoi(optarg), 0, INTERP_TIERS - 1); break;
+      case 'u': budgetUs = max(atoi(optarg), 0); break;
+      case 'a': alloc = constrain(atoi(optarg), 0, VA_NUMBER - 1); break;
+      case 'b': admitBudget = max(atoi(optarg), 0); break;
+      case 's': staged = true; break;
+      case 'k': sscanf(optarg, "%d,%d", &blockArg, &dmaArg); break;
+      case 'j': blockStart = true; break;
+      case 'e': envCheck = true; break;
+      case 'l': loopCheck = true; break;
+      case 'r':
+        refPath = strtok(optarg, ",");
+        if (const char* lsb = strtok(nullptr, ",")) maxLsb = max(atoi(lsb), 0);
+        break;
+      default: optind = argc; break;
+    }
+  }
+  if (envCheck) return checkEnvelopes() ? 0 : 2;
+  if (loopCheck) return checkLoops() ? 0 : 2;
+  if (optind + 2 > argc) {
+    fprintf(stderr, "usage: %s [-f folder] [-c channel] [-o out.wav] [-m us_per_read,us_per_sector] [-t tail_s] [-i interval_ms] [-q interpolation] [-u budget_us] [-a alloc] [-b budget_%%] [-r ref.wav[,max_lsb]] [-s] [-k block[,dma_buffers]] [-j] <image> <song.mid>\n       %s -e\n       %s -l\n", argv[0], argv[0], argv[0]);
+    return 1;
+  }
+  std::vector<midi_event_t> events;
+  if (!loadMidiFile(argv[optind + 1], events)) return 1;
+
+  FileDevice Image(argv[optind]);
+  SDMMC_FAT32 Card;
+  Card.begin(&Image);
+  if (Image.getSectors() == 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if (Card.ret != ESP_OK || !hasSampleSets(Card)) {
+    fprintf(stderr, "%s: no FAT32/exFAT partition with sample sets\n", argv[optind]);
+    return 1;
+  }
+  Reverb.Init();
+  Sampler.init(&Card);
+  if (quality >= 0) Sampler.setInterpolation((eInterp_t)quality);
+  if (alloc >= 0) Sampler.setVoiceAllocMethod((eVoiceAlloc_t)alloc);
+  if (admitBudget >= 0) Sampler.setAdmissionBudget(admitBudget);
+  if (blockStart) Sampler.setSampleAccurate(false);
+  if (model) Sampler.setCardRate((float)(READ_BUF_SECTORS * BYTES_PER_SECTOR) / (usPerRead + READ_BUF_SECTORS * usPerSector));
+  int sets = Sampler.scanRootFolder();
+  int folderId = -1;
+  for (int i = 0; i < sets; i++) {
+    if (strcasecmp(Sampler.getFolderName(i).c_str(), folder) == 0) folderId = i;
+  }
+  if (folderId < 0) folderId = constrain(atoi(folder), 0, sets - 1);
+  uint64_t t0 = nowUs();
+  Sampler.setCurrentFolder(folderId);
+  uint64_t loadUs = nowUs() - t0;
+  // what the audio task does when the block changes, then -u is the budget of this block
+  if (blockArg > 0) Sampler.setAudioBlock(blockArg, dmaArg > 0 ? dmaArg : Sampler.getDmaBufs());
+  const int blockLen = Sampler.getBlockLen();
+  const int dmaBufs = Sampler.getDmaBufs();
+  Sampler.blockChanged(blockLen, dmaBufs);
+  if (budgetUs >= 0) Sampler.setRenderBudget(budgetUs);
+  Reverb.SetLevel(0.5f);
+  Reverb.SetTime(0.7f);
+  Sampler.setReverbSendLevel(0.5f);
+
+  FILE* out = fopen(outPath, "wb");
+  if (out == nullptr) {
+    perror(outPath);
+    return 1;
+  }
+  wav_header_t wav;
+  fwrite(&wav, sizeof(wav), 1, out);
+
+  const float blockUs = (float)blockLen * US_PER_SAMPLE;
+  const uint64_t lastFrame = (events.empty() ? 0 : events.back().frame) + (uint64_t)(tail * SAMPLE_RATE);
+  const uint64_t intervalFrames = (uint64_t)intervalMs * SAMPLE_RATE / 1000;
+  std::vector<uint64_t> voiceBlocks(MAX_POLYPHONY + 1, 0);   // blocks rendered with that many active voices
+  uint64_t engineUs = 0, controlUs = 0, voicesNs = 0, mixNs = 0, blocks = 0, voiceSum = 0;
+  uint64_t readyNsMax = 0;
+  uint64_t ivBlocks = 0, ivVoices = 0, ivReads = 0, ivSectors = 0;
+  int ivMax = 0, peak = 0;
+  float credit = 0.0f, cardUs = 0.0f;
+  size_t next = 0;
+  Image.resetStats();
+  printf("\nRENDER: %s, %d events, %.1f s, sample set %d <%s> loaded in %.1f ms, %s engine\n", argv[optind + 1], (int)events.size(),
+    (double)lastFrame / SAMPLE_RATE, folderId, Sampler.getCurrentFolder().c_str(), loadUs / 1000.0, ENGINE_NAME);
+  printf("  time s   voices avg  max   reads  MB read\n");
+  t0 = nowUs();
+  for (uint64_t frame = 0; frame < lastFrame; frame += blockLen) {
+    uint64_t t1 = nowUs();
+    while (next < events.size() && events[next].frame < frame) {  // Core1 got them while Core0 played the block before
+      renderClockUs = (uint32_t)((double)events[next].frame * US_PER_SAMPLE);
+      dispatch(events[next++], channel);
+    }
+    credit = model ? min(credit + blockUs, blockUs) : 1e30f;
+    while (credit > 0.0f) {
+      uint32_t reads = Image.getReads();
+      uint64_t sectors = Image.getReadSectors();
+      Sampler.freeSomeVoices();
+      Sampler.fillBuffer();
+      if (Image.getReads() == reads) break;                 // nothing needed the card
+      float cost = (float)(Image.getReads() - reads) * usPerRead + (float)(Image.getReadSectors() - sectors) * usPerSector;
+      credit -= cost;
+      cardUs += cost;
+    }
+    uint64_t t2 = nowUs();
+    uint64_t n1 = nowNs();
+    renderClockUs = (uint32_t)((double)frame * US_PER_SAMPLE);
+    sampler_generate_buf(blockLen);
+    uint64_t n2 = nowNs();
+    if (staged) mixerStaged(blockLen); else mixer(blockLen);
+    uint64_t n3 = nowNs();
+    // the block is written when the one before is over, at frame + blockLen, and the DMA queue is in front of it like on the board
+    Sampler.blockOut((uint32_t)((double)(frame + (uint64_t)dmaBufs * blockLen) * US_PER_SAMPLE));
+    voicesNs += n2 - n1;
+    mixNs += n3 - n2;
+    readyNsMax = max(readyNsMax, n3 - n1);
+    fwrite(out_buf, blockLen * 2 * sizeof(int16_t), 1, out);
+    uint64_t t3 = nowUs();
+    controlUs += t2 - t1;
+    engineUs += t3 - t2;
+    int voices = Sampler.getActiveVoices();
+    voiceBlocks[voices]++;
+    voiceSum += voices;
+    peak = max(peak, voices);
+    blocks++;
+    ivBlocks++;
+    ivVoices += voices;
+    ivMax = max(ivMax, voices);
+    if ((frame + blockLen) / intervalFrames != frame / intervalFrames || frame + blockLen >= lastFrame) {
+      printf("%8.1f   %10.1f %4d %7u %8.2f\n", (double)(frame + blockLen) / SAMPLE_RATE, (double)ivVoices / ivBlocks, ivMax,
+        Image.getReads() - (uint32_t)ivReads, (Image.getReadSectors() - ivSectors) * BYTES_PER_SECTOR / 1048576.0);
+      ivReads = Image.getReads();
+      ivSectors = Image.getReadSectors();
+      ivBlocks = ivVoices = 0;
+      ivMax = 0;
+    }
+  }
+  uint64_t wallUs = nowUs() - t0;
+  uint32_t dataBytes = (uint32_t)(blocks * blockLen * 2 * sizeof(int16_t));
+  wav.dataSize = dataBytes;
+  wav.fileSize = dataBytes + sizeof(wav) - 8;
+  fseek(out, 0, SEEK_SET);
+  fwrite(&wav, sizeof(wav), 1, out);
+  fclose(out);
+
+  double audioS = (double)(blocks * blockLen) / SAMPLE_RATE;
+  double mb = Image.getReadSectors() * BYTES_PER_SECTOR / 1048576.0;
+  printf("\nRENDER: %.1f s of audio in %.2f s, %.1fx realtime (engine %.1f%%, control %.1f%% of the time), %.1f us per %d sample block\n",
+    audioS, wallUs / 1e6, wallUs ? audioS * 1e6 / wallUs : 0.0, 100.0 * engineUs / max(wallUs, (uint64_t)1), 100.0 * controlUs / max(wallUs, (uint64_t)1),
+    blocks ? (double)engineUs / blocks : 0.0, blockLen);
+  printf("RENDER: voice rendering %.2f us per block, %.3f us per voice and block, that's %.0f voices in a block time\n",
+    blocks ? voicesNs / 1000.0 / blocks : 0.0, voiceSum ? voicesNs / 1000.0 / voiceSum : 0.0, voicesNs ? blockUs * voiceSum * 1000.0 / voicesNs : 0.0);
+  printf("RENDER: %s mix %.2f us per block (%.1f ns per frame), the frames are ready %.2f us after the block starts, %.2f at most\n",
+    staged ? "three stage" : "fused", blocks ? mixNs / 1000.0 / blocks : 0.0, blocks ? (double)mixNs / blocks / blockLen : 0.0,
+    blocks ? (voicesNs + mixNs) / 1000.0 / blocks : 0.0, readyNsMax / 1000.0);
+  printf("RENDER: note-on latency, block %d x %d DMA buffers (%.2f ms), %s: %u notes, 50%% %.2f ms, 90%% %.2f, 99%% %.2f, max %.2f ms, jitter %.3f ms\n",
+    blockLen, dmaBufs, blockUs * 0.001f, Sampler.getSampleAccurate() ? "sample accurate" : "at the block start", Sampler.getLatencyNotes(),
+    Sampler.getLatencyMs(0.5f), Sampler.getLatencyMs(0.9f), Sampler.getLatencyMs(0.99f), Sampler.getLatencyMs(1.0f), Sampler.getJitterMs());
+  printf("RENDER: voices avg %.2f, peak %d of %d; time share by voice count:", blocks ? (double)voiceSum / blocks : 0.0, peak, MAX_POLYPHONY);
+  for (int i = 0; i <= peak; i++) printf(" %d:%.1f%%", i, 100.0 * voiceBlocks[i] / max(blocks, (uint64_t)1));
+  printf("\nRENDER: I/O %u reads, %.2f MB (%.2f MB per audio second), %.1f sectors per read", Image.getReads(), mb, audioS > 0 ? mb / audioS : 0.0,
+    Image.getReads() ? (double)Image.getReadSectors() / Image.getReads() : 0.0);
+  if (model) printf(", modeled card time %.2f s (%.1f%% of the control core)", cardUs / 1e6, 100.0 * cardUs / 1e6 / max(audioS, 1e-9));
+  printf("\n");
+  SectorCache& sc = Sampler.getSectorCache();
+  if (sc.getCapacity() > 0) {
+    double saved = sc.getBytesSaved() / 1048576.0;
+    printf("RENDER: sector cache hit rate %.1f%% (%u of %u reads), %u evictions, saved %.2f MB (%.2f MB per audio second = %.1f voices of card bandwidth)\n",
+      sc.getHitRate() * 100.0, sc.getHits(), sc.getHits() + sc.getMisses(), sc.getEvictions(), saved, audioS > 0 ? saved / audioS : 0.0,
+      audioS > 0 ? sc.getBytesSaved() / audioS / (SAMPLE_RATE * 4.0) : 0.0);
+  }
+  uint64_t interpSum = 0;
+  for (int q = 0; q <= INTERP_COPY; q++) interpSum += Sampler.getInterpBlocks(q);
+  printf("RENDER: interpolation up to %s, budget %u us per block; voice blocks:", interpNames[Sampler.getInterpolation()], Sampler.getRenderBudget());
+  for (int q = 0; q < INTERP_TIERS; q++) printf(" %s %.1f%%,", interpNames[q], 100.0 * Sampler.getInterpBlocks(q) / max(interpSum, (uint64_t)1));
+  printf(" copy %.1f%%; learned us per voice and block:", 100.0 * Sampler.getInterpBlocks(INTERP_COPY) / max(interpSum, (uint64_t)1));
+  for (int q = 0; q < INTERP_TIERS; q++) printf(" %.2f", Sampler.getInterpCost(q));
+  printf("\n");
+  Sampler.printSchedStats();
+  printf("RENDER: written %s\n", outPath);
+  Card.end();
+  if (refPath && !compareWav(outPath, refPath, maxLsb)) return 2;
+  return 0;
+}
@@ -0,0 +1,51 @@
+// Storage profiler on Linux: the StorageBench of the sketch, reading a card image or a card reader device.
+//
+//   sd_bench [-d] [-k streams] [-t KB] [-s seed] <image or /dev/...>
+//
+//   -d   O_DIRECT, bypass the page cache (use it for real cards, an image would be measured in RAM otherwise)
+//   -k   concurrent streams of the "streams" pattern, MAX_POLYPHONY by default
+//   -t   KB read per pattern and size, BENCH_TOTAL_KB by default
+//   -s   random seed, the same seed gives the same requests on the board
+
+#include "host.h"
+#include "storage_bench.h"
+#include "storage_bench.ino"
+
+int main(int argc, char** argv) {
+  bool direct = false;
+  uint32_t streams = MAX_POLYPHONY;
+  uint32_t totalKB = BENCH_TOTAL_KB;
+  uint32_t seed = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "dk:t:s:")) != -1) {
+    switch (opt) {
+      case 'd': direct = true; break;
+      case 'k': streams = atoi(optarg); break;
+      case 't': totalKB = atoi(optarg); break;
+      case 's': seed = strtoul(optarg, nullptr, 0); break;
+      default:
+        fprintf(stderr, "usage: %s [-d] [-k streams] [-t KB] [-s seed] <image>\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-d] [-k streams] [-t KB] [-s seed] <image>\n", argv[0]);
+    return 1;
+  }
+  SDMMC_FAT32 Card;
+  FileDevice Image(argv[optind], false, direct);
+  Card.begin(&Image);
+  if (Image.getSectors() == 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if (Card.ret != ESP_OK) {
+    fprintf(stderr, "%s: no FAT32/exFAT partition\n", argv[optind]);
+    return 1;
+  }
+  StorageBench Bench(&Card);
+  if (seed) Bench.setSeed(seed);
+  Bench.run(totalKB, streams);
+  Card.end();
+  return 0;
+}
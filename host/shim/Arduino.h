@@ -0,0 +1,95 @@
+#pragma once
+// Just enough of the Arduino-ESP32 core for the sampler sources to build and run on Linux.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <assert.h>
+#include "esp_err.h"
+#include <algorithm>
+#include <vector>
+
+using std::min;
+using std::max;
+typedef uint8_t byte;
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define WORD_ALIGNED_ATTR __attribute__((aligned(4)))
+#define INPUT 0
+
+#define bitRead(value, bit)   (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit)    ((value) |= (1UL << (bit)))
+#define bitClear(value, bit)  ((value) &= ~(1UL << (bit)))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define PI          3.1415926535897932384626433832795
+#define TWO_PI      6.283185307179586476925286766559
+
+static inline uint32_t micros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+static inline uint32_t millis()               { return micros() / 1000; }
+static inline void delay(uint32_t)            {}
+static inline long random(long howbig)        { return howbig > 0 ? ::random() % howbig : 0; }
+static inline long random(long lo, long hi)   { return lo + random(hi - lo); }
+static inline void randomSeed(unsigned long s){ srandom(s); }
+static inline int analogRead(int)             { return 0; }
+static inline void pinMode(int, int)          {}
+static inline void taskYIELD()                 {}  // single thread: the command queue is drained before every block
+
+// heap_caps_malloc() of esp_heap_caps.h, aligned for O_DIRECT. The PSRAM is that of an 8 MB module (HOST_PSRAM_KB),
+// counted but never given back, like the caches that keep it for good
+#define MALLOC_CAP_INTERNAL   (1 << 0)
+#define MALLOC_CAP_DMA        (1 << 1)
+#define MALLOC_CAP_SPIRAM     (1 << 2)
+#define MALLOC_CAP_8BIT       (1 << 3)
+#ifndef HOST_PSRAM_KB
+  #define HOST_PSRAM_KB       8192
+#endif
+static size_t hostPsramUsed = 0;
+static inline void* heap_caps_malloc(size_t size, uint32_t caps) {
+  void* p = nullptr;
+  if (caps & MALLOC_CAP_SPIRAM) {
+    if (hostPsramUsed + size > (size_t)HOST_PSRAM_KB * 1024) return nullptr;
+    hostPsramUsed += size;
+  }
+  return posix_memalign(&p, 4096, size ? size : 1) == 0 ? p : nullptr;
+}
+static inline void heap_caps_free(void* p)    { free(p); }
+static inline size_t heap_caps_get_free_size(uint32_t caps) {
+  return (caps & MALLOC_CAP_SPIRAM) ? (size_t)HOST_PSRAM_KB * 1024 - hostPsramUsed : (size_t)256 * 1024;
+}
+static inline size_t heap_caps_get_largest_free_block(uint32_t caps) { return heap_caps_get_free_size(caps); }
+
+// DEBUG_PORT of misc.h
+struct HostSerial {
+  void begin(long) {}
+  int printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    return n;
+  }
+  void print(const char* s)     { fputs(s, stdout); }
+  void print(char c)            { putchar(c); }
+  void print(int v)             { printf("%d", v); }
+  void print(unsigned v)        { printf("%u", v); }
+  void print(long v)            { printf("%ld", v); }
+  void print(double v)          { printf("%.2f", v); }
+  void println(const char* s)   { printf("%s\n", s); }
+  void println(int v)           { printf("%d\n", v); }
+  void println(unsigned v)      { printf("%u\n", v); }
+  void println(long v)          { printf("%ld\n", v); }
+  void println(double v)        { printf("%.2f\n", v); }
+  void println()                { putchar(10); }
+};
+extern HostSerial Serial;